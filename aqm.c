@@ -0,0 +1,542 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "openconnect-internal.h"
+
+/*
+ * Active queue management for packets read from the tun device and
+ * waiting for the transport (CSTP, DTLS or ESP) to send them.
+ *
+ * Without it, vpninfo->outgoing_queue is a plain FIFO. With it, packets
+ * are held here instead and the transports fetch them through
+ * dequeue_outgoing_packet(). Anything they can't send is still put back
+ * on vpninfo->outgoing_queue with requeue_packet(), and is taken from
+ * there first next time round.
+ *
+ * The dropping is CoDel (RFC8289): if packets have spent longer than
+ * 'target' in the queue for at least 'interval', start dropping at the
+ * head, at a rate which increases with the square root of the number of
+ * drops until the sojourn time comes back down. FQ-CoDel (RFC8290) runs
+ * a separate CoDel instance for each of a number of queues selected by
+ * hashing the 5-tuple, and serves them by deficit round-robin with new
+ * flows first, so sparse interactive flows don't wait behind bulk ones.
+ * Plain CoDel is just the degenerate case with a single queue.
+ *
+ * In front of that there may be strict priority bands, selected by the
+ * DSCP of each packet through vpninfo->dscp_band[]. By default EF, CS6
+ * and CS7 go ahead of everything else, and CS1 and LE behind it. Each
+ * band has its own set of queues, which are plain FIFOs if CoDel isn't
+ * enabled. Since all of this happens before the transport sees the
+ * packet, it works the same for CSTP, DTLS and ESP.
+ */
+
+#define AQM_TARGET_US		5000
+#define AQM_INTERVAL_US		100000
+#define AQM_FQ_FLOWS		256
+
+/* With AQM, keep most of the standing queue here where we can see it,
+   not in the TCP socket's send buffer. */
+#define AQM_NOTSENT_LOWAT	32768
+
+struct codel_vars {
+	uint64_t first_above_time;
+	uint64_t drop_next;
+	uint32_t count;
+	uint32_t lastcount;
+	int dropping;
+};
+
+struct aqm_flow {
+	struct pkt_q q;
+	int band;
+	int backlog;		/* Bytes */
+	int deficit;
+	int listed;
+	struct aqm_flow *next;
+	struct codel_vars cvars;
+};
+
+struct aqm_flow_list {
+	struct aqm_flow *head;
+	struct aqm_flow *tail;
+};
+
+struct aqm_band {
+	int count;
+	struct aqm_flow *flows;
+	struct aqm_flow_list new_flows;
+	struct aqm_flow_list old_flows;
+
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t drops;
+};
+
+struct oc_aqm {
+	int nr_bands;
+	int nr_flows;		/* In each band */
+	int codel;
+	int quantum;
+	uint32_t perturbation;
+	int count;		/* Packets in all flows */
+	struct aqm_band bands[AQM_NR_BANDS];
+
+	uint64_t codel_drops;
+	uint64_t overlimit_drops;
+	uint64_t dequeued;
+	uint64_t sojourn_total;
+	uint64_t sojourn_max;
+
+	struct aqm_flow flows[];
+};
+
+uint64_t monotonic_usec(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+}
+
+static uint32_t int_sqrt(uint64_t x)
+{
+	uint64_t res = 0, bit = 1ULL << 62;
+
+	while (bit > x)
+		bit >>= 2;
+
+	while (bit) {
+		if (x >= res + bit) {
+			x -= res + bit;
+			res = (res >> 1) + bit;
+		} else
+			res >>= 1;
+		bit >>= 2;
+	}
+	return res;
+}
+
+/* interval / sqrt(count), in fixed point to avoid needing libm */
+static uint64_t codel_control_law(uint64_t t, uint32_t count)
+{
+	return t + (uint64_t)AQM_INTERVAL_US * 1024 / int_sqrt((uint64_t)count << 20);
+}
+
+static uint32_t flow_hash(struct oc_aqm *aqm, const struct pkt *pkt)
+{
+	const unsigned char *p = pkt->data;
+	uint32_t h = 2166136261U ^ aqm->perturbation;
+	int i, addrofs, addrlen, proto, l4 = 0;
+
+	if (pkt->len >= 20 && (p[0] >> 4) == 4) {
+		addrofs = 12;
+		addrlen = 8;
+		proto = p[9];
+		/* Ports only if this isn't a non-initial fragment */
+		if (!(load_be16(p + 6) & 0x1fff))
+			l4 = (p[0] & 0x0f) * 4;
+	} else if (pkt->len >= 40 && (p[0] >> 4) == 6) {
+		addrofs = 8;
+		addrlen = 32;
+		proto = p[6];
+		l4 = 40;
+	} else
+		return 0;
+
+	for (i = 0; i < addrlen; i++)
+		h = (h ^ p[addrofs + i]) * 16777619U;
+	h = (h ^ proto) * 16777619U;
+
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && l4 && l4 + 4 <= pkt->len)
+		for (i = 0; i < 4; i++)
+			h = (h ^ p[l4 + i]) * 16777619U;
+
+	return h;
+}
+
+static void flow_list_add(struct aqm_flow_list *l, struct aqm_flow *f)
+{
+	f->next = NULL;
+	if (l->tail)
+		l->tail->next = f;
+	else
+		l->head = f;
+	l->tail = f;
+}
+
+static struct aqm_flow *flow_list_pop(struct aqm_flow_list *l)
+{
+	struct aqm_flow *f = l->head;
+
+	l->head = f->next;
+	if (!l->head)
+		l->tail = NULL;
+	return f;
+}
+
+static void aqm_drop(struct openconnect_info *vpninfo, struct aqm_flow *f, struct pkt *pkt)
+{
+	vpninfo->aqm->bands[f->band].drops++;
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("AQM dropped outgoing packet of %d bytes\n"), pkt->len);
+	free(pkt);
+}
+
+static struct pkt *flow_dequeue(struct oc_aqm *aqm, struct aqm_flow *f)
+{
+	struct pkt *pkt = dequeue_packet(&f->q);
+
+	if (pkt) {
+		f->backlog -= pkt->len;
+		aqm->bands[f->band].count--;
+		aqm->count--;
+	}
+	return pkt;
+}
+
+static int codel_should_drop(struct openconnect_info *vpninfo, struct aqm_flow *f,
+			     struct pkt *pkt, uint64_t now)
+{
+	struct oc_aqm *aqm = vpninfo->aqm;
+	uint64_t sojourn;
+
+	if (!pkt) {
+		f->cvars.first_above_time = 0;
+		return 0;
+	}
+
+	sojourn = now - pkt->tstamp;
+	aqm->sojourn_total += sojourn;
+	if (sojourn > aqm->sojourn_max)
+		aqm->sojourn_max = sojourn;
+
+	if (!aqm->codel || sojourn < AQM_TARGET_US || f->backlog <= vpninfo->ip_info.mtu) {
+		f->cvars.first_above_time = 0;
+		return 0;
+	}
+	if (!f->cvars.first_above_time) {
+		f->cvars.first_above_time = now + AQM_INTERVAL_US;
+		return 0;
+	}
+	return now >= f->cvars.first_above_time;
+}
+
+static struct pkt *codel_dequeue(struct openconnect_info *vpninfo, struct aqm_flow *f)
+{
+	struct oc_aqm *aqm = vpninfo->aqm;
+	struct codel_vars *v = &f->cvars;
+	uint64_t now = monotonic_usec();
+	struct pkt *pkt = flow_dequeue(aqm, f);
+	int drop = codel_should_drop(vpninfo, f, pkt, now);
+
+	if (v->dropping) {
+		if (!drop) {
+			v->dropping = 0;
+		} else {
+			while (v->dropping && now >= v->drop_next) {
+				aqm_drop(vpninfo, f, pkt);
+				aqm->codel_drops++;
+				v->count++;
+				pkt = flow_dequeue(aqm, f);
+				if (!codel_should_drop(vpninfo, f, pkt, now))
+					v->dropping = 0;
+				else
+					v->drop_next = codel_control_law(v->drop_next, v->count);
+			}
+		}
+	} else if (drop) {
+		uint32_t delta;
+
+		aqm_drop(vpninfo, f, pkt);
+		aqm->codel_drops++;
+		pkt = flow_dequeue(aqm, f);
+		codel_should_drop(vpninfo, f, pkt, now);
+
+		v->dropping = 1;
+		/* If we were dropping recently, resume near the old rate */
+		delta = v->count - v->lastcount;
+		if (delta > 1 && now - v->drop_next < 16 * AQM_INTERVAL_US)
+			v->count = delta;
+		else
+			v->count = 1;
+		v->lastcount = v->count;
+		v->drop_next = codel_control_law(now, v->count);
+	}
+	return pkt;
+}
+
+void aqm_default_dscp_bands(struct openconnect_info *vpninfo)
+{
+	memset(vpninfo->dscp_band, AQM_BAND_NORMAL, sizeof(vpninfo->dscp_band));
+	vpninfo->dscp_band[DSCP_EF] = AQM_BAND_HIGH;
+	vpninfo->dscp_band[DSCP_CS6] = AQM_BAND_HIGH;
+	vpninfo->dscp_band[DSCP_CS7] = AQM_BAND_HIGH;
+	vpninfo->dscp_band[DSCP_CS1] = AQM_BAND_LOW;
+	vpninfo->dscp_band[DSCP_LE] = AQM_BAND_LOW;
+}
+
+static int pkt_dscp(const struct pkt *pkt)
+{
+	if (pkt->len < 2)
+		return 0;
+
+	switch (pkt->data[0] >> 4) {
+	case 4:
+		return pkt->data[1] >> 2;
+	case 6:
+		return (load_be16(pkt->data) >> 6) & 0x3f;
+	default:
+		return 0;
+	}
+}
+
+static int aqm_init(struct openconnect_info *vpninfo)
+{
+	int nr_bands = vpninfo->dscp_prio ? AQM_NR_BANDS : 1;
+	int nr_flows = vpninfo->aqm_mode == AQM_FQ_CODEL ? AQM_FQ_FLOWS : 1;
+	struct oc_aqm *aqm;
+	int i;
+
+	aqm = calloc(1, sizeof(*aqm) + nr_bands * nr_flows * sizeof(aqm->flows[0]));
+	if (!aqm)
+		return -ENOMEM;
+
+	aqm->nr_bands = nr_bands;
+	aqm->nr_flows = nr_flows;
+	aqm->codel = vpninfo->aqm_mode != AQM_NONE;
+	aqm->quantum = vpninfo->ip_info.mtu ? : 1500;
+	if (openconnect_random(&aqm->perturbation, sizeof(aqm->perturbation)))
+		aqm->perturbation = monotonic_usec();
+	for (i = 0; i < nr_bands * nr_flows; i++) {
+		init_pkt_queue(&aqm->flows[i].q);
+		aqm->flows[i].band = i / nr_flows;
+	}
+	for (i = 0; i < nr_bands; i++)
+		aqm->bands[i].flows = &aqm->flows[i * nr_flows];
+
+	vpninfo->aqm = aqm;
+	return 0;
+}
+
+void aqm_free(struct openconnect_info *vpninfo)
+{
+	struct oc_aqm *aqm = vpninfo->aqm;
+	struct pkt *pkt;
+	int i;
+
+	if (!aqm)
+		return;
+
+	for (i = 0; i < aqm->nr_bands * aqm->nr_flows; i++)
+		while ((pkt = dequeue_packet(&aqm->flows[i].q)))
+			free(pkt);
+
+	free(aqm);
+	vpninfo->aqm = NULL;
+}
+
+/* Returns the number of packets now queued */
+int queue_outgoing_packet(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	struct oc_aqm *aqm = vpninfo->aqm;
+	struct aqm_band *band;
+	struct aqm_flow *f;
+
+	if (!aqm) {
+		if ((vpninfo->aqm_mode == AQM_NONE && !vpninfo->dscp_prio) ||
+		    aqm_init(vpninfo))
+			return queue_packet(&vpninfo->outgoing_queue, pkt);
+		aqm = vpninfo->aqm;
+	}
+
+	pkt->tstamp = monotonic_usec();
+	band = &aqm->bands[aqm->nr_bands > 1 ? vpninfo->dscp_band[pkt_dscp(pkt)] : 0];
+	f = &band->flows[aqm->nr_flows > 1 ? flow_hash(aqm, pkt) % aqm->nr_flows : 0];
+	queue_packet(&f->q, pkt);
+	f->backlog += pkt->len;
+	band->count++;
+	band->pkts++;
+	band->bytes += pkt->len;
+	aqm->count++;
+
+	if (!f->listed) {
+		f->listed = 1;
+		f->deficit = aqm->quantum;
+		flow_list_add(&band->new_flows, f);
+	}
+
+	/* Over the limit; drop from the head of the fattest queue in the
+	   lowest priority band that has anything. Without CoDel we never
+	   get here, as tun_mainloop() stops reading when the queue is full. */
+	if (aqm->codel && aqm->count + vpninfo->outgoing_queue.count > vpninfo->max_qlen) {
+		struct aqm_flow *fat;
+		int i;
+
+		band = &aqm->bands[aqm->nr_bands - 1];
+		while (!band->count)
+			band--;
+
+		fat = &band->flows[0];
+		for (i = 1; i < aqm->nr_flows; i++)
+			if (band->flows[i].backlog > fat->backlog)
+				fat = &band->flows[i];
+
+		aqm_drop(vpninfo, fat, flow_dequeue(aqm, fat));
+		aqm->overlimit_drops++;
+	}
+
+	return outgoing_queue_len(vpninfo);
+}
+
+static struct pkt *band_dequeue(struct openconnect_info *vpninfo, struct aqm_band *band)
+{
+	struct oc_aqm *aqm = vpninfo->aqm;
+	struct pkt *pkt;
+
+	while (1) {
+		struct aqm_flow_list *l;
+		struct aqm_flow *f;
+
+		if (band->new_flows.head)
+			l = &band->new_flows;
+		else if (band->old_flows.head)
+			l = &band->old_flows;
+		else
+			return NULL;
+
+		f = l->head;
+		if (f->deficit <= 0) {
+			f->deficit += aqm->quantum;
+			flow_list_add(&band->old_flows, flow_list_pop(l));
+			continue;
+		}
+
+		pkt = codel_dequeue(vpninfo, f);
+		if (!pkt) {
+			flow_list_pop(l);
+			/* Don't let an emptied new flow jump straight back
+			   ahead of the old ones if it becomes active again */
+			if (l == &band->new_flows && band->old_flows.head)
+				flow_list_add(&band->old_flows, f);
+			else
+				f->listed = 0;
+			continue;
+		}
+
+		f->deficit -= pkt->len;
+		return pkt;
+	}
+}
+
+static struct pkt *aqm_dequeue(struct openconnect_info *vpninfo)
+{
+	struct oc_aqm *aqm = vpninfo->aqm;
+	struct pkt *pkt;
+	int i;
+
+	/* Packets the transport couldn't send last time go first */
+	pkt = dequeue_packet(&vpninfo->outgoing_queue);
+	if (pkt || !aqm)
+		return pkt;
+
+	for (i = 0; i < aqm->nr_bands; i++) {
+		/* CoDel may drop everything that was in this band */
+		pkt = band_dequeue(vpninfo, &aqm->bands[i]);
+		if (pkt) {
+			aqm->dequeued++;
+			return pkt;
+		}
+	}
+	return NULL;
+}
+
+struct pkt *dequeue_outgoing_packet(struct openconnect_info *vpninfo)
+{
+	struct pkt *pkt;
+
+	/* A GSO super-packet from the tun device is queued (and scheduled)
+	   whole, and only split up when the transport is ready for it. The
+	   remaining segments go back on vpninfo->outgoing_queue. */
+	while ((pkt = aqm_dequeue(vpninfo)) && pkt->gso_size) {
+		pkt = gso_segment(vpninfo, pkt);
+		if (pkt)
+			break;
+	}
+	return pkt;
+}
+
+int outgoing_queue_len(struct openconnect_info *vpninfo)
+{
+	return vpninfo->outgoing_queue.count +
+		(vpninfo->aqm ? vpninfo->aqm->count : 0);
+}
+
+void aqm_setup_socket(struct openconnect_info *vpninfo, int fd)
+{
+#ifdef TCP_NOTSENT_LOWAT
+	int lowat = AQM_NOTSENT_LOWAT;
+
+	if (vpninfo->aqm_mode != AQM_NONE &&
+	    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void *)&lowat, sizeof(lowat)))
+		vpn_perror(vpninfo, _("Set TCP_NOTSENT_LOWAT"));
+#endif
+}
+
+void aqm_report_stats(struct openconnect_info *vpninfo)
+{
+	static const char * const band_names[AQM_NR_BANDS] = { "high", "normal", "low" };
+	struct oc_aqm *aqm = vpninfo->aqm;
+	int i;
+
+	if (!aqm)
+		return;
+
+	if (aqm->codel)
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("AQM: %llu packets sent, %llu CoDel drops, %llu overlimit drops, sojourn avg %llu us max %llu us\n"),
+			     (unsigned long long)aqm->dequeued,
+			     (unsigned long long)aqm->codel_drops,
+			     (unsigned long long)aqm->overlimit_drops,
+			     (unsigned long long)(aqm->dequeued + aqm->codel_drops ?
+						  aqm->sojourn_total / (aqm->dequeued + aqm->codel_drops) : 0),
+			     (unsigned long long)aqm->sojourn_max);
+
+	if (aqm->nr_bands > 1)
+		for (i = 0; i < aqm->nr_bands; i++)
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Priority band %s: %llu packets, %llu bytes, %llu dropped\n"),
+				     band_names[i],
+				     (unsigned long long)aqm->bands[i].pkts,
+				     (unsigned long long)aqm->bands[i].bytes,
+				     (unsigned long long)aqm->bands[i].drops);
+}
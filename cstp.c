@@ -724,9 +724,10 @@ int cstp_connect(struct openconnect_info *vpninfo)
 	return ret;
 }
 
-static int cstp_reconnect(struct openconnect_info *vpninfo)
+static int cstp_reconnect(struct openconnect_info *vpninfo, int *timeout)
 {
-	if (vpninfo->cstp_compr == COMPR_DEFLATE) {
+	/* Only when the reconnection starts, not each time we're polled */
+	if (!vpninfo->reconnect_pending && vpninfo->cstp_compr == COMPR_DEFLATE) {
 		/* Requeue the original packet that was deflated */
 		if (vpninfo->current_ssl_pkt == vpninfo->deflate_pkt) {
 			vpninfo->current_ssl_pkt = NULL;
@@ -737,7 +738,7 @@ static int cstp_reconnect(struct openconnect_info *vpninfo)
 		deflateEnd(&vpninfo->deflate_strm);
 	}
 
-	return ssl_reconnect(vpninfo);
+	return ssl_reconnect(vpninfo, timeout);
 }
 
 int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
@@ -906,6 +907,11 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		int receive_mtu = MAX(16384, vpninfo->deflate_pkt_size ? : vpninfo->ip_info.mtu);
 		int len, payload_len;
 
+		if (incoming_queue_full(vpninfo)) {
+			unmonitor_read_fd(vpninfo, ssl);
+			break;
+		}
+
 		if (!vpninfo->cstp_pkt) {
 			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + receive_mtu);
 			if (!vpninfo->cstp_pkt) {
@@ -1098,7 +1104,9 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("CSTP Dead Peer Detection detected dead peer!\n"));
 	do_reconnect:
-		ret = cstp_reconnect(vpninfo);
+		ret = cstp_reconnect(vpninfo, timeout);
+		if (ret == -EAGAIN)
+			return work_done;
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 			vpninfo->quit_reason = "CSTP reconnect failed";
@@ -1125,7 +1133,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		/* No need to send an explicit keepalive
 		   if we have real data to send */
 		if (vpninfo->dtls_state != DTLS_CONNECTED &&
-		    vpninfo->outgoing_queue.head)
+		    outgoing_queue_len(vpninfo))
 			break;
 
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send CSTP Keepalive\n"));
@@ -1139,7 +1147,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	/* Service outgoing packet queue, if no DTLS */
 	while (vpninfo->dtls_state != DTLS_CONNECTED &&
-	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
+	       (vpninfo->current_ssl_pkt = dequeue_outgoing_packet(vpninfo))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
 		if (vpninfo->cstp_compr) {
@@ -170,6 +170,7 @@ void dtls_close(struct openconnect_info *vpninfo)
 		vpninfo->dtls_fd = -1;
 	}
 	vpninfo->dtls_state = DTLS_SLEEPING;
+	pmtud_stop(vpninfo);
 }
 
 static int dtls_reconnect(struct openconnect_info *vpninfo)
@@ -246,6 +247,7 @@ int dtls_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 
 int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
+	struct pkt *this;
 	int work_done = 0;
 	char magic_pkt;
 
@@ -273,9 +275,15 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	}
 
 	while (1) {
-		int len = vpninfo->ip_info.mtu;
+		int len = max_tunnel_mtu(vpninfo);
 		unsigned char *buf;
 
+		if (vpninfo->udp_drop_policy == UDP_DROP_NONE &&
+		    incoming_queue_full(vpninfo)) {
+			unmonitor_read_fd(vpninfo, dtls);
+			break;
+		}
+
 		if (!vpninfo->dtls_pkt) {
 			vpninfo->dtls_pkt = malloc(sizeof(struct pkt) + len);
 			if (!vpninfo->dtls_pkt) {
@@ -298,8 +306,8 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		switch (buf[0]) {
 		case AC_PKT_DATA:
 			vpninfo->dtls_pkt->len = len - 1;
-			queue_packet(&vpninfo->incoming_queue, vpninfo->dtls_pkt);
-			vpninfo->dtls_pkt = NULL;
+			if (!queue_incoming_udp_packet(vpninfo, vpninfo->dtls_pkt))
+				vpninfo->dtls_pkt = NULL;
 			work_done = 1;
 			break;
 
@@ -314,6 +322,11 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			continue;
 
 		case AC_PKT_DPD_RESP:
+			/* Our MTU probes carry an ID; plain DPD doesn't */
+			if (len >= 5) {
+				pmtud_probe_acked(vpninfo, load_be32(buf + 1));
+				break;
+			}
 			vpn_progress(vpninfo, PRG_DEBUG, _("Got DTLS DPD response\n"));
 			break;
 
@@ -350,6 +363,9 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		}
 	}
 
+	if (pmtud_mainloop(vpninfo, timeout))
+		work_done = 1;
+
 	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
 	case KA_REKEY: {
 		int ret;
@@ -391,7 +407,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	case KA_KEEPALIVE:
 		/* No need to send an explicit keepalive
 		   if we have real data to send */
-		if (vpninfo->outgoing_queue.head)
+		if (outgoing_queue_len(vpninfo))
 			break;
 
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send DTLS Keepalive\n"));
@@ -410,8 +426,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	/* Service outgoing packet queue */
 	unmonitor_write_fd(vpninfo, dtls);
-	while (vpninfo->outgoing_queue.head) {
-		struct pkt *this = dequeue_packet(&vpninfo->outgoing_queue);
+	while ((this = dequeue_outgoing_packet(vpninfo))) {
 		struct pkt *send_pkt = this;
 		int ret;
 
@@ -468,6 +483,13 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			if (ret == SSL_ERROR_WANT_WRITE) {
 				monitor_write_fd(vpninfo, dtls);
 				requeue_packet(&vpninfo->outgoing_queue, this);
+			} else if (ret == SSL_ERROR_SYSCALL && errno == EMSGSIZE) {
+				/* The socket has DF set, and the kernel has
+				   heard that the path MTU is smaller */
+				pmtud_too_big(vpninfo);
+				free(this);
+				work_done = 1;
+				continue;
 			} else if (ret != SSL_ERROR_WANT_READ) {
 				/* If it's a real error, kill the DTLS connection and
 				   requeue the packet to be sent over SSL */
@@ -483,7 +505,14 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		}
 #else /* GnuTLS */
 		ret = gnutls_record_send(vpninfo->dtls_ssl, &send_pkt->cstp.hdr[7], send_pkt->len + 1);
-		if (ret <= 0) {
+		if (ret == GNUTLS_E_LARGE_PACKET) {
+			/* EMSGSIZE, since the socket has DF set and the
+			   kernel has heard that the path MTU is smaller */
+			pmtud_too_big(vpninfo);
+			free(this);
+			work_done = 1;
+			continue;
+		} else if (ret <= 0) {
 			if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED) {
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("DTLS got write error: %s. Falling back to SSL\n"),
@@ -509,260 +538,29 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	return work_done;
 }
 
-#define MTU_ID_SIZE 4
-#define MTU_MAX_TRIES 10
-#define MTU_TIMEOUT_MS 2400
-
-/* Performs a binary search to detect MTU.
- * @buf: is preallocated with MTU size
- * @id: a unique ID for our DPD exchange
- *
- * Returns: new MTU or 0
- */
-static int detect_mtu_ipv4(struct openconnect_info *vpninfo, unsigned char *buf)
-{
-	int max, min, cur, ret, orig_min;
-	int tries = 0; /* Number of loops in bin search - includes resends */
-	char id[MTU_ID_SIZE];
-
-	cur = max = vpninfo->ip_info.mtu;
-	orig_min = min = vpninfo->ip_info.mtu/2;
-
-	vpn_progress(vpninfo, PRG_DEBUG,
-		     _("Initiating IPv4 MTU detection (min=%d, max=%d)\n"), min, max);
-
-	while (max > min) {
-		/* Common case will be that the negotiated MTU is correct.
-		   So try that first. Then search lower values. */
-		if (!tries)
-			cur = max;
-		else
-			cur = (min + max + 1) / 2;
-
-	next_rnd:
-		/* Generate unique ID */
-		if (openconnect_random(id, sizeof(id)) < 0)
-			goto fail;
-
-	next_nornd:
-		if (tries++ >= MTU_MAX_TRIES) {
-			if (orig_min == min) {
-				/* Hm, we never got *anything* back successfully? */
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Too long time in MTU detect loop; assuming negotiated MTU.\n"));
-				goto fail;
-			} else {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Too long time in MTU detect loop; MTU set to %d.\n"), min);
-				return min;
-			}
-		}
-
-		buf[0] = AC_PKT_DPD_OUT;
-		memcpy(&buf[1], id, sizeof(id));
-
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Sending MTU DPD probe (%u bytes, min=%u, max=%u)\n"), cur, min, max);
-		ret = openconnect_dtls_write(vpninfo, buf, cur+1);
-		if (ret != cur+1) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Failed to send DPD request (%d %d)\n"), cur, ret);
-			/* If it didn't even manage to send, it took basically zero time.
-			   So don't count it as a 'try' for the purpose of our timeout. */
-			max = --cur;
-			tries--;
-			goto next_rnd;
-		}
-
-	reread:
-		memset(buf, 0, sizeof(id)+1);
-
-		ret = openconnect_dtls_read(vpninfo, buf, cur+1, MTU_TIMEOUT_MS);
-		if (ret > 0 && (buf[0] != AC_PKT_DPD_RESP || memcmp(&buf[1], id, sizeof(id)) != 0)) {
-			vpn_progress(vpninfo, PRG_DEBUG,
-			     _("Received unexpected packet (%.2x) in MTU detection; skipping.\n"), (unsigned)buf[0]);
-			goto reread;
-		}
-
-		/* Timeout. Either it was too large, or it just got lost. Try again
-		 * with a smaller value, but don't actually reduce 'max' because we
-		 * don't *know* it was too large. */
-		if (ret == -ETIMEDOUT) {
-			int next = (min + cur + 1) / 2;
-
-			if (next < cur && next > min) {
-				vpn_progress(vpninfo, PRG_DEBUG,
-					     _("Timeout while waiting for DPD response; trying %d\n"),
-					     next);
-				cur = next;
-				/* We don't set 'max' because we don't *know* it won't get through */
-				goto next_rnd;
-			} else {
-				vpn_progress(vpninfo, PRG_DEBUG,
-					     _("Timeout while waiting for DPD response; resending probe.\n"));
-				goto next_nornd;
-			}
-		}
-
-		if (ret <= 0) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Failed to recv DPD request (%d)\n"), cur);
-			goto fail;
-		}
-
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Received MTU DPD probe (%u bytes of %u)\n"), ret, cur);
-
-		/* If we reached the max, success */
-		if (cur == max)
-			break;
-
-		min = cur;
-	}
-
-	return cur;
- fail:
- 	return 0;
-}
-
-#if defined(IPPROTO_IPV6)
-
-/* This symbol is missing in glibc < 2.22 (bug 18643). */
-#if defined(__linux__) && !defined(HAVE_IPV6_PATHMTU)
-# define HAVE_IPV6_PATHMTU 1
-# define IPV6_PATHMTU 61
-#endif
-
-/* Verifies whether current MTU is ok, or detects new MTU using IPv6's ICMP6 messages
- * @buf: is preallocated with MTU size
- * @id: a unique ID for our DPD exchange
- *
- * Returns: new MTU or 0
- */
-static int detect_mtu_ipv6(struct openconnect_info *vpninfo, unsigned char *buf)
-{
-	int max, cur, ret;
-	int max_resends = 5; /* maximum number of resends */
-	char id[MTU_ID_SIZE];
-	unsigned re_use_rnd_val = 0;
-
-	cur = max = vpninfo->ip_info.mtu;
-
-	vpn_progress(vpninfo, PRG_DEBUG,
-	     _("Initiating IPv6 MTU detection\n"));
-
-	while(max_resends-- > 0) {
-		/* generate unique ID */
-		if (!re_use_rnd_val) {
-			if (openconnect_random(id, sizeof(id)) < 0)
-				goto fail;
-		} else {
-			re_use_rnd_val = 0;
-		}
-
-		buf[0] = AC_PKT_DPD_OUT;
-		memcpy(&buf[1], id, sizeof(id));
-
-		vpn_progress(vpninfo, PRG_TRACE,
-		     _("Sending MTU DPD probe (%u bytes)\n"), cur);
-		ret = openconnect_dtls_write(vpninfo, buf, cur+1);
-		if (ret != cur+1) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Failed to send DPD request (%d)\n"), cur);
-			goto mtu6_fail;
-		}
-
- reread:
-		memset(buf, 0, sizeof(id)+1);
-		ret = openconnect_dtls_read(vpninfo, buf, cur+1, MTU_TIMEOUT_MS);
-
-		/* timeout, probably our original request was lost,
-		 * let's resend the DPD */
-		if (ret == -ETIMEDOUT) {
-			vpn_progress(vpninfo, PRG_DEBUG,
-			     _("Timeout while waiting for DPD response; resending probe.\n"));
-			re_use_rnd_val = 1;
-			continue;
-		}
-
-		/* something unexpected was received, let's ignore it */
-		if (ret > 0 && (buf[0] != AC_PKT_DPD_RESP || memcmp(&buf[1], id, sizeof(id)) != 0)) {
-			vpn_progress(vpninfo, PRG_DEBUG,
-			     _("Received unexpected packet (%.2x) in MTU detection; skipping.\n"), (unsigned)buf[0]);
-			goto reread;
-		}
-
-		vpn_progress(vpninfo, PRG_TRACE,
-		     _("Received MTU DPD probe (%u bytes)\n"), cur);
-
-		/* we received what we expected, move on */
-		break;
-	}
-
-#ifdef HAVE_IPV6_PATHMTU
-	/* If we received back our DPD packet, do nothing; otherwise,
-	 * attempt to get MTU from the ICMP6 packet we received */
-	if (ret <= 0) {
-		struct ip6_mtuinfo mtuinfo;
-		socklen_t len = sizeof(mtuinfo);
-		max = 0;
-		vpn_progress(vpninfo, PRG_ERR,
-		     _("Failed to recv DPD request (%d)\n"), cur);
- mtu6_fail:
-		if (getsockopt(vpninfo->dtls_fd, IPPROTO_IPV6, IPV6_PATHMTU, &mtuinfo, &len) >= 0) {
-			max = mtuinfo.ip6m_mtu;
-			if (max >= 0 && max < cur) {
-				cur = dtls_set_mtu(vpninfo, max) - /*ipv6*/40 - /*udp*/20 - /*oc dtls*/1;
-			}
-		}
-	}
-#else
- mtu6_fail:
-#endif
-
-	return cur;
- fail:
-	return 0;
-}
-#endif
-
-void dtls_detect_mtu(struct openconnect_info *vpninfo)
+/* A DPD request padded to 'size' bytes of tunnel MTU, which the server
+   echoes back. The first four bytes of payload identify it. */
+int dtls_send_mtu_probe(struct openconnect_info *vpninfo, int size, uint32_t id)
 {
-	int mtu = vpninfo->ip_info.mtu;
-	int prev_mtu = vpninfo->ip_info.mtu;
 	unsigned char *buf;
+	int ret;
 
-	if (vpninfo->ip_info.mtu < 1+MTU_ID_SIZE)
-		return;
+	if (size < 4)
+		return -EINVAL;
 
-	/* detect MTU */
-	buf = calloc(1, 1 + vpninfo->ip_info.mtu);
-	if (!buf) {
-		vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
-		return;
-	}
+	buf = calloc(1, size + 1);
+	if (!buf)
+		return -ENOMEM;
 
-	if (vpninfo->peer_addr->sa_family == AF_INET) { /* IPv4 */
-		mtu = detect_mtu_ipv4(vpninfo, buf);
-		if (mtu == 0)
-			goto skip_mtu;
-#if defined(IPPROTO_IPV6)
-	} else if (vpninfo->peer_addr->sa_family == AF_INET6) { /* IPv6 */
-		mtu = detect_mtu_ipv6(vpninfo, buf);
-		if (mtu == 0)
-			goto skip_mtu;
-#endif
-	}
+	buf[0] = AC_PKT_DPD_OUT;
+	store_be32(buf + 1, id);
+	ret = DTLS_SEND(vpninfo->dtls_ssl, buf, size + 1);
+	free(buf);
 
-	vpninfo->ip_info.mtu = mtu;
-	if (prev_mtu != vpninfo->ip_info.mtu) {
-		vpn_progress(vpninfo, PRG_INFO,
-		     _("Detected MTU of %d bytes (was %d)\n"), vpninfo->ip_info.mtu, prev_mtu);
-	} else {
+	if (ret != size + 1) {
 		vpn_progress(vpninfo, PRG_DEBUG,
-		     _("No change in MTU after detection (was %d)\n"), prev_mtu);
+			     _("Failed to send MTU probe of %d bytes\n"), size);
+		return -EIO;
 	}
-
- skip_mtu:
-	free(buf);
+	return 0;
 }
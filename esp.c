@@ -35,11 +35,43 @@
 #else
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
 #endif
 
 #include "openconnect-internal.h"
 #include "lzo.h"
 
+#define ESP_GSO_MAX_BYTES	65507	/* Largest UDP payload over IPv4 */
+#define ESP_GRO_BUFSIZE		65535
+
+#define ESP_SA_OVERLAP		30	/* Seconds an old inbound SA stays valid */
+
+/* Ask the kernel to coalesce incoming ESP datagrams, and check whether
+   it will accept UDP_SEGMENT for sending batches of them. Both are only
+   optimisations, so neither is fatal if it's not supported. */
+static void esp_setup_offload(struct openconnect_info *vpninfo, int fd)
+{
+#ifdef UDP_SEGMENT
+	int segsize = 0;
+	socklen_t optlen = sizeof(segsize);
+
+	vpninfo->esp_udp_gso = !getsockopt(fd, IPPROTO_UDP, UDP_SEGMENT,
+					   (void *)&segsize, &optlen);
+#endif
+#ifdef UDP_GRO
+	{
+		int on = 1;
+
+		vpninfo->esp_udp_gro = !setsockopt(fd, IPPROTO_UDP, UDP_GRO,
+						   (void *)&on, sizeof(on));
+	}
+#endif
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("ESP UDP segmentation offload %s, receive coalescing %s\n"),
+		     vpninfo->esp_udp_gso ? _("enabled") : _("disabled"),
+		     vpninfo->esp_udp_gro ? _("enabled") : _("disabled"));
+}
+
 int print_esp_keys(struct openconnect_info *vpninfo, const char *name, struct esp *esp)
 {
 	int i;
@@ -94,6 +126,8 @@ int esp_send_probes(struct openconnect_info *vpninfo)
 		if (fd < 0)
 			return fd;
 
+		esp_setup_offload(vpninfo, fd);
+
 		/* We are not connected until we get an ESP packet back */
 		vpninfo->dtls_state = DTLS_SLEEPING;
 		vpninfo->dtls_fd = fd;
@@ -135,6 +169,63 @@ static uint16_t csum(uint16_t *buf, int nwords)
 	return htons((uint16_t)(~sum));
 }
 
+/* Magic payload which gets the GlobalProtect gateway to respond; see below */
+static const char gp_magic[16] = "monitor\x00\x00pan ha ";
+
+/* ICMP sequence number of our MTU probes, which also carry an ID */
+#define GP_MTU_PROBE_SEQ 0x8000
+
+/* Send an ICMP echo request of 'len' bytes of IP packet to the gateway */
+static int esp_send_ping_gp(struct openconnect_info *vpninfo, int len,
+			    uint16_t seq, const void *extra, int extra_len)
+{
+	int hdrlen = sizeof(struct ip) + ICMP_MINLEN;
+	struct pkt *pkt;
+	struct ip *iph;
+	struct icmp *icmph;
+	int pktlen, ret = 0;
+
+	if (len < hdrlen + sizeof(gp_magic) + extra_len)
+		return -EINVAL;
+
+	/* One spare byte for the checksum of an odd length */
+	pkt = calloc(1, sizeof(*pkt) + len + 1 + vpninfo->pkt_trailer);
+	if (!pkt)
+		return -ENOMEM;
+
+	iph = (void *)pkt->data;
+	icmph = (void *)(pkt->data + sizeof(*iph));
+	pkt->len = len;
+
+	/* IP Header */
+	iph->ip_hl = 5;
+	iph->ip_v = 4;
+	iph->ip_len = htons(len);
+	iph->ip_id = htons(0x4747); /* what the Windows client uses */
+	iph->ip_off = htons(IP_DF); /* don't fragment, frag offset = 0 */
+	iph->ip_ttl = 64; /* hops */
+	iph->ip_p = 1; /* ICMP */
+	iph->ip_src.s_addr = inet_addr(vpninfo->ip_info.addr);
+	iph->ip_dst.s_addr = vpninfo->esp_magic;
+	iph->ip_sum = csum((uint16_t *)iph, sizeof(*iph)/2);
+
+	/* ICMP echo request */
+	icmph->icmp_type = ICMP_ECHO;
+	icmph->icmp_hun.ih_idseq.icd_id = htons(0x4747);
+	icmph->icmp_hun.ih_idseq.icd_seq = htons(seq);
+	memcpy(pkt->data + hdrlen, gp_magic, sizeof(gp_magic)); /* required to get gateway to respond */
+	if (extra_len)
+		memcpy(pkt->data + hdrlen + sizeof(gp_magic), extra, extra_len);
+	icmph->icmp_cksum = csum((uint16_t *)icmph, (len - sizeof(*iph) + 1)/2);
+
+	pktlen = encrypt_esp_packet(vpninfo, pkt);
+	if (pktlen >= 0 && send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0) != pktlen)
+		ret = -errno;
+
+	free(pkt);
+	return ret;
+}
+
 int esp_send_probes_gp(struct openconnect_info *vpninfo)
 {
 	/* The GlobalProtect VPN initiates and maintains the ESP connection
@@ -155,21 +246,15 @@ int esp_send_probes_gp(struct openconnect_info *vpninfo)
 	 *
 	 *    Don't blame me. I didn't design this.
 	 */
-	static char magic[16] = "monitor\x00\x00pan ha ";
-
-	int pktlen, seq;
-	struct pkt *pkt = malloc(sizeof(*pkt) + sizeof(struct ip) + ICMP_MINLEN + sizeof(magic) + vpninfo->pkt_trailer);
-	struct ip *iph = (void *)pkt->data;
-	struct icmp *icmph = (void *)(pkt->data + sizeof(*iph));
-	char *pmagic = (void *)(pkt->data + sizeof(*iph) + ICMP_MINLEN);
-	if (!pkt)
-		return -ENOMEM;
+	int seq;
 
 	if (vpninfo->dtls_fd == -1) {
 		int fd = udp_connect(vpninfo);
 		if (fd < 0)
 			return fd;
 
+		esp_setup_offload(vpninfo, fd);
+
 		/* We are not connected until we get an ESP packet back */
 		vpninfo->dtls_state = DTLS_SLEEPING;
 		vpninfo->dtls_fd = fd;
@@ -178,41 +263,25 @@ int esp_send_probes_gp(struct openconnect_info *vpninfo)
 		monitor_except_fd(vpninfo, dtls);
 	}
 
-	for (seq=1; seq <= (vpninfo->dtls_state==DTLS_CONNECTED ? 1 : 3); seq++) {
-		memset(pkt, 0, sizeof(*pkt) + sizeof(*iph) + ICMP_MINLEN + sizeof(magic));
-		pkt->len = sizeof(struct ip) + ICMP_MINLEN + sizeof(magic);
-
-		/* IP Header */
-		iph->ip_hl = 5;
-		iph->ip_v = 4;
-		iph->ip_len = htons(sizeof(*iph) + ICMP_MINLEN + sizeof(magic));
-		iph->ip_id = htons(0x4747); /* what the Windows client uses */
-		iph->ip_off = htons(IP_DF); /* don't fragment, frag offset = 0 */
-		iph->ip_ttl = 64; /* hops */
-		iph->ip_p = 1; /* ICMP */
-		iph->ip_src.s_addr = inet_addr(vpninfo->ip_info.addr);
-		iph->ip_dst.s_addr = vpninfo->esp_magic;
-		iph->ip_sum = csum((uint16_t *)iph, sizeof(*iph)/2);
-
-		/* ICMP echo request */
-		icmph->icmp_type = ICMP_ECHO;
-		icmph->icmp_hun.ih_idseq.icd_id = htons(0x4747);
-		icmph->icmp_hun.ih_idseq.icd_seq = htons(seq);
-		memcpy(pmagic, magic, sizeof(magic)); /* required to get gateway to respond */
-		icmph->icmp_cksum = csum((uint16_t *)icmph, (ICMP_MINLEN+sizeof(magic))/2);
-
-		pktlen = encrypt_esp_packet(vpninfo, pkt);
-		if (pktlen >= 0)
-			send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
-	}
-
-	free(pkt);
+	for (seq=1; seq <= (vpninfo->dtls_state==DTLS_CONNECTED ? 1 : 3); seq++)
+		esp_send_ping_gp(vpninfo, sizeof(struct ip) + ICMP_MINLEN + sizeof(gp_magic),
+				 seq, NULL, 0);
 
 	vpninfo->dtls_times.last_tx = time(&vpninfo->new_dtls_started);
 
 	return 0;
 }
 
+/* The gateway echoes the whole payload, so pad the magic ping out to
+   the size we want to try, with the probe ID after the magic */
+int esp_send_mtu_probe_gp(struct openconnect_info *vpninfo, int size, uint32_t id)
+{
+	unsigned char idbuf[4];
+
+	store_be32(idbuf, id);
+	return esp_send_ping_gp(vpninfo, size, GP_MTU_PROBE_SEQ, idbuf, sizeof(idbuf));
+}
+
 int esp_catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
 	return (pkt->len == 1 && pkt->data[0] == 0);
@@ -221,11 +290,20 @@ int esp_catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt)
 int esp_catch_probe_gp(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
 	struct ip *iph = (void *)(pkt->data);
-	return ( pkt->len >= 21
-		 && iph->ip_p==1 /* IPv4 protocol field == ICMP */
-		 && iph->ip_src.s_addr == vpninfo->esp_magic /* source == magic address */
-		 && pkt->len >= (iph->ip_hl<<2)+1 /* No short-packet segfaults */
-		 && pkt->data[iph->ip_hl<<2]==0 /* ICMP reply */ );
+	int hlen;
+
+	if (!( pkt->len >= 21
+	       && iph->ip_p==1 /* IPv4 protocol field == ICMP */
+	       && iph->ip_src.s_addr == vpninfo->esp_magic /* source == magic address */
+	       && pkt->len >= (iph->ip_hl<<2)+1 /* No short-packet segfaults */
+	       && pkt->data[iph->ip_hl<<2]==0 /* ICMP reply */ ))
+		return 0;
+
+	hlen = (iph->ip_hl<<2) + ICMP_MINLEN;
+	if (pkt->len >= hlen + sizeof(gp_magic) + 4 &&
+	    load_be16(pkt->data + hlen - 2) == GP_MTU_PROBE_SEQ)
+		pmtud_probe_acked(vpninfo, load_be32(pkt->data + hlen + sizeof(gp_magic)));
+	return 1;
 }
 
 int esp_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
@@ -251,18 +329,388 @@ int esp_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 	return 0;
 }
 
+/* Pick a slot in the inbound SA table for new keys, and make it
+   current. The previous SA stays valid for ESP_SA_OVERLAP seconds, for
+   packets the server sent before it switched to the new keys. */
+struct esp *esp_new_sa_in(struct openconnect_info *vpninfo)
+{
+	struct esp *old = &vpninfo->esp_in[vpninfo->current_esp_in];
+	struct esp *esp;
+	int i, slot = -1;
+
+	if (old->cipher)
+		old->retire = time(NULL) + ESP_SA_OVERLAP;
+
+	/* An unused slot, or else the one which was retired first */
+	for (i = 0; i < ESP_NR_SA_IN; i++) {
+		esp = &vpninfo->esp_in[i];
+		if (i == vpninfo->current_esp_in)
+			continue;
+		if (!esp->cipher) {
+			slot = i;
+			break;
+		}
+		if (slot < 0 || esp->retire < vpninfo->esp_in[slot].retire)
+			slot = i;
+	}
+
+	esp = &vpninfo->esp_in[slot];
+	destroy_esp_ciphers(esp);
+	memset(esp, 0, sizeof(*esp));
+	vpninfo->current_esp_in = slot;
+	return esp;
+}
+
+static struct esp *esp_find_sa_in(struct openconnect_info *vpninfo, uint32_t spi)
+{
+	int i;
+
+	for (i = 0; i < ESP_NR_SA_IN; i++) {
+		struct esp *esp = &vpninfo->esp_in[i];
+
+		if (!esp->cipher || esp->spi != spi)
+			continue;
+
+		if (i != vpninfo->current_esp_in && time(NULL) >= esp->retire) {
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Discarding expired ESP SA with SPI 0x%08x\n"),
+				     (unsigned)ntohl(spi));
+			destroy_esp_ciphers(esp);
+			return NULL;
+		}
+		return esp;
+	}
+	return NULL;
+}
+
+/* Check, decrypt and queue an ESP packet of 'len' bytes received into
+   vpninfo->dtls_pkt. */
+static void esp_receive_packet(struct openconnect_info *vpninfo, int len, int receive_mtu)
+{
+	struct pkt *pkt = vpninfo->dtls_pkt;
+	struct esp *esp;
+	int i;
+
+	/* both supported algos (SHA1 and MD5) have 12-byte MAC lengths (RFC2403 and RFC2404) */
+	if (len <= sizeof(pkt->esp) + 12)
+		return;
+
+	len -= sizeof(pkt->esp) + 12;
+	pkt->len = len;
+
+	esp = esp_find_sa_in(vpninfo, pkt->esp.spi);
+	if (!esp) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Received ESP packet with invalid SPI 0x%08x\n"),
+			     (unsigned)ntohl(pkt->esp.spi));
+		return;
+	}
+	if (esp != &vpninfo->esp_in[vpninfo->current_esp_in])
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Received ESP packet from old SPI 0x%x, seq %u\n"),
+			     (unsigned)ntohl(esp->spi), (unsigned)ntohl(pkt->esp.seq));
+	if (decrypt_esp_packet(vpninfo, esp, pkt))
+		return;
+	esp->bytes += len;
+
+	/* Possible values of the Next Header field are:
+	   0x04: IP[v4]-in-IP
+	   0x05: supposed to mean Internet Stream Protocol
+	         (XXX: but used for LZO compressed packets by Juniper)
+	   0x29: IPv6 encapsulation */
+	if (pkt->data[len - 1] != 0x04 && pkt->data[len - 1] != 0x29 &&
+	    pkt->data[len - 1] != 0x05) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Received ESP packet with unrecognised payload type %02x\n"),
+			     pkt->data[len-1]);
+		return;
+	}
+
+	if (len <= 2 + pkt->data[len - 2]) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Invalid padding length %02x in ESP\n"),
+			     pkt->data[len - 2]);
+		return;
+	}
+	pkt->len = len - 2 - pkt->data[len - 2];
+	for (i = 0 ; i < pkt->data[len - 2]; i++) {
+		if (pkt->data[pkt->len + i] != i + 1)
+			break; /* We can't just 'return' here because it
+				* would only break out of this 'for' loop */
+	}
+	if (i != pkt->data[len - 2]) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Invalid padding bytes in ESP\n"));
+		return;
+	}
+	vpninfo->dtls_times.last_rx = time(NULL);
+
+	if (vpninfo->proto->udp_catch_probe) {
+		if (vpninfo->proto->udp_catch_probe(vpninfo, pkt)) {
+			if (vpninfo->dtls_state == DTLS_SLEEPING) {
+				vpn_progress(vpninfo, PRG_INFO,
+					     _("ESP session established with server\n"));
+				queue_esp_control(vpninfo, 1);
+				vpninfo->dtls_state = DTLS_CONNECTING;
+			}
+			return;
+		}
+	}
+	if (pkt->data[len - 1] == 0x05) {
+		struct pkt *newpkt = malloc(sizeof(*pkt) + receive_mtu + vpninfo->pkt_trailer);
+		int newlen = receive_mtu;
+		if (!newpkt) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to allocate memory to decrypt ESP packet\n"));
+			return;
+		}
+		if (av_lzo1x_decode(newpkt->data, &newlen,
+				    pkt->data, &pkt->len) || pkt->len) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("LZO decompression of ESP packet failed\n"));
+			free(newpkt);
+			return;
+		}
+		newpkt->len = receive_mtu - newlen;
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("LZO decompressed %d bytes into %d\n"),
+			     len - 2 - pkt->data[len-2], newpkt->len);
+		if (queue_incoming_udp_packet(vpninfo, newpkt))
+			free(newpkt);
+	} else {
+		if (!queue_incoming_udp_packet(vpninfo, pkt))
+			vpninfo->dtls_pkt = NULL;
+	}
+}
+
+static struct pkt *esp_rx_pkt(struct openconnect_info *vpninfo, int receive_mtu)
+{
+	if (!vpninfo->dtls_pkt) {
+		vpninfo->dtls_pkt = malloc(sizeof(struct pkt) + receive_mtu + vpninfo->pkt_trailer);
+		if (!vpninfo->dtls_pkt)
+			vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
+	}
+	return vpninfo->dtls_pkt;
+}
+
+#ifdef UDP_GRO
+/* With UDP_GRO, a single recvmsg() may return a number of datagrams
+   from the same sender, all of the size given in the control message
+   except perhaps the last. Split them up again. */
+static int esp_receive_gro(struct openconnect_info *vpninfo, int receive_mtu)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int len, ofs, segsize = 0;
+
+	if (!vpninfo->esp_gro_buf) {
+		vpninfo->esp_gro_buf = malloc(ESP_GRO_BUFSIZE);
+		if (!vpninfo->esp_gro_buf)
+			return -ENOMEM;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = vpninfo->esp_gro_buf;
+	iov.iov_len = ESP_GRO_BUFSIZE;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	len = recvmsg(vpninfo->dtls_fd, &msg, 0);
+	if (len <= 0)
+		return len;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO)
+			memcpy(&segsize, CMSG_DATA(cmsg), sizeof(segsize));
+	}
+	if (segsize <= 0)
+		segsize = len;
+	else
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Received %d coalesced bytes of ESP packets of %d bytes\n"),
+			     len, segsize);
+
+	for (ofs = 0; ofs < len; ofs += segsize) {
+		int seglen = MIN(segsize, len - ofs);
+		struct pkt *pkt = esp_rx_pkt(vpninfo, receive_mtu);
+
+		if (!pkt)
+			break;
+
+		/* Plain recv() would have truncated it; it'll fail the MAC */
+		if (seglen > sizeof(pkt->esp) + receive_mtu + vpninfo->pkt_trailer)
+			continue;
+
+		memcpy(&pkt->esp, vpninfo->esp_gro_buf + ofs, seglen);
+		vpn_progress(vpninfo, PRG_TRACE, _("Received ESP packet of %d bytes\n"),
+			     seglen);
+		esp_receive_packet(vpninfo, seglen, receive_mtu);
+	}
+	return len;
+}
+#endif
+
+/* Free the first 'count' packets of the batch, which have been sent or
+   dropped, and move the rest up. */
+static void esp_batch_done(struct openconnect_info *vpninfo, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		free(vpninfo->esp_batch[i]);
+	vpninfo->esp_batch_nr -= count;
+	memmove(vpninfo->esp_batch, vpninfo->esp_batch + count,
+		vpninfo->esp_batch_nr * sizeof(vpninfo->esp_batch[0]));
+	memmove(vpninfo->esp_batch_len, vpninfo->esp_batch_len + count,
+		vpninfo->esp_batch_nr * sizeof(vpninfo->esp_batch_len[0]));
+}
+
+/* Send the first 'count' packets of vpninfo->esp_batch, which must all
+   be the same length except that the last may be shorter. With
+   UDP_SEGMENT, they go in a single sendmsg(). Returns -EAGAIN if the
+   socket was full, leaving what wasn't sent in the batch for when it
+   has room. */
+static int esp_send_batch(struct openconnect_info *vpninfo, int count)
+{
+	struct pkt **pkts = vpninfo->esp_batch;
+	int *lens = vpninfo->esp_batch_len;
+	int i, ret;
+
+	vpninfo->esp_batch_stalled = 0;
+
+#ifdef UDP_SEGMENT
+	if (count > 1) {
+		char cbuf[CMSG_SPACE(sizeof(uint16_t))];
+		struct iovec iov[ESP_GSO_MAX_SEGS];
+		uint16_t segsize = lens[0];
+		struct cmsghdr *cmsg;
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		memset(cbuf, 0, sizeof(cbuf));
+		for (i = 0; i < count; i++) {
+			iov[i].iov_base = (void *)&pkts[i]->esp;
+			iov[i].iov_len = lens[i];
+		}
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(segsize));
+		memcpy(CMSG_DATA(cmsg), &segsize, sizeof(segsize));
+
+		if (sendmsg(vpninfo->dtls_fd, &msg, 0) >= 0) {
+			vpninfo->dtls_times.last_tx = time(NULL);
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("Sent %d ESP packets of %d bytes with UDP_SEGMENT\n"),
+				     count, lens[0]);
+			ret = 0;
+			goto out;
+		}
+		if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
+			monitor_write_fd(vpninfo, dtls);
+			vpninfo->esp_batch_stalled = count;
+			return -EAGAIN;
+		}
+		if (errno == EMSGSIZE) {
+			/* The path MTU, not the offload, is the problem */
+			pmtud_too_big(vpninfo);
+			ret = 0;
+			goto out;
+		}
+		/* The outgoing device may lack the checksum offload that
+		   UDP_SEGMENT needs. Send them one at a time instead. */
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Disabling ESP UDP segmentation offload: %s\n"),
+			     strerror(errno));
+		vpninfo->esp_udp_gso = 0;
+	}
+#endif
+	for (i = 0; i < count; i++) {
+		ret = send(vpninfo->dtls_fd, (void *)&pkts[i]->esp, lens[i], 0);
+		if (ret < 0) {
+			/* Not that this is likely to happen with UDP, but... */
+			if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
+				monitor_write_fd(vpninfo, dtls);
+				esp_batch_done(vpninfo, i);
+				vpninfo->esp_batch_stalled = count - i;
+				return -EAGAIN;
+			} else if (errno == EMSGSIZE) {
+				pmtud_too_big(vpninfo);
+			} else {
+				/* A real error in sending. Fall back to TCP? */
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to send ESP packet: %s\n"),
+					     strerror(errno));
+			}
+		} else {
+			vpninfo->dtls_times.last_tx = time(NULL);
+
+			vpn_progress(vpninfo, PRG_TRACE, _("Sent ESP packet of %d bytes\n"),
+				     lens[i]);
+		}
+	}
+	ret = 0;
+ out:
+	esp_batch_done(vpninfo, count);
+	return ret;
+}
+
+/* The server gives lifetimes for the keys in bytes and/or seconds. Ask
+   for new ones when 90% of either is used up, to allow time for them
+   to arrive before the old ones run out. */
+static int esp_rekey_due(struct openconnect_info *vpninfo, int *timeout)
+{
+	uint64_t bytes = vpninfo->esp_lifetime_bytes;
+	time_t secs = vpninfo->esp_lifetime_seconds;
+	struct esp *esp_in = &vpninfo->esp_in[vpninfo->current_esp_in];
+
+	if (bytes) {
+		bytes -= bytes / 10;
+		if (vpninfo->esp_out.bytes >= bytes || esp_in->bytes >= bytes)
+			return 1;
+	}
+	if (secs) {
+		secs -= secs / 10;
+		if (ka_check_deadline(timeout, time(NULL), vpninfo->esp_out.installed + secs))
+			return 1;
+	}
+	return 0;
+}
+
+/* ESP keys are only ever negotiated over the TCP connection, so make a
+   new one. ESP carries on with the current keys while that happens (see
+   ssl_reconnect()), and when the new keys arrive the outbound SA switches
+   over at once while the old inbound SA remains valid for a while. */
+static void esp_rekey(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->ssl_fd == -1)
+		return; /* Already reconnecting */
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("ESP keys due for renewal; renegotiating\n"));
+	openconnect_close_https(vpninfo, 0);
+}
+
 int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
-	struct esp *esp = &vpninfo->esp_in[vpninfo->current_esp_in];
-	struct esp *old_esp = &vpninfo->esp_in[vpninfo->current_esp_in ^ 1];
+	int *batch_len = vpninfo->esp_batch_len;
 	struct pkt *this;
 	int work_done = 0;
-	int ret;
+	int i, batch_bytes;
 
 	/* Some servers send us packets that are larger than negotiated
 	   MTU, or lack the ability to negotiate MTU (see gpst.c). We
 	   reserve some extra space to handle that */
-	int receive_mtu = MAX(2048, vpninfo->ip_info.mtu + 256);
+	int receive_mtu = MAX(2048, max_tunnel_mtu(vpninfo) + 256);
 
 	if (vpninfo->dtls_state == DTLS_SLEEPING) {
 		if (ka_check_deadline(timeout, time(NULL), vpninfo->new_dtls_started + vpninfo->dtls_attempt_period)
@@ -277,17 +725,26 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	while (1) {
 		int len = receive_mtu + vpninfo->pkt_trailer;
-		int i;
 		struct pkt *pkt;
 
-		if (!vpninfo->dtls_pkt) {
-			vpninfo->dtls_pkt = malloc(sizeof(struct pkt) + len);
-			if (!vpninfo->dtls_pkt) {
-				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
+		if (vpninfo->udp_drop_policy == UDP_DROP_NONE &&
+		    incoming_queue_full(vpninfo)) {
+			unmonitor_read_fd(vpninfo, dtls);
+			break;
+		}
+
+#ifdef UDP_GRO
+		if (vpninfo->esp_udp_gro) {
+			if (esp_receive_gro(vpninfo, receive_mtu) <= 0)
 				break;
-			}
+			work_done = 1;
+			continue;
 		}
-		pkt = vpninfo->dtls_pkt;
+#endif
+		pkt = esp_rx_pkt(vpninfo, receive_mtu);
+		if (!pkt)
+			break;
+
 		len = recv(vpninfo->dtls_fd, (void *)&pkt->esp, len + sizeof(pkt->esp), 0);
 		if (len <= 0)
 			break;
@@ -296,105 +753,21 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			     len);
 		work_done = 1;
 
-		/* both supported algos (SHA1 and MD5) have 12-byte MAC lengths (RFC2403 and RFC2404) */
-		if (len <= sizeof(pkt->esp) + 12)
-			continue;
-
-		len -= sizeof(pkt->esp) + 12;
-		pkt->len = len;
-
-		if (pkt->esp.spi == esp->spi) {
-			if (decrypt_esp_packet(vpninfo, esp, pkt))
-				continue;
-		} else if (pkt->esp.spi == old_esp->spi &&
-			   ntohl(pkt->esp.seq) + esp->seq < vpninfo->old_esp_maxseq) {
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Received ESP packet from old SPI 0x%x, seq %u\n"),
-				     (unsigned)ntohl(old_esp->spi), (unsigned)ntohl(pkt->esp.seq));
-			if (decrypt_esp_packet(vpninfo, old_esp, pkt))
-				continue;
-		} else {
-			vpn_progress(vpninfo, PRG_DEBUG,
-				     _("Received ESP packet with invalid SPI 0x%08x\n"),
-				     (unsigned)ntohl(pkt->esp.spi));
-			continue;
-		}
-
-		/* Possible values of the Next Header field are:
-		   0x04: IP[v4]-in-IP
-		   0x05: supposed to mean Internet Stream Protocol
-		         (XXX: but used for LZO compressed packets by Juniper)
-		   0x29: IPv6 encapsulation */
-		if (pkt->data[len - 1] != 0x04 && pkt->data[len - 1] != 0x29 &&
-		    pkt->data[len - 1] != 0x05) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Received ESP packet with unrecognised payload type %02x\n"),
-				     pkt->data[len-1]);
-			continue;
-		}
-
-		if (len <= 2 + pkt->data[len - 2]) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Invalid padding length %02x in ESP\n"),
-				     pkt->data[len - 2]);
-			continue;
-		}
-		pkt->len = len - 2 - pkt->data[len - 2];
-		for (i = 0 ; i < pkt->data[len - 2]; i++) {
-			if (pkt->data[pkt->len + i] != i + 1)
-				break; /* We can't just 'continue' here because it
-					* would only break out of this 'for' loop */
-		}
-		if (i != pkt->data[len - 2]) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Invalid padding bytes in ESP\n"));
-			continue; /* We can here, though */
-		}
-		vpninfo->dtls_times.last_rx = time(NULL);
-
-		if (vpninfo->proto->udp_catch_probe) {
-			if (vpninfo->proto->udp_catch_probe(vpninfo, pkt)) {
-				if (vpninfo->dtls_state == DTLS_SLEEPING) {
-					vpn_progress(vpninfo, PRG_INFO,
-						     _("ESP session established with server\n"));
-					queue_esp_control(vpninfo, 1);
-					vpninfo->dtls_state = DTLS_CONNECTING;
-				}
-				continue;
-			}
-		}
-		if (pkt->data[len - 1] == 0x05) {
-			struct pkt *newpkt = malloc(sizeof(*pkt) + receive_mtu + vpninfo->pkt_trailer);
-			int newlen = receive_mtu;
-			if (!newpkt) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Failed to allocate memory to decrypt ESP packet\n"));
-				continue;
-			}
-			if (av_lzo1x_decode(newpkt->data, &newlen,
-					    pkt->data, &pkt->len) || pkt->len) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("LZO decompression of ESP packet failed\n"));
-				free(newpkt);
-				continue;
-			}
-			newpkt->len = receive_mtu - newlen;
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("LZO decompressed %d bytes into %d\n"),
-				     len - 2 - pkt->data[len-2], newpkt->len);
-			queue_packet(&vpninfo->incoming_queue, newpkt);
-		} else {
-			queue_packet(&vpninfo->incoming_queue, pkt);
-			vpninfo->dtls_pkt = NULL;
-		}
+		esp_receive_packet(vpninfo, len, receive_mtu);
 	}
 
 	if (vpninfo->dtls_state != DTLS_CONNECTED)
 		return 0;
 
+	if (esp_rekey_due(vpninfo, timeout))
+		esp_rekey(vpninfo);
+
+	if (pmtud_mainloop(vpninfo, timeout))
+		work_done = 1;
+
 	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
 	case KA_REKEY:
-		vpn_progress(vpninfo, PRG_ERR, _("Rekey not implemented for ESP\n"));
+		esp_rekey(vpninfo);
 		break;
 
 	case KA_DPD_DEAD:
@@ -420,37 +793,48 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		break;
 	}
 	unmonitor_write_fd(vpninfo, dtls);
-	while ((this = dequeue_packet(&vpninfo->outgoing_queue))) {
+
+	/* First what the socket had no room for last time */
+	if (vpninfo->esp_batch_stalled) {
+		work_done = 1;
+		if (esp_send_batch(vpninfo, vpninfo->esp_batch_stalled))
+			return work_done;
+	}
+	for (i = batch_bytes = 0; i < vpninfo->esp_batch_nr; i++)
+		batch_bytes += batch_len[i];
+
+	while ((this = dequeue_outgoing_packet(vpninfo))) {
+		int nr_batch = vpninfo->esp_batch_nr;
 		int len;
 
+		work_done = 1;
 		len = encrypt_esp_packet(vpninfo, this);
-		if (len > 0) {
-			ret = send(vpninfo->dtls_fd, (void *)&this->esp, len, 0);
-			if (ret < 0) {
-				/* Not that this is likely to happen with UDP, but... */
-				if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
-					monitor_write_fd(vpninfo, dtls);
-					/* XXX: Keep the packet somewhere? */
-					free(this);
-					return work_done;
-				} else {
-					/* A real error in sending. Fall back to TCP? */
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Failed to send ESP packet: %s\n"),
-						     strerror(errno));
-				}
-			} else {
-				vpninfo->dtls_times.last_tx = time(NULL);
-
-				vpn_progress(vpninfo, PRG_TRACE, _("Sent ESP packet of %d bytes\n"),
-					     len);
-			}
-		} else {
+		if (len <= 0) {
 			/* XXX: Fall back to TCP transport? */
+			free(this);
+			continue;
 		}
-		free(this);
-		work_done = 1;
+		vpninfo->esp_out.bytes += this->len;
+
+		/* Send what we have so far if this one can't join the batch */
+		if (nr_batch &&
+		    (!vpninfo->esp_udp_gso || nr_batch == ESP_GSO_MAX_SEGS ||
+		     len > batch_len[0] || batch_len[nr_batch - 1] < batch_len[0] ||
+		     batch_bytes + len > ESP_GSO_MAX_BYTES)) {
+			if (esp_send_batch(vpninfo, nr_batch)) {
+				/* Already encrypted, so it has to wait here */
+				vpninfo->esp_batch[vpninfo->esp_batch_nr] = this;
+				batch_len[vpninfo->esp_batch_nr++] = len;
+				return work_done;
+			}
+			batch_bytes = 0;
+		}
+		vpninfo->esp_batch[vpninfo->esp_batch_nr] = this;
+		batch_len[vpninfo->esp_batch_nr++] = len;
+		batch_bytes += len;
 	}
+	if (vpninfo->esp_batch_nr)
+		esp_send_batch(vpninfo, vpninfo->esp_batch_nr);
 
 	return work_done;
 }
@@ -466,8 +850,12 @@ void esp_close(struct openconnect_info *vpninfo)
 		unmonitor_except_fd(vpninfo, dtls);
 		vpninfo->dtls_fd = -1;
 	}
+	esp_batch_done(vpninfo, vpninfo->esp_batch_nr);
+	vpninfo->esp_batch_stalled = 0;
+	vpninfo->esp_udp_gso = vpninfo->esp_udp_gro = 0;
 	if (vpninfo->dtls_state > DTLS_DISABLED)
 		vpninfo->dtls_state = DTLS_SLEEPING;
+	pmtud_stop(vpninfo);
 }
 
 void esp_close_secret(struct openconnect_info *vpninfo)
@@ -479,8 +867,10 @@ void esp_close_secret(struct openconnect_info *vpninfo)
 
 void esp_shutdown(struct openconnect_info *vpninfo)
 {
-	destroy_esp_ciphers(&vpninfo->esp_in[0]);
-	destroy_esp_ciphers(&vpninfo->esp_in[1]);
+	int i;
+
+	for (i = 0; i < ESP_NR_SA_IN; i++)
+		destroy_esp_ciphers(&vpninfo->esp_in[i]);
 	destroy_esp_ciphers(&vpninfo->esp_out);
 	esp_close(vpninfo);
 }
@@ -69,6 +69,9 @@ static int init_esp_ciphers(struct openconnect_info *vpninfo, struct esp *esp,
 	}
 	esp->seq = 0;
 	esp->seq_backlog = 0;
+	esp->installed = time(NULL);
+	esp->bytes = 0;
+	esp->retire = 0;
 	return 0;
 }
 
@@ -106,12 +109,10 @@ int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys)
 		return -EINVAL;
 	}
 
-	if (new_keys) {
-		vpninfo->old_esp_maxseq = vpninfo->esp_in[vpninfo->current_esp_in].seq + 32;
-		vpninfo->current_esp_in ^= 1;
-	}
-
-	esp_in = &vpninfo->esp_in[vpninfo->current_esp_in];
+	if (new_keys)
+		esp_in = esp_new_sa_in(vpninfo);
+	else
+		esp_in = &vpninfo->esp_in[vpninfo->current_esp_in];
 
 	if (new_keys) {
 		if ((ret = gnutls_rnd(GNUTLS_RND_NONCE, &esp_in->spi, sizeof(esp_in->spi))) ||
@@ -190,6 +190,10 @@ static int _openconnect_gnutls_read(gnutls_session_t ses, int fd, struct opencon
 
 static int openconnect_gnutls_read(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
+	int ret = ssl_rbuf_read(vpninfo, buf, len);
+
+	if (ret)
+		return ret;
 	return _openconnect_gnutls_read(vpninfo->https_sess, vpninfo->ssl_fd, vpninfo, buf, len, 0);
 }
 
@@ -198,70 +202,14 @@ int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t le
 	return _openconnect_gnutls_read(vpninfo->dtls_ssl, vpninfo->dtls_fd, vpninfo, buf, len, ms);
 }
 
-static int openconnect_gnutls_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
-{
-	int i = 0;
-	int ret;
-
-	if (len < 2)
-		return -EINVAL;
-
-	while (1) {
-		ret = gnutls_record_recv(vpninfo->https_sess, buf + i, 1);
-		if (ret == 1) {
-			if (buf[i] == '\n') {
-				buf[i] = 0;
-				if (i && buf[i-1] == '\r') {
-					buf[i-1] = 0;
-					i--;
-				}
-				return i;
-			}
-			i++;
-
-			if (i >= len - 1) {
-				buf[i] = 0;
-				return i;
-			}
-		} else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
-			/* Wait for something to happen on the socket, or on cmd_fd */
-			fd_set rd_set, wr_set;
-			int maxfd = vpninfo->ssl_fd;
-
-			FD_ZERO(&rd_set);
-			FD_ZERO(&wr_set);
-
-			if (gnutls_record_get_direction(vpninfo->https_sess))
-				FD_SET(vpninfo->ssl_fd, &wr_set);
-			else
-				FD_SET(vpninfo->ssl_fd, &rd_set);
-
-			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			select(maxfd + 1, &rd_set, &wr_set, NULL, NULL);
-			if (is_cancel_pending(vpninfo, &rd_set)) {
-				vpn_progress(vpninfo, PRG_ERR, _("SSL read cancelled\n"));
-				ret = -EINTR;
-				break;
-			}
-		} else if (ret == GNUTLS_E_REHANDSHAKE) {
-			ret = cstp_handshake(vpninfo, 0);
-			if (ret)
-				return ret;
-		} else {
-			vpn_progress(vpninfo, PRG_ERR, _("Failed to read from SSL socket: %s\n"),
-				     gnutls_strerror(ret));
-			ret = -EIO;
-			break;
-		}
-	}
-	buf[i] = 0;
-	return i ?: ret;
-}
-
 int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
 {
 	int ret;
 
+	ret = ssl_rbuf_read(vpninfo, buf, maxlen);
+	if (ret)
+		return ret;
+
 	ret = gnutls_record_recv(vpninfo->https_sess, buf, maxlen);
 	if (ret > 0)
 		return ret;
@@ -1894,14 +1842,60 @@ void openconnect_free_peer_cert_chain(struct openconnect_info *vpninfo,
 	free(chain);
 }
 
+static int peer_chain_key(struct openconnect_info *vpninfo,
+			  const gnutls_datum_t *cert_list,
+			  unsigned int cert_list_size, unsigned char *key)
+{
+	struct oc_cert *chain = calloc(cert_list_size, sizeof(*chain));
+	unsigned int i;
+	int ret;
+
+	if (!chain)
+		return -ENOMEM;
+
+	for (i = 0; i < cert_list_size; i++) {
+		chain[i].der_data = cert_list[i].data;
+		chain[i].der_len = cert_list[i].size;
+	}
+	ret = verify_cache_key(vpninfo, chain, cert_list_size, key);
+	free(chain);
+	return ret;
+}
+
+/* When the first certificate in the chain expires */
+static time_t peer_chain_expiry(const gnutls_datum_t *cert_list,
+				unsigned int cert_list_size)
+{
+	gnutls_x509_crt_t cert;
+	time_t expiry = 0, t;
+	unsigned int i;
+
+	for (i = 0; i < cert_list_size; i++) {
+		if (gnutls_x509_crt_init(&cert))
+			return 0;
+		if (gnutls_x509_crt_import(cert, &cert_list[i], GNUTLS_X509_FMT_DER)) {
+			gnutls_x509_crt_deinit(cert);
+			return 0;
+		}
+		t = gnutls_x509_crt_get_expiration_time(cert);
+		gnutls_x509_crt_deinit(cert);
+		if (t == (time_t)-1)
+			return 0;
+		if (!i || t < expiry)
+			expiry = t;
+	}
+	return expiry;
+}
+
 static int verify_peer(gnutls_session_t session)
 {
 	struct openconnect_info *vpninfo = gnutls_session_get_ptr(session);
 	const gnutls_datum_t *cert_list;
 	gnutls_x509_crt_t cert;
 	unsigned int status, cert_list_size;
+	unsigned char cache_key[SHA256_SIZE];
 	const char *reason = NULL;
-	int err = 0;
+	int have_key, err = 0;
 
 	cert_list = gnutls_certificate_get_peers(session, &cert_list_size);
 	if (!cert_list) {
@@ -1941,10 +1935,16 @@ static int verify_peer(gnutls_session_t session)
 	}
 
 	vpninfo->peer_cert = cert;
+
+	have_key = !peer_chain_key(vpninfo, cert_list, cert_list_size, cache_key);
+	if (have_key && verify_cache_lookup(vpninfo, cache_key))
+		return 0;
+
 	err = set_peer_cert_hash(vpninfo);
 	if (err < 0) {
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("Could not calculate hash of server's certificate\n"));
+		have_key = 0;
 	}
 
 	err = gnutls_certificate_verify_peers2(session, &status);
@@ -2033,14 +2033,58 @@ static int verify_peer(gnutls_session_t session)
 			vpninfo->cert_list_handle = NULL;
 		} else
 			err = GNUTLS_E_CERTIFICATE_ERROR;
+	} else if (have_key) {
+		/* Only if it verified on its own merits, not by the user's say-so */
+		verify_cache_add(vpninfo, cache_key,
+				 peer_chain_expiry(cert_list, cert_list_size));
 	}
 
 	return err;
 }
 
+/* verify_peer() isn't called when a session is resumed, but the
+   server's certificate is still available from the session data. */
+static int set_resumed_peer_cert(struct openconnect_info *vpninfo)
+{
+	const gnutls_datum_t *cert_list;
+	unsigned int cert_list_size;
+	gnutls_x509_crt_t cert;
+
+	cert_list = gnutls_certificate_get_peers(vpninfo->https_sess, &cert_list_size);
+	if (!cert_list || gnutls_x509_crt_init(&cert))
+		return -EIO;
+
+	if (gnutls_x509_crt_import(cert, &cert_list[0], GNUTLS_X509_FMT_DER)) {
+		gnutls_x509_crt_deinit(cert);
+		return -EIO;
+	}
+
+	vpninfo->peer_cert = cert;
+	if (set_peer_cert_hash(vpninfo) < 0)
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Could not calculate hash of server's certificate\n"));
+	return 0;
+}
+
+static void save_https_session(struct openconnect_info *vpninfo)
+{
+	gnutls_datum_t data;
+
+	if (gnutls_session_get_data2(vpninfo->https_sess, &data))
+		return;
+
+	gnutls_free(vpninfo->https_sess_data.data);
+	vpninfo->https_sess_data = data;
+	if (https_sess_cache_set_host(vpninfo)) {
+		gnutls_free(vpninfo->https_sess_data.data);
+		vpninfo->https_sess_data.data = NULL;
+	}
+}
+
 int openconnect_open_https(struct openconnect_info *vpninfo)
 {
 	const char *default_prio;
+	uint64_t handshake_start;
 	int ssl_sock = -1;
 	int err;
 
@@ -2137,7 +2181,12 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		}
 
 		if (vpninfo->cert) {
+			uint64_t start = monotonic_usec();
+
 			err = load_certificate(vpninfo);
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Loading certificate took %lu ms\n"),
+				     (unsigned long)((monotonic_usec() - start) / 1000));
 			if (err) {
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("Loading certificate failed. Aborting.\n"));
@@ -2219,6 +2268,13 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	gnutls_credentials_set(vpninfo->https_sess, GNUTLS_CRD_CERTIFICATE, vpninfo->https_cred);
 	gnutls_transport_set_ptr(vpninfo->https_sess,(gnutls_transport_ptr_t)(intptr_t)ssl_sock);
 
+	/* Offer the session from last time, if there was one. If the server
+	   no longer accepts it, this is just a full handshake. */
+	if (vpninfo->https_sess_data.data && https_sess_cache_valid(vpninfo))
+		gnutls_session_set_data(vpninfo->https_sess,
+					vpninfo->https_sess_data.data,
+					vpninfo->https_sess_data.size);
+
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
 
@@ -2227,9 +2283,29 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 				     GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
 #endif
 
+	handshake_start = monotonic_usec();
 	err = cstp_handshake(vpninfo, 1);
 	if (err)
 		return err;
+	vpn_progress(vpninfo, PRG_DEBUG, _("TLS handshake took %lu ms\n"),
+		     (unsigned long)((monotonic_usec() - handshake_start) / 1000));
+
+	if (gnutls_session_is_resumed(vpninfo->https_sess)) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Resumed previous TLS session with %s\n"),
+			     vpninfo->hostname);
+		err = set_resumed_peer_cert(vpninfo);
+		if (err) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("No server certificate in resumed TLS session\n"));
+			gnutls_deinit(vpninfo->https_sess);
+			vpninfo->https_sess = NULL;
+			gnutls_free(vpninfo->https_sess_data.data);
+			vpninfo->https_sess_data.data = NULL;
+			closesocket(ssl_sock);
+			return err;
+		}
+	}
 
 	gnutls_free(vpninfo->cstp_cipher);
 	vpninfo->cstp_cipher = get_gnutls_cipher(vpninfo->https_sess);
@@ -2238,7 +2314,7 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 
 	vpninfo->ssl_read = openconnect_gnutls_read;
 	vpninfo->ssl_write = openconnect_gnutls_write;
-	vpninfo->ssl_gets = openconnect_gnutls_gets;
+	vpninfo->ssl_gets = openconnect_SSL_gets;
 
 	return 0;
 }
@@ -2301,9 +2377,11 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
 	if (vpninfo->https_sess) {
+		save_https_session(vpninfo);
 		gnutls_deinit(vpninfo->https_sess);
 		vpninfo->https_sess = NULL;
 	}
+	vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
 	if (vpninfo->ssl_fd != -1) {
 		closesocket(vpninfo->ssl_fd);
 		unmonitor_read_fd(vpninfo, ssl);
@@ -2311,6 +2389,12 @@ void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 		unmonitor_except_fd(vpninfo, ssl);
 		vpninfo->ssl_fd = -1;
 	}
+	if (final) {
+		gnutls_free(vpninfo->https_sess_data.data);
+		vpninfo->https_sess_data.data = NULL;
+		free(vpninfo->https_sess_host);
+		vpninfo->https_sess_host = NULL;
+	}
 	if (final && vpninfo->https_cred) {
 		gnutls_certificate_free_credentials(vpninfo->https_cred);
 		vpninfo->https_cred = NULL;
@@ -2508,6 +2592,48 @@ int openconnect_sha256(unsigned char *result, void *data, int datalen)
 	return 0;
 }
 
+/* AES-256-GCM in place, with a 12-byte IV and 16-byte tag. On decryption
+   the tag is checked, and -EBADMSG returned if it doesn't match. */
+int openconnect_aes_gcm(int encrypt, const unsigned char *key,
+			const unsigned char *iv, const void *aad, int aadlen,
+			void *buf, int len, unsigned char *tag)
+{
+	gnutls_cipher_hd_t h;
+	gnutls_datum_t k, i;
+	unsigned char mytag[16], diff = 0;
+	int err, n;
+
+	k.data = (void *)key;
+	k.size = 32;
+	i.data = (void *)iv;
+	i.size = 12;
+
+	if (gnutls_cipher_init(&h, GNUTLS_CIPHER_AES_256_GCM, &k, &i))
+		return -EIO;
+
+	err = gnutls_cipher_add_auth(h, aad, aadlen);
+	if (!err && len) {
+		if (encrypt)
+			err = gnutls_cipher_encrypt(h, buf, len);
+		else
+			err = gnutls_cipher_decrypt(h, buf, len);
+	}
+	if (!err)
+		err = gnutls_cipher_tag(h, mytag, sizeof(mytag));
+	gnutls_cipher_deinit(h);
+	if (err)
+		return -EIO;
+
+	if (encrypt) {
+		memcpy(tag, mytag, sizeof(mytag));
+		return 0;
+	}
+
+	for (n = 0; n < sizeof(mytag); n++)
+		diff |= mytag[n] ^ tag[n];
+	return diff ? -EBADMSG : 0;
+}
+
 int openconnect_md5(unsigned char *result, void *data, int datalen)
 {
 	gnutls_datum_t d;
@@ -518,19 +518,18 @@ static int gpst_parse_config_xml(struct openconnect_info *vpninfo, xmlNode *xml_
 		} else if (xmlnode_is_named(xml_node, "ipsec")) {
 #ifdef HAVE_ESP
 			if (vpninfo->dtls_state != DTLS_DISABLED) {
-				int c = (vpninfo->current_esp_in ^= 1);
-				vpninfo->old_esp_maxseq = vpninfo->esp_in[c^1].seq + 32;
+				struct esp *esp_in = esp_new_sa_in(vpninfo);
 				for (member = xml_node->children; member; member=member->next) {
 					s = NULL;
 					if (!xmlnode_get_text(member, "udp-port", &s))		udp_sockaddr(vpninfo, atoi(s));
 					else if (!xmlnode_get_text(member, "enc-algo", &s)) 	set_esp_algo(vpninfo, s, 0);
 					else if (!xmlnode_get_text(member, "hmac-algo", &s))	set_esp_algo(vpninfo, s, 1);
 					else if (!xmlnode_get_text(member, "c2s-spi", &s))	vpninfo->esp_out.spi = htonl(strtoul(s, NULL, 16));
-					else if (!xmlnode_get_text(member, "s2c-spi", &s))	vpninfo->esp_in[c].spi = htonl(strtoul(s, NULL, 16));
+					else if (!xmlnode_get_text(member, "s2c-spi", &s))	esp_in->spi = htonl(strtoul(s, NULL, 16));
 					else if (xmlnode_is_named(member, "ekey-c2s"))		get_key_bits(member, vpninfo->esp_out.enc_key);
-					else if (xmlnode_is_named(member, "ekey-s2c"))		get_key_bits(member, vpninfo->esp_in[c].enc_key);
+					else if (xmlnode_is_named(member, "ekey-s2c"))		get_key_bits(member, esp_in->enc_key);
 					else if (xmlnode_is_named(member, "akey-c2s"))		get_key_bits(member, vpninfo->esp_out.hmac_key);
-					else if (xmlnode_is_named(member, "akey-s2c"))		get_key_bits(member, vpninfo->esp_in[c].hmac_key);
+					else if (xmlnode_is_named(member, "akey-s2c"))		get_key_bits(member, esp_in->hmac_key);
 					else if (!xmlnode_get_text(member, "ipsec-mode", &s) && strcmp(s, "esp-tunnel"))
 						vpn_progress(vpninfo, PRG_ERR, _("GlobalProtect config sent ipsec-mode=%s (expected esp-tunnel)\n"), s);
 					free((void *)s);
@@ -798,16 +797,11 @@ out:
 	return buf_free(buf);
 }
 
-/* check if HIP report is needed (to ssl-vpn/hipreportcheck.esp) or submit HIP report contents (to ssl-vpn/hipreport.esp) */
-static int check_or_submit_hip_report(struct openconnect_info *vpninfo, const char *report)
+static int hip_report_request(struct openconnect_info *vpninfo, const char *report,
+			      struct oc_text_buf *request_body)
 {
 	int result;
 
-	struct oc_text_buf *request_body = buf_alloc();
-	const char *request_body_type = "application/x-www-form-urlencoded";
-	const char *method = "POST";
-	char *xml_buf=NULL, *orig_path;
-
 	/* cookie gives us these fields: authcookie, portal, user, domain, computer, and (maybe the unnecessary) preferred-ip */
 	buf_append(request_body, "client-role=global-protect-full&%s", vpninfo->cookie);
 	append_opt(request_body, "client-ip", vpninfo->ip_info.addr);
@@ -818,10 +812,23 @@ static int check_or_submit_hip_report(struct openconnect_info *vpninfo, const ch
 	} else {
 		result = build_csd_token(vpninfo);
 		if (result)
-			goto out;
+			return result;
 		append_opt(request_body, "md5", vpninfo->csd_token);
 	}
-	if ((result = buf_error(request_body)))
+	return buf_error(request_body);
+}
+
+/* check if HIP report is needed (to ssl-vpn/hipreportcheck.esp) or submit HIP report contents (to ssl-vpn/hipreport.esp) */
+static int check_or_submit_hip_report(struct openconnect_info *vpninfo, const char *report)
+{
+	int result;
+
+	struct oc_text_buf *request_body = buf_alloc();
+	const char *request_body_type = "application/x-www-form-urlencoded";
+	const char *method = "POST";
+	char *xml_buf=NULL, *orig_path;
+
+	if ((result = hip_report_request(vpninfo, report, request_body)))
 		goto out;
 
 	orig_path = vpninfo->urlpath;
@@ -839,6 +846,94 @@ out:
 	return result;
 }
 
+/* The same check, but the answer is collected by gpst_mainloop() with
+   finish_hip_report_check() once it arrives, instead of waiting for it. */
+static int start_hip_report_check(struct openconnect_info *vpninfo)
+{
+	struct oc_text_buf *request_body = buf_alloc();
+	char *orig_path;
+	int result;
+
+	result = hip_report_request(vpninfo, NULL, request_body);
+	if (!result) {
+		orig_path = vpninfo->urlpath;
+		vpninfo->urlpath = strdup("ssl-vpn/hipreportcheck.esp");
+		result = start_https_request(vpninfo, "POST",
+					     "application/x-www-form-urlencoded",
+					     request_body);
+		free(vpninfo->urlpath);
+		vpninfo->urlpath = orig_path;
+	}
+	buf_free(request_body);
+	return result;
+}
+
+static int finish_hip_report_check(struct openconnect_info *vpninfo)
+{
+	char *xml_buf = NULL;
+	int result;
+
+	result = finish_https_request(vpninfo, &xml_buf);
+	result = gpst_xml_or_error(vpninfo, result, xml_buf, parse_hip_report_check, NULL, NULL);
+	free(xml_buf);
+	return result;
+}
+
+/* The report which was last accepted, and the client IP it was made for
+ * (the script puts that into the report). It is resubmitted when the
+ * gateway asks for a report again on reconnect, rather than running the
+ * script again, which can take a long time. The csd_token md5 which the
+ * gateway keys its HIP state on doesn't change over the session.
+ */
+static void cache_hip_report(struct openconnect_info *vpninfo, const char *report)
+{
+	unsigned char hash[MD5_SIZE];
+
+	openconnect_md5(hash, (void *)report, strlen(report));
+	if (vpninfo->hip_report && !memcmp(hash, vpninfo->hip_report_hash, MD5_SIZE))
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("HIP report is unchanged since it was last run\n"));
+
+	free_hip_report(vpninfo);
+	vpninfo->hip_report = strdup(report);
+	vpninfo->hip_report_ip = vpninfo->ip_info.addr ? strdup(vpninfo->ip_info.addr) : NULL;
+	memcpy(vpninfo->hip_report_hash, hash, MD5_SIZE);
+	if (!vpninfo->hip_report || (vpninfo->ip_info.addr && !vpninfo->hip_report_ip))
+		free_hip_report(vpninfo);
+}
+
+void free_hip_report(struct openconnect_info *vpninfo)
+{
+	free(vpninfo->hip_report);
+	free(vpninfo->hip_report_ip);
+	vpninfo->hip_report = vpninfo->hip_report_ip = NULL;
+}
+
+static int submit_cached_hip_report(struct openconnect_info *vpninfo)
+{
+	const char *ip = vpninfo->ip_info.addr;
+	int ret;
+
+	if (!vpninfo->hip_report)
+		return -ENOENT;
+	if (!ip || !vpninfo->hip_report_ip || strcmp(ip, vpninfo->hip_report_ip)) {
+		free_hip_report(vpninfo);
+		return -ENOENT;
+	}
+
+	ret = check_or_submit_hip_report(vpninfo, vpninfo->hip_report);
+	if (ret < 0) {
+		/* The gateway wants something newer; run the script */
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Cached HIP report was not accepted\n"));
+		free_hip_report(vpninfo);
+		return ret;
+	}
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Resubmitted cached HIP report.\n"));
+	return 0;
+}
+
 static int run_hip_script(struct openconnect_info *vpninfo)
 {
 #if !defined(_WIN32) && !defined(__native_client__)
@@ -889,6 +984,7 @@ static int run_hip_script(struct openconnect_info *vpninfo)
 				vpn_progress(vpninfo, PRG_ERR, _("HIP report submission failed.\n"));
 			else {
 				vpn_progress(vpninfo, PRG_INFO, _("HIP report submitted successfully.\n"));
+				cache_hip_report(vpninfo, report_buf->data);
 				ret = 0;
 			}
 		}
@@ -920,6 +1016,28 @@ static int run_hip_script(struct openconnect_info *vpninfo)
 #endif /* !_WIN32 && !__native_client__ */
 }
 
+/* Ask the gateway whether it needs a HIP report, and send one if so.
+   Returns an error only if the report couldn't be made or submitted. */
+static int check_hip_report(struct openconnect_info *vpninfo)
+{
+	int ret;
+
+	ret = check_or_submit_hip_report(vpninfo, NULL);
+	if (ret == -EAGAIN) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+					 _("Gateway says HIP report submission is needed.\n"));
+		if (!submit_cached_hip_report(vpninfo))
+			return 0;
+		return run_hip_script(vpninfo);
+	} else if (ret == 0)
+		vpn_progress(vpninfo, PRG_DEBUG,
+					 _("Gateway says no HIP report submission is needed.\n"));
+	else
+		vpn_progress(vpninfo, PRG_DEBUG,
+					 _("HIP report check failed; continuing without\n"));
+	return 0;
+}
+
 int gpst_setup(struct openconnect_info *vpninfo)
 {
 	int ret;
@@ -928,22 +1046,45 @@ int gpst_setup(struct openconnect_info *vpninfo)
 	if (vpninfo->proto->udp_close)
 		vpninfo->proto->udp_close(vpninfo);
 
+	/* An unanswered HIP report check mustn't be taken for the reply
+	   to getconfig */
+	if (vpninfo->hip_check_pending) {
+		vpninfo->hip_check_pending = 0;
+		openconnect_close_https(vpninfo, 0);
+	}
+
 	/* Get configuration */
 	ret = gpst_get_config(vpninfo);
 	if (ret)
 		goto out;
 
-	/* Check HIP */
-	ret = check_or_submit_hip_report(vpninfo, NULL);
-	if (ret == -EAGAIN) {
+	/* On reconnect with ESP, a report which was accepted for this IP
+	 * almost certainly still is. Send the check now, but let the ESP
+	 * tunnel come up while we wait for the answer, on the connection
+	 * which fetched the configuration. If the gateway does want a
+	 * report after all, gpst_mainloop() reconnects to send it.
+	 */
+	if (vpninfo->hip_report && vpninfo->ip_info.addr && vpninfo->hip_report_ip &&
+	    !strcmp(vpninfo->ip_info.addr, vpninfo->hip_report_ip) &&
+	    !vpninfo->hip_report_stale &&
+	    vpninfo->dtls_state != DTLS_DISABLED && vpninfo->dtls_state != DTLS_NOSECRET) {
 		vpn_progress(vpninfo, PRG_DEBUG,
-					 _("Gateway says HIP report submission is needed.\n"));
-		ret = run_hip_script(vpninfo);
-		if (ret != 0)
+			     _("Checking HIP report while the tunnel comes up\n"));
+		if (start_hip_report_check(vpninfo)) {
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("HIP report check failed; continuing without\n"));
+		} else {
+			vpninfo->hip_check_pending = 1;
+			monitor_fd_new(vpninfo, ssl);
+			monitor_read_fd(vpninfo, ssl);
+		}
+		ret = 0;
+	} else {
+		vpninfo->hip_report_stale = 0;
+		ret = check_hip_report(vpninfo);
+		if (ret)
 			goto out;
-	} else if (ret == 0)
-		vpn_progress(vpninfo, PRG_DEBUG,
-					 _("Gateway says no HIP report submission is needed.\n"));
+	}
 
 	/* We do NOT actually start the HTTPS tunnel yet if we want to
 	 * use ESP, because the ESP tunnel won't work if the HTTPS tunnel
@@ -951,11 +1092,76 @@ int gpst_setup(struct openconnect_info *vpninfo)
 	 */
 	if (vpninfo->dtls_state == DTLS_DISABLED || vpninfo->dtls_state == DTLS_NOSECRET)
 		ret = gpst_connect(vpninfo);
+	else
+		vpninfo->esp_wait_start = 0;
 
 out:
 	return ret;
 }
 
+/* Since the HTTPS tunnel stops ESP from working, the two can't be raced
+ * against each other. Instead, we give ESP only as long as the gateway
+ * should take to answer: a few times the round trip of the quickest
+ * HTTPS request, which includes the server's own processing time. The
+ * probes are repeated within that time, so that the loss of one burst
+ * doesn't send us to HTTPS. Packets from the tun device are queued in
+ * the meantime and go out over whichever tunnel wins.
+ */
+#define GP_ESP_WAIT_MIN		500	/* ms */
+#define GP_ESP_WAIT_MAX		5000
+#define GP_ESP_WAIT_RTTS	4
+#define GP_ESP_RETRY_RTTS	2	/* After ESP has failed once */
+#define GP_ESP_PROBE_ROUNDS	3
+
+static int esp_wait_ms(struct openconnect_info *vpninfo)
+{
+	uint64_t wait = vpninfo->https_rtt_usec * GP_ESP_WAIT_RTTS / 1000;
+
+	/* If it was blocked before it probably still is, so don't wait as
+	   long. But a slow link must still get time for a round trip, or
+	   ESP could never win again after one failure. */
+	if (vpninfo->esp_wait_failed)
+		wait = vpninfo->https_rtt_usec * GP_ESP_RETRY_RTTS / 1000;
+
+	if (!vpninfo->https_rtt_usec || wait > GP_ESP_WAIT_MAX)
+		return GP_ESP_WAIT_MAX;
+	if (wait < GP_ESP_WAIT_MIN)
+		return GP_ESP_WAIT_MIN;
+	return wait;
+}
+
+/* Returns non-zero once ESP has had its chance */
+static int esp_wait_expired(struct openconnect_info *vpninfo, int *timeout)
+{
+	uint64_t now = monotonic_usec();
+	int wait = esp_wait_ms(vpninfo);
+	int elapsed, next;
+
+	if (!vpninfo->esp_wait_start) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Waiting up to %d ms for ESP tunnel\n"), wait);
+		vpninfo->esp_wait_start = now;
+		vpninfo->esp_wait_probes = 1;
+	}
+
+	elapsed = (now - vpninfo->esp_wait_start) / 1000;
+	if (elapsed >= wait)
+		return 1;
+
+	next = wait * vpninfo->esp_wait_probes / GP_ESP_PROBE_ROUNDS;
+	if (elapsed >= next) {
+		vpn_progress(vpninfo, PRG_DEBUG, _("Resend ESP probes\n"));
+		if (vpninfo->proto->udp_send_probes)
+			vpninfo->proto->udp_send_probes(vpninfo);
+		vpninfo->esp_wait_probes++;
+		next = wait * vpninfo->esp_wait_probes / GP_ESP_PROBE_ROUNDS;
+	}
+
+	if (*timeout > next - elapsed)
+		*timeout = next - elapsed;
+	return 0;
+}
+
 int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
 	int ret;
@@ -963,15 +1169,37 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	uint16_t ethertype;
 	uint32_t one, zero, magic;
 
+	/* The answer to the HIP report check which gpst_setup() sent */
+	if (vpninfo->hip_check_pending && https_response_ready(vpninfo)) {
+		vpninfo->hip_check_pending = 0;
+		ret = finish_hip_report_check(vpninfo);
+		openconnect_close_https(vpninfo, 0);
+		if (ret == -EAGAIN) {
+			/* Running the script or even resubmitting the report
+			   here would stall the tunnel; gpst_setup() does it */
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Gateway says HIP report submission is needed; reconnecting.\n"));
+			vpninfo->hip_report_stale = 1;
+			goto do_reconnect;
+		} else if (ret == 0)
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Gateway says no HIP report submission is needed.\n"));
+		else
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("HIP report check failed; continuing without\n"));
+	}
+
 	/* Starting the HTTPS tunnel kills ESP, so we avoid starting
 	 * it if the ESP tunnel is connected or connecting.
 	 */
 	switch (vpninfo->dtls_state) {
 	case DTLS_CONNECTING:
-		openconnect_close_https(vpninfo, 0); /* don't keep stale HTTPS socket */
+		if (!vpninfo->hip_check_pending)
+			openconnect_close_https(vpninfo, 0); /* don't keep stale HTTPS socket */
 		vpn_progress(vpninfo, PRG_INFO,
 			     _("ESP tunnel connected; exiting HTTPS mainloop.\n"));
 		vpninfo->dtls_state = DTLS_CONNECTED;
+		vpninfo->esp_wait_failed = 0;
 	case DTLS_CONNECTED:
 		/* Rekey if needed */
 		if (keepalive_action(&vpninfo->ssl_times, timeout) == KA_REKEY)
@@ -979,13 +1207,21 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		return 0;
 	case DTLS_SECRET:
 	case DTLS_SLEEPING:
-		if (!ka_check_deadline(timeout, time(NULL), vpninfo->new_dtls_started + 5)) {
-			/* Allow 5 seconds after configuration for ESP to start */
+		if (!esp_wait_expired(vpninfo, timeout)) {
+			/* Allow ESP a chance to start */
 			return 0;
 		} else {
 			/* ... before we switch to HTTPS instead */
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to connect ESP tunnel; using HTTPS instead.\n"));
+			vpninfo->esp_wait_failed = 1;
+			if (vpninfo->hip_check_pending) {
+				/* The HTTPS tunnel needs the connection */
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("No answer to HIP report check; continuing without\n"));
+				vpninfo->hip_check_pending = 0;
+				openconnect_close_https(vpninfo, 0);
+			}
 			if (gpst_connect(vpninfo)) {
 				vpninfo->quit_reason = "GPST connect failed";
 				return 1;
@@ -1009,6 +1245,11 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		int receive_mtu = MAX(16384, vpninfo->ip_info.mtu);
 		int len, payload_len;
 
+		if (incoming_queue_full(vpninfo)) {
+			unmonitor_read_fd(vpninfo, ssl);
+			break;
+		}
+
 		if (!vpninfo->cstp_pkt) {
 			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + receive_mtu);
 			if (!vpninfo->cstp_pkt) {
@@ -1135,7 +1376,9 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("GPST Dead Peer Detection detected dead peer!\n"));
 	do_reconnect:
-		ret = ssl_reconnect(vpninfo);
+		ret = ssl_reconnect(vpninfo, timeout);
+		if (ret == -EAGAIN)
+			return work_done;
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 			vpninfo->quit_reason = "GPST reconnect failed";
@@ -1149,7 +1392,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		/* No need to send an explicit keepalive
 		   if we have real data to send */
 		if (vpninfo->dtls_state != DTLS_CONNECTED &&
-		    vpninfo->outgoing_queue.head)
+		    outgoing_queue_len(vpninfo))
 			break;
 
 	case KA_DPD:
@@ -1162,7 +1405,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	/* Service outgoing packet queue */
 	while (vpninfo->dtls_state != DTLS_CONNECTED &&
-	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
+	       (vpninfo->current_ssl_pkt = dequeue_outgoing_packet(vpninfo))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
 		/* store header */
@@ -0,0 +1,382 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * Segmentation and coalescing of TCP packets, for a tun device which is
+ * exchanging GSO super-packets with the kernel (see tun.c).
+ *
+ * Outgoing super-packets are queued whole, and only split into segments
+ * of pkt->gso_size when the transport dequeues them for encapsulation.
+ * Incoming packets which are consecutive segments of the same TCP flow
+ * are merged back into a single super-packet before os_write_tun().
+ *
+ * The MSS clamping for --clamp-mss lives here too, since it is the
+ * other thing which rewrites TCP headers on their way through.
+ */
+
+#define TCP_FLAG_FIN	0x01
+#define TCP_FLAG_SYN	0x02
+#define TCP_FLAG_PSH	0x08
+#define TCP_FLAG_ACK	0x10
+#define TCP_FLAG_CWR	0x80
+
+#define TCPOPT_EOL	0
+#define TCPOPT_NOP	1
+#define TCPOPT_MSS	2
+
+#ifndef IPPROTO_TCP
+#define IPPROTO_TCP 6
+#endif
+
+/* RFC1071 one's complement sum, not yet folded or inverted */
+uint32_t csum_partial(const void *buf, int len, uint32_t sum)
+{
+	const unsigned char *p = buf;
+	uint64_t acc = sum;
+
+	while (len > 1) {
+		acc += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+	if (len)
+		acc += p[0] << 8;
+
+	while (acc >> 32)
+		acc = (acc & 0xffffffff) + (acc >> 32);
+	return acc;
+}
+
+uint16_t csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* Sum of the TCP/UDP pseudo-header for the IPv4 or IPv6 header at iph */
+uint32_t csum_pseudo(const unsigned char *iph, int proto, int l4len)
+{
+	if ((iph[0] >> 4) == 4)
+		return csum_partial(iph + 12, 8, proto + l4len);
+	else
+		return csum_partial(iph + 8, 32, proto + l4len);
+}
+
+static void set_tcp_csum(unsigned char *iph, unsigned char *th, int l4len)
+{
+	store_be16(th + 16, 0);
+	store_be16(th + 16, ~csum_fold(csum_partial(th, l4len,
+						    csum_pseudo(iph, IPPROTO_TCP, l4len))));
+}
+
+static void set_ip_csum(unsigned char *iph, int iphl)
+{
+	store_be16(iph + 10, 0);
+	store_be16(iph + 10, ~csum_fold(csum_partial(iph, iphl, 0)));
+}
+
+/* Split a TCP super-packet into segments of pkt->gso_size. The first is
+   returned, and the rest go at the head of vpninfo->outgoing_queue to be
+   sent immediately after it. */
+struct pkt *gso_segment(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	unsigned char *iph = pkt->data;
+	int mss = pkt->gso_size;
+	int iphl, proto, thl, hdrlen, ofs, i;
+	struct pkt_q segs;
+	struct pkt *seg;
+	uint32_t seq;
+
+	if ((iph[0] >> 4) == 4) {
+		iphl = (iph[0] & 0x0f) * 4;
+		proto = iph[9];
+	} else {
+		/* Extension headers would be unusual for locally generated TCP */
+		iphl = 40;
+		proto = iph[6];
+	}
+	if (proto != IPPROTO_TCP || pkt->len < iphl + 20)
+		goto bad;
+
+	thl = (iph[iphl + 12] >> 4) * 4;
+	hdrlen = iphl + thl;
+	if (thl < 20 || pkt->len <= hdrlen || !mss)
+		goto bad;
+
+	seq = load_be32(iph + iphl + 4);
+	memset(&segs, 0, sizeof(segs));
+	init_pkt_queue(&segs);
+
+	for (ofs = hdrlen, i = 0; ofs < pkt->len; ofs += mss, i++) {
+		int seglen = MIN(mss, pkt->len - ofs);
+		unsigned char *sh, *th;
+
+		seg = malloc(sizeof(struct pkt) + hdrlen + seglen + vpninfo->pkt_trailer);
+		if (!seg) {
+			vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
+			while ((seg = dequeue_packet(&segs)))
+				free(seg);
+			free(pkt);
+			return NULL;
+		}
+		seg->tstamp = pkt->tstamp;
+		seg->gso_size = 0;
+		seg->len = hdrlen + seglen;
+		memcpy(seg->data, pkt->data, hdrlen);
+		memcpy(seg->data + hdrlen, pkt->data + ofs, seglen);
+
+		sh = seg->data;
+		th = sh + iphl;
+		if ((sh[0] >> 4) == 4) {
+			store_be16(sh + 2, seg->len);
+			store_be16(sh + 4, load_be16(iph + 4) + i);
+			set_ip_csum(sh, iphl);
+		} else
+			store_be16(sh + 4, seg->len - 40);
+
+		store_be32(th + 4, seq + ofs - hdrlen);
+		if (ofs + seglen < pkt->len)
+			th[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+		if (i)
+			th[13] &= ~TCP_FLAG_CWR;
+		set_tcp_csum(sh, th, thl + seglen);
+
+		queue_packet(&segs, seg);
+	}
+	free(pkt);
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Split GSO packet into %d segments of %d bytes\n"),
+		     segs.count, mss);
+
+	seg = dequeue_packet(&segs);
+	if (segs.head) {
+		*segs.tail = vpninfo->outgoing_queue.head;
+		if (!vpninfo->outgoing_queue.count)
+			vpninfo->outgoing_queue.tail = segs.tail;
+		vpninfo->outgoing_queue.head = segs.head;
+		vpninfo->outgoing_queue.count += segs.count;
+	}
+	return seg;
+
+ bad:
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("Dropping unsupported GSO packet of %d bytes\n"), pkt->len);
+	free(pkt);
+	return NULL;
+}
+
+/* If this is a plain data segment of a TCP flow with a valid checksum,
+   return the length of its payload and set the header lengths. */
+static int tcp_gro_candidate(const struct pkt *pkt, int *iphl, int *thl)
+{
+	const unsigned char *iph = pkt->data;
+	const unsigned char *th;
+	int l4len;
+
+	if (pkt->len >= 40 && (iph[0] >> 4) == 4) {
+		/* No IP options, no fragments */
+		if (iph[0] != 0x45 || iph[9] != IPPROTO_TCP ||
+		    load_be16(iph + 2) != pkt->len || (load_be16(iph + 6) & 0x3fff))
+			return -1;
+		*iphl = 20;
+	} else if (pkt->len >= 60 && (iph[0] >> 4) == 6) {
+		if (iph[6] != IPPROTO_TCP || load_be16(iph + 4) + 40 != pkt->len)
+			return -1;
+		*iphl = 40;
+	} else
+		return -1;
+
+	th = iph + *iphl;
+	*thl = (th[12] >> 4) * 4;
+	l4len = pkt->len - *iphl;
+	if (*thl < 20 || *thl >= l4len)
+		return -1;
+
+	if ((th[13] & ~TCP_FLAG_PSH) != TCP_FLAG_ACK)
+		return -1;
+
+	if (csum_fold(csum_partial(th, l4len, csum_pseudo(iph, IPPROTO_TCP, l4len))) != 0xffff)
+		return -1;
+
+	return l4len - *thl;
+}
+
+static int tcp_gro_same_flow(const struct pkt *a, const struct pkt *b, int iphl, int thl)
+{
+	const unsigned char *ia = a->data, *ib = b->data;
+	const unsigned char *ta = ia + iphl, *tb = ib + iphl;
+
+	if (iphl == 20) {
+		/* TOS, DF, TTL and addresses */
+		if (ia[1] != ib[1] || ia[6] != ib[6] || ia[8] != ib[8] ||
+		    memcmp(ia + 12, ib + 12, 8))
+			return 0;
+	} else {
+		/* Traffic class, flow label, hop limit and addresses */
+		if (memcmp(ia, ib, 4) || ia[7] != ib[7] || memcmp(ia + 8, ib + 8, 32))
+			return 0;
+	}
+
+	/* Ports, then ACK, header length, window and options. The sequence
+	   number is checked by the caller. */
+	return !memcmp(ta, tb, 4) && !memcmp(ta + 8, tb + 8, 5) &&
+		!memcmp(ta + 14, tb + 14, 2) && !memcmp(ta + 20, tb + 20, thl - 20);
+}
+
+/* See if the packets at the head of vpninfo->incoming_queue continue
+   the TCP flow of 'pkt' (which has already been dequeued). If so, build
+   a super-packet of them all in 'out', which must have room for
+   TUN_GSO_MAX bytes, and set out->gso_size. Returns the number of
+   segments merged, or zero if 'pkt' should just be written alone. The
+   caller must dequeue the other segments once it's done with them. */
+int gro_coalesce(struct openconnect_info *vpninfo, struct pkt *pkt, struct pkt *out)
+{
+	struct pkt *next = vpninfo->incoming_queue.head;
+	unsigned char *iph, *th;
+	int iphl, thl, hdrlen, mss, len, nsegs = 1;
+	uint32_t seq;
+
+	if (!next)
+		return 0;
+
+	mss = tcp_gro_candidate(pkt, &iphl, &thl);
+	if (mss <= 0 || (pkt->data[iphl + 13] & TCP_FLAG_PSH))
+		return 0;
+
+	hdrlen = iphl + thl;
+	seq = load_be32(pkt->data + iphl + 4) + mss;
+	len = pkt->len;
+
+	for (; next; next = next->next) {
+		int niphl, nthl, nlen = tcp_gro_candidate(next, &niphl, &nthl);
+
+		if (nlen <= 0 || nlen > mss || niphl != iphl || nthl != thl ||
+		    len + nlen > TUN_GSO_MAX ||
+		    load_be32(next->data + iphl + 4) != seq ||
+		    !tcp_gro_same_flow(pkt, next, iphl, thl))
+			break;
+
+		if (nsegs == 1)
+			memcpy(out->data, pkt->data, pkt->len);
+		memcpy(out->data + len, next->data + hdrlen, nlen);
+		len += nlen;
+		seq += nlen;
+		nsegs++;
+
+		/* A short segment or a push ends the run */
+		if (nlen < mss || (next->data[iphl + 13] & TCP_FLAG_PSH)) {
+			out->data[iphl + 13] |= next->data[iphl + 13] & TCP_FLAG_PSH;
+			break;
+		}
+	}
+	if (nsegs == 1)
+		return 0;
+
+	iph = out->data;
+	th = iph + iphl;
+	out->len = len;
+	out->gso_size = mss;
+	if (iphl == 20) {
+		store_be16(iph + 2, len);
+		set_ip_csum(iph, iphl);
+	} else
+		store_be16(iph + 4, len - 40);
+
+	/* The kernel finishes the checksum for each segment; it wants
+	   just the pseudo-header sum for now. */
+	store_be16(th + 16, csum_fold(csum_pseudo(iph, IPPROTO_TCP, len - iphl)));
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Coalesced %d TCP segments into %d bytes\n"), nsegs, len);
+	return nsegs;
+}
+
+/* Lower the MSS option of a TCP SYN or SYN-ACK, in either direction, so
+   that neither end sends segments too big for the tunnel. */
+void tcp_clamp_mss(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	unsigned char *iph = pkt->data, *th;
+	int iphl, thl, mss, i;
+
+	if (pkt->len >= 40 && (iph[0] >> 4) == 4) {
+		/* Not a later fragment */
+		if (iph[9] != IPPROTO_TCP || (load_be16(iph + 6) & 0x1fff))
+			return;
+		iphl = (iph[0] & 0xf) * 4;
+		mss = vpninfo->ip_info.mtu - 40;
+	} else if (pkt->len >= 60 && (iph[0] >> 4) == 6) {
+		/* Extension headers aren't worth looking past for SYNs */
+		if (iph[6] != IPPROTO_TCP)
+			return;
+		iphl = 40;
+		mss = vpninfo->ip_info.mtu - 60;
+	} else
+		return;
+
+	if (iphl < 20 || pkt->len < iphl + 20)
+		return;
+	th = iph + iphl;
+	thl = (th[12] >> 4) * 4;
+	if (!(th[13] & TCP_FLAG_SYN) || thl < 20 || iphl + thl > pkt->len)
+		return;
+
+	for (i = 20; i < thl; ) {
+		unsigned char *opt = th + i;
+		uint32_t old_be, new_be;
+		int old;
+
+		if (opt[0] == TCPOPT_EOL)
+			break;
+		if (opt[0] == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 2 > thl || opt[1] < 2 || i + opt[1] > thl)
+			break;
+		if (opt[0] != TCPOPT_MSS || opt[1] != 4) {
+			i += opt[1];
+			continue;
+		}
+
+		old = load_be16(opt + 2);
+		if (old <= mss)
+			break;
+		store_be16(opt + 2, mss);
+
+		/* Incremental checksum update (RFC 1624). At an odd offset
+		   the value straddles two 16-bit words, so its bytes count
+		   the other way round. */
+		old_be = old;
+		new_be = mss;
+		if (i & 1) {
+			old_be = ((old & 0xff) << 8) | (old >> 8);
+			new_be = ((mss & 0xff) << 8) | (mss >> 8);
+		}
+		store_be16(th + 16, ~csum_fold((uint16_t)~load_be16(th + 16) +
+					       (uint16_t)~old_be + new_be));
+
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Clamped TCP MSS from %d to %d\n"), old, mss);
+		break;
+	}
+}
@@ -0,0 +1,803 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * Handing an established session over to another process, so that the
+ * binary can be upgraded without taking the tunnel down.
+ *
+ * The new process listens on a UNIX socket. When the old one is told to
+ * detach (OC_CMD_DETACH, or SIGHUP for the command line client) and has
+ * a handover path, it connects there and sends its session state along
+ * with the tun device and the ESP socket, using SCM_RIGHTS. It then
+ * exits without running the vpnc-script or logging out, and the new
+ * process carries on with the same tun device, routes and ESP SAs.
+ *
+ * There's no way to move a live TLS session from one process to another
+ * with either GnuTLS or OpenSSL, so the HTTPS connection (and with it,
+ * Cisco DTLS) is made again by the new process using the cookie, exactly
+ * as it would be after the server dropped it. For GlobalProtect and
+ * Juniper, data carries on flowing over ESP in the meantime.
+ */
+
+#define HANDOVER_MAGIC		"OCHOVER1"
+#define HANDOVER_MAGIC_LEN	8
+#define HANDOVER_MAX_LEN	(1 << 20)
+#define HANDOVER_TIMEOUT	5	/* seconds, for the other process to answer */
+
+/* Both ends are the same host, so native byte order is fine */
+static void put_u32(struct oc_text_buf *buf, uint32_t val)
+{
+	buf_append_bytes(buf, &val, sizeof(val));
+}
+
+static void put_u64(struct oc_text_buf *buf, uint64_t val)
+{
+	buf_append_bytes(buf, &val, sizeof(val));
+}
+
+static void put_str(struct oc_text_buf *buf, const char *str)
+{
+	if (!str) {
+		put_u32(buf, 0xffffffff);
+		return;
+	}
+	put_u32(buf, strlen(str));
+	buf_append_bytes(buf, str, strlen(str));
+}
+
+static void put_split(struct oc_text_buf *buf, struct oc_split_include *inc)
+{
+	struct oc_split_include *this;
+	int n = 0;
+
+	for (this = inc; this; this = this->next)
+		n++;
+	put_u32(buf, n);
+	for (this = inc; this; this = this->next)
+		put_str(buf, this->route);
+}
+
+static void put_esp(struct oc_text_buf *buf, struct esp *esp)
+{
+	put_u32(buf, !!esp->cipher);
+	put_u32(buf, esp->spi);
+	put_u64(buf, esp->seq);
+	put_u64(buf, esp->seq_backlog);
+	buf_append_bytes(buf, esp->enc_key, sizeof(esp->enc_key));
+	buf_append_bytes(buf, esp->hmac_key, sizeof(esp->hmac_key));
+	put_u64(buf, esp->installed);
+	put_u64(buf, esp->bytes);
+	put_u64(buf, esp->retire);
+}
+
+static void put_ka(struct oc_text_buf *buf, struct keepalive_info *ka)
+{
+	put_u32(buf, ka->dpd);
+	put_u32(buf, ka->keepalive);
+	put_u32(buf, ka->rekey);
+	put_u32(buf, ka->rekey_method);
+}
+
+struct ho_reader {
+	const unsigned char *p;
+	int left;
+	int err;
+};
+
+static void get_bytes(struct ho_reader *r, void *dst, int len)
+{
+	if (r->err || r->left < len) {
+		r->err = -EINVAL;
+		memset(dst, 0, len);
+		return;
+	}
+	memcpy(dst, r->p, len);
+	r->p += len;
+	r->left -= len;
+}
+
+static uint32_t get_u32(struct ho_reader *r)
+{
+	uint32_t val;
+
+	get_bytes(r, &val, sizeof(val));
+	return val;
+}
+
+static uint64_t get_u64(struct ho_reader *r)
+{
+	uint64_t val;
+
+	get_bytes(r, &val, sizeof(val));
+	return val;
+}
+
+static char *get_str(struct ho_reader *r)
+{
+	uint32_t len = get_u32(r);
+	char *str;
+
+	if (r->err || len == 0xffffffff)
+		return NULL;
+	if (len > r->left) {
+		r->err = -EINVAL;
+		return NULL;
+	}
+	str = malloc(len + 1);
+	if (!str) {
+		r->err = -ENOMEM;
+		return NULL;
+	}
+	get_bytes(r, str, len);
+	str[len] = 0;
+	return str;
+}
+
+/* The ip_info strings point into the option list, which owns them. Find
+   the received value there, or else add it to the list. */
+static const char *ip_info_str(struct openconnect_info *vpninfo, char *val)
+{
+	struct oc_vpn_option *opt;
+
+	if (!val)
+		return NULL;
+
+	for (opt = vpninfo->cstp_options; opt; opt = opt->next) {
+		if (!strcmp(opt->value, val)) {
+			free(val);
+			return opt->value;
+		}
+	}
+
+	opt = malloc(sizeof(*opt));
+	if (!opt) {
+		free(val);
+		return NULL;
+	}
+	opt->option = strdup("handover");
+	opt->value = val;
+	opt->next = vpninfo->cstp_options;
+	vpninfo->cstp_options = opt;
+	return val;
+}
+
+static void get_split(struct openconnect_info *vpninfo, struct ho_reader *r,
+		      struct oc_split_include **list)
+{
+	uint32_t n = get_u32(r);
+
+	while (!r->err && n--) {
+		struct oc_split_include *inc = malloc(sizeof(*inc));
+
+		if (!inc) {
+			r->err = -ENOMEM;
+			return;
+		}
+		inc->route = ip_info_str(vpninfo, get_str(r));
+		if (!inc->route) {
+			free(inc);
+			return;
+		}
+		inc->next = *list;
+		*list = inc;
+	}
+}
+
+static void get_esp(struct ho_reader *r, struct esp *esp, int *valid)
+{
+	*valid = get_u32(r);
+	esp->spi = get_u32(r);
+	esp->seq = get_u64(r);
+	esp->seq_backlog = get_u64(r);
+	get_bytes(r, esp->enc_key, sizeof(esp->enc_key));
+	get_bytes(r, esp->hmac_key, sizeof(esp->hmac_key));
+	esp->installed = get_u64(r);
+	esp->bytes = get_u64(r);
+	esp->retire = get_u64(r);
+}
+
+static void get_ka(struct ho_reader *r, struct keepalive_info *ka)
+{
+	ka->dpd = get_u32(r);
+	ka->keepalive = get_u32(r);
+	ka->rekey = get_u32(r);
+	ka->rekey_method = get_u32(r);
+	ka->last_rekey = ka->last_tx = ka->last_rx = ka->last_dpd = time(NULL);
+}
+
+static int handover_sockaddr(struct openconnect_info *vpninfo, const char *path,
+			     struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Handover socket path '%s' is too long\n"), path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(sun->sun_path, path);
+	return 0;
+}
+
+static int udp_is_esp(struct openconnect_info *vpninfo)
+{
+	return vpninfo->proto->udp_protocol &&
+		!strcmp(vpninfo->proto->udp_protocol, "ESP");
+}
+
+static int build_handover(struct openconnect_info *vpninfo, struct oc_text_buf *buf,
+			  int send_esp)
+{
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	struct oc_vpn_option *opt;
+	int i, n = 0;
+
+	buf_append_bytes(buf, HANDOVER_MAGIC, HANDOVER_MAGIC_LEN);
+	put_str(buf, vpninfo->proto->name);
+	put_str(buf, vpninfo->hostname);
+	put_str(buf, vpninfo->unique_hostname);
+	put_u32(buf, vpninfo->port);
+	put_str(buf, vpninfo->urlpath);
+	put_str(buf, vpninfo->cookie);
+	put_str(buf, vpninfo->peer_cert ?
+		openconnect_get_peer_cert_hash(vpninfo) : NULL);
+	put_u32(buf, vpninfo->peer_addrlen);
+	if (vpninfo->peer_addrlen)
+		buf_append_bytes(buf, vpninfo->peer_addr, vpninfo->peer_addrlen);
+
+	put_str(buf, vpninfo->ifname);
+	put_u32(buf, vpninfo->tun_vnet_hdr);
+
+	for (opt = vpninfo->cstp_options; opt; opt = opt->next)
+		n++;
+	put_u32(buf, n);
+	for (opt = vpninfo->cstp_options; opt; opt = opt->next) {
+		put_str(buf, opt->option);
+		put_str(buf, opt->value);
+	}
+	put_str(buf, ip->addr);
+	put_str(buf, ip->netmask);
+	put_str(buf, ip->addr6);
+	put_str(buf, ip->netmask6);
+	for (i = 0; i < 3; i++) {
+		put_str(buf, ip->dns[i]);
+		put_str(buf, ip->nbns[i]);
+	}
+	put_str(buf, ip->domain);
+	put_str(buf, ip->proxy_pac);
+	put_u32(buf, ip->mtu);
+	put_split(buf, ip->split_dns);
+	put_split(buf, ip->split_includes);
+	put_split(buf, ip->split_excludes);
+	put_str(buf, ip->gateway_addr);
+
+	put_u64(buf, vpninfo->stats.tx_pkts);
+	put_u64(buf, vpninfo->stats.tx_bytes);
+	put_u64(buf, vpninfo->stats.rx_pkts);
+	put_u64(buf, vpninfo->stats.rx_bytes);
+	put_ka(buf, &vpninfo->ssl_times);
+
+	put_u32(buf, send_esp);
+	if (send_esp) {
+		struct sockaddr_in *sin = (void *)vpninfo->dtls_addr;
+
+		put_u32(buf, vpninfo->dtls_state);
+		put_u32(buf, vpninfo->dtls_fd != -1);
+		/* The port is in the same place for IPv6 */
+		put_u32(buf, ntohs(sin->sin_port));
+		put_u32(buf, vpninfo->esp_hmac);
+		put_u32(buf, vpninfo->esp_enc);
+		put_u32(buf, vpninfo->esp_compr);
+		put_u32(buf, vpninfo->esp_replay_protect);
+		put_u32(buf, vpninfo->esp_lifetime_bytes);
+		put_u32(buf, vpninfo->esp_lifetime_seconds);
+		put_u32(buf, vpninfo->esp_ssl_fallback);
+		put_u32(buf, vpninfo->esp_magic);
+		put_u32(buf, vpninfo->enc_key_len);
+		put_u32(buf, vpninfo->hmac_key_len);
+		put_u32(buf, vpninfo->esp_udp_gso);
+		put_u32(buf, vpninfo->esp_udp_gro);
+		put_u32(buf, vpninfo->dtls_attempt_period);
+		put_ka(buf, &vpninfo->dtls_times);
+		put_u32(buf, vpninfo->current_esp_in);
+		put_esp(buf, &vpninfo->esp_out);
+		for (i = 0; i < ESP_NR_SA_IN; i++)
+			put_esp(buf, &vpninfo->esp_in[i]);
+	}
+
+	return buf_error(buf);
+}
+
+/* Called from the main loop on OC_CMD_DETACH. Returns 0 if the session
+   now belongs to the process listening on vpninfo->handover_path, in
+   which case the tun device and UDP socket have been closed here without
+   any further ado. On failure, the session is left as it was. */
+int handover_send(struct openconnect_info *vpninfo)
+{
+	struct sockaddr_un sun;
+	struct oc_text_buf *buf;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} cmsgbuf;
+	struct timeval tv;
+	int fds[2], nr_fds = 0;
+	int send_esp, sock, ret, len;
+
+	if (!tun_is_up(vpninfo) || vpninfo->script_tun) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Cannot hand over session without a tun device\n"));
+		return -EINVAL;
+	}
+
+	send_esp = udp_is_esp(vpninfo) && vpninfo->dtls_addr &&
+		vpninfo->dtls_state >= DTLS_SECRET && vpninfo->esp_out.cipher;
+
+	ret = handover_sockaddr(vpninfo, vpninfo->handover_path, &sun);
+	if (ret)
+		return ret;
+
+	buf = buf_alloc();
+	ret = build_handover(vpninfo, buf, send_esp);
+	if (ret)
+		goto out;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		ret = -errno;
+		goto out;
+	}
+	if (connect(sock, (void *)&sun, sizeof(sun))) {
+		ret = -errno;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to connect to handover socket %s: %s\n"),
+			     vpninfo->handover_path, strerror(errno));
+		close(sock);
+		goto out;
+	}
+
+#ifdef SO_PEERCRED
+	/* Anyone could have bound the path before the new process did */
+	{
+		struct ucred cred;
+		socklen_t credlen = sizeof(cred);
+
+		if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) ||
+		    (cred.uid != geteuid() && cred.uid != 0)) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Handover socket %s belongs to another user\n"),
+				     vpninfo->handover_path);
+			ret = -EPERM;
+			close(sock);
+			goto out;
+		}
+	}
+#endif
+	/* We're in the main loop; don't let the other end stall us */
+	tv.tv_sec = HANDOVER_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	fds[nr_fds++] = vpninfo->tun_fd;
+	if (send_esp && vpninfo->dtls_fd != -1)
+		fds[nr_fds++] = vpninfo->dtls_fd;
+
+	/* The length goes with the file descriptors, then the state */
+	len = buf->pos;
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = CMSG_SPACE(nr_fds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nr_fds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nr_fds * sizeof(int));
+
+	if (sendmsg(sock, &msg, 0) != sizeof(len) ||
+	    send(sock, buf->data, buf->pos, 0) != buf->pos) {
+		ret = -errno ? : -EIO;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to send session to handover socket: %s\n"),
+			     strerror(-ret));
+		close(sock);
+		goto out;
+	}
+
+	/* Wait for the other end to confirm that it has everything */
+	if (recv(sock, &ret, sizeof(ret), MSG_WAITALL) != sizeof(ret) || ret) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Handover was not accepted by the new process\n"));
+		ret = -EIO;
+		close(sock);
+		goto out;
+	}
+	close(sock);
+
+	/* It's not ours any more. Close our copies without running the
+	   script, and without logging out or sending anything. */
+	unmonitor_read_fd(vpninfo, tun);
+	close(vpninfo->tun_fd);
+	vpninfo->tun_fd = -1;
+	if (send_esp && vpninfo->dtls_fd != -1) {
+		unmonitor_read_fd(vpninfo, dtls);
+		unmonitor_except_fd(vpninfo, dtls);
+		close(vpninfo->dtls_fd);
+		vpninfo->dtls_fd = -1;
+		vpninfo->dtls_state = DTLS_DISABLED;
+	}
+	vpninfo->handed_over = 1;
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Handed over session to %s\n"), vpninfo->handover_path);
+ out:
+	if (buf->data)
+		memset(buf->data, 0, buf->pos);
+	buf_free(buf);
+	return ret;
+}
+
+static int apply_handover(struct openconnect_info *vpninfo, struct ho_reader *r,
+			  int *fds, int nr_fds, char **fingerprint)
+{
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	char *str, *legacy_ifname;
+	uint32_t n;
+	int i, ret, has_esp, has_fd, port, cur, valid[ESP_NR_SA_IN], out_valid;
+	int dtls_state;
+
+	str = get_str(r);
+	if (!str)
+		return -EINVAL;
+	ret = openconnect_set_protocol(vpninfo, str);
+	free(str);
+	if (ret)
+		return ret;
+
+	str = get_str(r);
+	ret = openconnect_set_hostname(vpninfo, str);
+	free(str);
+	if (ret)
+		return ret;
+	vpninfo->unique_hostname = get_str(r);
+	vpninfo->port = get_u32(r);
+	free(vpninfo->urlpath);
+	vpninfo->urlpath = get_str(r);
+	free(vpninfo->cookie);
+	vpninfo->cookie = get_str(r);
+	*fingerprint = get_str(r);
+	vpninfo->peer_addrlen = get_u32(r);
+	if (r->err || vpninfo->peer_addrlen > sizeof(struct sockaddr_storage))
+		return -EINVAL;
+	if (vpninfo->peer_addrlen) {
+		vpninfo->peer_addr = malloc(vpninfo->peer_addrlen);
+		if (!vpninfo->peer_addr)
+			return -ENOMEM;
+		get_bytes(r, vpninfo->peer_addr, vpninfo->peer_addrlen);
+	}
+
+	free(vpninfo->ifname);
+	vpninfo->ifname = get_str(r);
+	vpninfo->tun_vnet_hdr = get_u32(r);
+
+	free_optlist(vpninfo->cstp_options);
+	vpninfo->cstp_options = NULL;
+	free_split_routes(vpninfo);
+	n = get_u32(r);
+	while (!r->err && n--) {
+		struct oc_vpn_option *opt = malloc(sizeof(*opt));
+
+		if (!opt)
+			return -ENOMEM;
+		opt->option = get_str(r);
+		opt->value = get_str(r);
+		if (!opt->option || !opt->value) {
+			free(opt->option);
+			free(opt->value);
+			free(opt);
+			return r->err ? : -EINVAL;
+		}
+		/* Keep the server's order */
+		opt->next = NULL;
+		if (!vpninfo->cstp_options) {
+			vpninfo->cstp_options = opt;
+		} else {
+			struct oc_vpn_option *last = vpninfo->cstp_options;
+
+			while (last->next)
+				last = last->next;
+			last->next = opt;
+		}
+	}
+	ip->addr = ip_info_str(vpninfo, get_str(r));
+	ip->netmask = ip_info_str(vpninfo, get_str(r));
+	ip->addr6 = ip_info_str(vpninfo, get_str(r));
+	ip->netmask6 = ip_info_str(vpninfo, get_str(r));
+	for (i = 0; i < 3; i++) {
+		ip->dns[i] = ip_info_str(vpninfo, get_str(r));
+		ip->nbns[i] = ip_info_str(vpninfo, get_str(r));
+	}
+	ip->domain = ip_info_str(vpninfo, get_str(r));
+	ip->proxy_pac = ip_info_str(vpninfo, get_str(r));
+	ip->mtu = get_u32(r);
+	get_split(vpninfo, r, &ip->split_dns);
+	get_split(vpninfo, r, &ip->split_includes);
+	get_split(vpninfo, r, &ip->split_excludes);
+	free(ip->gateway_addr);
+	ip->gateway_addr = get_str(r);
+
+	vpninfo->stats.tx_pkts = get_u64(r);
+	vpninfo->stats.tx_bytes = get_u64(r);
+	vpninfo->stats.rx_pkts = get_u64(r);
+	vpninfo->stats.rx_bytes = get_u64(r);
+	get_ka(r, &vpninfo->ssl_times);
+
+	has_esp = get_u32(r);
+	if (r->err)
+		return r->err;
+	if (!vpninfo->ifname || nr_fds < 1)
+		return -EINVAL;
+
+	/* The tun device, as set up by the old process and its script.
+	   Now's the time to drop privileges, as if we'd set it up. */
+	openconnect_setup_tun_fd(vpninfo, fds[0]);
+	fds[0] = -1;
+	prepare_script_env(vpninfo);
+	legacy_ifname = openconnect_utf8_to_legacy(vpninfo, vpninfo->ifname);
+	script_setenv(vpninfo, "TUNDEV", legacy_ifname, 0);
+	if (legacy_ifname != vpninfo->ifname)
+		free(legacy_ifname);
+	ret = drop_privileges(vpninfo);
+	if (ret)
+		return ret;
+
+	if (!has_esp)
+		return 0;
+
+	dtls_state = get_u32(r);
+	has_fd = get_u32(r);
+	port = get_u32(r);
+	vpninfo->esp_hmac = get_u32(r);
+	vpninfo->esp_enc = get_u32(r);
+	vpninfo->esp_compr = get_u32(r);
+	vpninfo->esp_replay_protect = get_u32(r);
+	vpninfo->esp_lifetime_bytes = get_u32(r);
+	vpninfo->esp_lifetime_seconds = get_u32(r);
+	vpninfo->esp_ssl_fallback = get_u32(r);
+	vpninfo->esp_magic = get_u32(r);
+	vpninfo->enc_key_len = get_u32(r);
+	vpninfo->hmac_key_len = get_u32(r);
+	vpninfo->esp_udp_gso = get_u32(r);
+	vpninfo->esp_udp_gro = get_u32(r);
+	vpninfo->dtls_attempt_period = get_u32(r);
+	get_ka(r, &vpninfo->dtls_times);
+	cur = get_u32(r);
+	get_esp(r, &vpninfo->esp_out, &out_valid);
+	for (i = 0; i < ESP_NR_SA_IN; i++)
+		get_esp(r, &vpninfo->esp_in[i], &valid[i]);
+	if (r->err)
+		return r->err;
+	if (cur >= ESP_NR_SA_IN || !out_valid || !valid[cur] ||
+	    !vpninfo->peer_addr || (has_fd && nr_fds < 2))
+		return -EINVAL;
+
+	ret = udp_sockaddr(vpninfo, port);
+	if (ret)
+		return ret;
+
+	/* setup_esp_keys() only initialises the current inbound SA, and
+	   resets the counters which we want to carry on from. */
+	if (vpninfo->dtls_state == DTLS_DISABLED)
+		vpninfo->dtls_state = DTLS_NOSECRET;
+	for (i = 0; i < ESP_NR_SA_IN; i++) {
+		struct esp saved_out = vpninfo->esp_out;
+		struct esp saved_in = vpninfo->esp_in[i];
+
+		if (!valid[i])
+			continue;
+		vpninfo->current_esp_in = i;
+		ret = setup_esp_keys(vpninfo, 0);
+		if (ret)
+			return ret;
+
+		vpninfo->esp_out.seq = saved_out.seq;
+		vpninfo->esp_out.installed = saved_out.installed;
+		vpninfo->esp_out.bytes = saved_out.bytes;
+		vpninfo->esp_in[i].seq = saved_in.seq;
+		vpninfo->esp_in[i].seq_backlog = saved_in.seq_backlog;
+		vpninfo->esp_in[i].installed = saved_in.installed;
+		vpninfo->esp_in[i].bytes = saved_in.bytes;
+		vpninfo->esp_in[i].retire = saved_in.retire;
+	}
+	vpninfo->current_esp_in = cur;
+
+	if (!has_fd) {
+		vpninfo->esp_udp_gso = vpninfo->esp_udp_gro = 0;
+		vpninfo->dtls_state = DTLS_SECRET;
+		return 0;
+	}
+
+	vpninfo->dtls_fd = fds[1];
+	fds[1] = -1;
+	set_fd_cloexec(vpninfo->dtls_fd);
+	set_sock_nonblock(vpninfo->dtls_fd);
+	monitor_fd_new(vpninfo, dtls);
+	monitor_read_fd(vpninfo, dtls);
+	monitor_except_fd(vpninfo, dtls);
+	vpninfo->dtls_state = dtls_state;
+	vpninfo->new_dtls_started = time(NULL);
+
+	return dtls_state == DTLS_CONNECTED;
+}
+
+/* Wait on 'path' for an established session to be handed over by
+   another process. Returns 1 if the ESP transport was carried over and
+   is connected, so there's no need to wait for the HTTPS connection
+   before passing traffic, or 0 if the caller needs to make the HTTPS
+   connection (and set up DTLS) as it normally would after
+   authenticating. In both cases the tun device is already set up. */
+int openconnect_handover_recv(struct openconnect_info *vpninfo, const char *path,
+			      char **fingerprint)
+{
+	struct sockaddr_un sun;
+	struct ho_reader r;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} cmsgbuf;
+	struct timeval tv;
+	int fds[2] = { -1, -1 }, nr_fds = 0;
+	int lsock, sock, len, ret, i;
+	unsigned char *buf = NULL;
+
+	ret = handover_sockaddr(vpninfo, path, &sun);
+	if (ret)
+		return ret;
+
+	lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lsock < 0)
+		return -errno;
+	unlink(path);
+	if (bind(lsock, (void *)&sun, sizeof(sun)) || chmod(path, 0600) ||
+	    listen(lsock, 1)) {
+		ret = -errno;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to listen on handover socket %s: %s\n"),
+			     path, strerror(errno));
+		close(lsock);
+		unlink(path);
+		return ret;
+	}
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Waiting for a session to be handed over on %s\n"), path);
+	do {
+		sock = accept(lsock, NULL, NULL);
+	} while (sock < 0 && errno == EINTR);
+	ret = -errno;
+	close(lsock);
+	unlink(path);
+	if (sock < 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to accept handover connection: %s\n"),
+			     strerror(-ret));
+		return ret;
+	}
+
+#ifdef SO_PEERCRED
+	{
+		struct ucred cred;
+		socklen_t credlen = sizeof(cred);
+
+		if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) ||
+		    (cred.uid != geteuid() && cred.uid != 0)) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Handover from another user refused\n"));
+			close(sock);
+			return -EPERM;
+		}
+	}
+#endif
+	/* Don't hang forever if the old process dies part way */
+	tv.tv_sec = HANDOVER_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	ret = -EIO;
+	if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(len))
+		goto out;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nr_fds > 2)
+			nr_fds = 2;
+		memcpy(fds, CMSG_DATA(cmsg), nr_fds * sizeof(int));
+	}
+	if (!nr_fds || (msg.msg_flags & MSG_CTRUNC) ||
+	    len < HANDOVER_MAGIC_LEN || len > HANDOVER_MAX_LEN)
+		goto out;
+
+	buf = malloc(len);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (recv(sock, buf, len, MSG_WAITALL) != len ||
+	    memcmp(buf, HANDOVER_MAGIC, HANDOVER_MAGIC_LEN))
+		goto out;
+
+	r.p = buf + HANDOVER_MAGIC_LEN;
+	r.left = len - HANDOVER_MAGIC_LEN;
+	r.err = 0;
+	ret = apply_handover(vpninfo, &r, fds, nr_fds, fingerprint);
+
+ out:
+	if (ret < 0)
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to receive handed over session: %s\n"),
+			     strerror(-ret));
+	else
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Took over session for %s with tun device %s\n"),
+			     openconnect_get_hostname(vpninfo), vpninfo->ifname);
+
+	/* Tell the old process whether to let go */
+	i = ret < 0 ? ret : 0;
+	if (send(sock, &i, sizeof(i), 0) != sizeof(i) && ret >= 0) {
+		/* It will carry on with the session, so we mustn't */
+		ret = -EIO;
+	}
+	close(sock);
+
+	for (i = 0; i < 2; i++)
+		if (fds[i] != -1)
+			close(fds[i]);
+	if (buf) {
+		memset(buf, 0, len);
+		free(buf);
+	}
+	return ret;
+}
@@ -249,6 +249,8 @@ int gen_authorization_hdr(struct openconnect_info *vpninfo, int proxy,
 
 		if (auth_state->state > AUTH_UNSEEN) {
 			ret = auth_methods[i].authorization(vpninfo, proxy, auth_state, buf);
+			if (!ret && proxy)
+				vpninfo->proxy_auth_last = auth_methods[i].state_index;
 			if (ret == -EAGAIN || !ret)
 				return ret;
 		}
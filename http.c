@@ -810,6 +810,74 @@ void dump_buf_hex(struct openconnect_info *vpninfo, int loglevel, char prefix, u
 	vpn_progress(vpninfo, loglevel, "%c %s\n", prefix, linebuf);
 }
 
+/* A kept-alive connection may have been closed by the server while it
+ * was idle. A healthy idle connection has nothing to read, whereas one
+ * the server has closed has a close_notify alert or EOF waiting. Check
+ * before sending a request, since afterwards we can't tell whether the
+ * server acted on it, and a POST can't safely be repeated. */
+static int https_conn_stale(struct openconnect_info *vpninfo)
+{
+	struct timeval tv = { 0, 0 };
+	fd_set rd_set;
+
+	/* Left over from the last response, in our buffer or the TLS
+	   library's; we've lost track somewhere */
+	if (vpninfo->ssl_rbuf_pos != vpninfo->ssl_rbuf_len ||
+	    openconnect_https_pending(vpninfo))
+		return 1;
+
+	FD_ZERO(&rd_set);
+	FD_SET(vpninfo->ssl_fd, &rd_set);
+	return select(vpninfo->ssl_fd + 1, &rd_set, NULL, NULL, &tv) > 0;
+}
+
+static int build_https_request(struct openconnect_info *vpninfo,
+			       struct oc_text_buf *buf, const char *method,
+			       const char *request_body_type,
+			       struct oc_text_buf *request_body, int auth)
+{
+	int rlen, pad;
+
+	buf_truncate(buf);
+	buf_append(buf, "%s /%s HTTP/1.1\r\n", method, vpninfo->urlpath ?: "");
+	if (auth) {
+		int ret = gen_authorization_hdr(vpninfo, 0, buf);
+		if (ret)
+			return ret;
+
+		/* Forget existing challenges */
+		clear_auth_states(vpninfo, vpninfo->http_auth, 0);
+	}
+	if (vpninfo->proto->add_http_headers)
+		vpninfo->proto->add_http_headers(vpninfo, buf);
+
+	if (request_body_type) {
+		rlen = request_body->pos;
+
+		/* force body length to be a multiple of 64, to avoid leaking
+		 * password length. */
+		pad = 64*(1+rlen/64) - rlen;
+		buf_append(buf, "X-Pad: %0*d\r\n", pad, 0);
+
+		buf_append(buf, "Content-Type: %s\r\n", request_body_type);
+		buf_append(buf, "Content-Length: %d\r\n", (int)rlen);
+	}
+	buf_append(buf, "\r\n");
+
+	if (request_body_type)
+		buf_append_bytes(buf, request_body->data, request_body->pos);
+
+	if (vpninfo->port == 443)
+		vpn_progress(vpninfo, PRG_INFO, "%s https://%s/%s\n",
+			     method, vpninfo->hostname,
+			     vpninfo->urlpath ?: "");
+	else
+		vpn_progress(vpninfo, PRG_INFO, "%s https://%s:%d/%s\n",
+			     method, vpninfo->hostname, vpninfo->port,
+			     vpninfo->urlpath ?: "");
+	return 0;
+}
+
 /* Inputs:
  *  method:             GET or POST
  *  vpninfo->hostname:  Host DNS name
@@ -830,9 +898,9 @@ int do_https_request(struct openconnect_info *vpninfo, const char *method,
 	struct oc_text_buf *buf = buf_alloc();
 	int result;
 	int rq_retry;
-	int rlen, pad;
 	int i, auth = 0;
 	int max_redirects = 10;
+	uint64_t start, connected;
 
 	if (request_body_type && buf_error(request_body))
 		return buf_error(request_body);
@@ -859,43 +927,10 @@ int do_https_request(struct openconnect_info *vpninfo, const char *method,
 	 * So the world gained Yet Another HTTP Implementation. Sorry.
 	 *
 	 */
-	buf_truncate(buf);
-	buf_append(buf, "%s /%s HTTP/1.1\r\n", method, vpninfo->urlpath ?: "");
-	if (auth) {
-		result = gen_authorization_hdr(vpninfo, 0, buf);
-		if (result)
-			goto out;
-
-		/* Forget existing challenges */
-		clear_auth_states(vpninfo, vpninfo->http_auth, 0);
-	}
-	if (vpninfo->proto->add_http_headers)
-		vpninfo->proto->add_http_headers(vpninfo, buf);
-
-	if (request_body_type) {
-		rlen = request_body->pos;
-
-		/* force body length to be a multiple of 64, to avoid leaking
-		 * password length. */
-		pad = 64*(1+rlen/64) - rlen;
-		buf_append(buf, "X-Pad: %0*d\r\n", pad, 0);
-
-		buf_append(buf, "Content-Type: %s\r\n", request_body_type);
-		buf_append(buf, "Content-Length: %d\r\n", (int)rlen);
-	}
-	buf_append(buf, "\r\n");
-
-	if (request_body_type)
-		buf_append_bytes(buf, request_body->data, request_body->pos);
-
-	if (vpninfo->port == 443)
-		vpn_progress(vpninfo, PRG_INFO, "%s https://%s/%s\n",
-			     method, vpninfo->hostname,
-			     vpninfo->urlpath ?: "");
-	else
-		vpn_progress(vpninfo, PRG_INFO, "%s https://%s:%d/%s\n",
-			     method, vpninfo->hostname, vpninfo->port,
-			     vpninfo->urlpath ?: "");
+	result = build_https_request(vpninfo, buf, method, request_body_type,
+				     request_body, auth);
+	if (result)
+		goto out;
 
 	if (buf_error(buf))
 		return buf_free(buf);
@@ -903,6 +938,12 @@ int do_https_request(struct openconnect_info *vpninfo, const char *method,
 	vpninfo->retry_on_auth_fail = 0;
 
  retry:
+	start = connected = monotonic_usec();
+	if (openconnect_https_connected(vpninfo) && https_conn_stale(vpninfo)) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Server closed idle HTTPS connection; reconnecting\n"));
+		openconnect_close_https(vpninfo, 0);
+	}
 	if (openconnect_https_connected(vpninfo)) {
 		/* The session is already connected. If we get a failure on
 		* *sending* the request, try it again immediately with a new
@@ -921,6 +962,7 @@ int do_https_request(struct openconnect_info *vpninfo, const char *method,
 			result = -EIO;
 			goto out;
 		}
+		connected = monotonic_usec();
 	}
 
 	if (vpninfo->dump_http_traffic)
@@ -941,6 +983,26 @@ int do_https_request(struct openconnect_info *vpninfo, const char *method,
 	}
 
 	result = process_http_response(vpninfo, 0, http_auth_hdrs, buf);
+	if (result >= 0) {
+		uint64_t rtt = monotonic_usec() - connected;
+
+		if (!vpninfo->https_rtt_usec || rtt < vpninfo->https_rtt_usec)
+			vpninfo->https_rtt_usec = rtt;
+	}
+
+	/* So we can see where the time goes in a long authentication flow */
+	if (rq_retry)
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("%s /%s: result %d after %lu ms on existing connection\n"),
+			     method, vpninfo->urlpath ?: "", result,
+			     (unsigned long)((monotonic_usec() - start) / 1000));
+	else
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("%s /%s: result %d after %lu ms, including %lu ms to connect\n"),
+			     method, vpninfo->urlpath ?: "", result,
+			     (unsigned long)((monotonic_usec() - start) / 1000),
+			     (unsigned long)((connected - start) / 1000));
+
 	if (result < 0) {
 		goto out;
 	}
@@ -993,6 +1055,164 @@ int do_https_request(struct openconnect_info *vpninfo, const char *method,
 	return result;
 }
 
+/* For a request whose answer isn't needed straight away, so that the
+ * mainloop can carry on while it's outstanding. The request is sent
+ * now. The caller calls https_response_ready() whenever the connection
+ * is readable, until it says the whole answer is in, and then parses it
+ * with finish_https_request(). There is no handling of authentication
+ * or redirects.
+ */
+int start_https_request(struct openconnect_info *vpninfo, const char *method,
+			const char *request_body_type, struct oc_text_buf *request_body)
+{
+	struct oc_text_buf *buf;
+	int result, i;
+
+	if (request_body_type && buf_error(request_body))
+		return buf_error(request_body);
+
+	if (openconnect_https_connected(vpninfo) && https_conn_stale(vpninfo))
+		openconnect_close_https(vpninfo, 0);
+	if ((result = openconnect_open_https(vpninfo))) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to open HTTPS connection to %s\n"),
+			     vpninfo->hostname);
+		return -EIO;
+	}
+
+	buf_free(vpninfo->https_resp);
+	vpninfo->https_resp = buf_alloc();
+
+	buf = buf_alloc();
+	result = build_https_request(vpninfo, buf, method, request_body_type,
+				     request_body, 0);
+	if (!result)
+		result = buf_error(buf);
+	if (result)
+		goto out;
+
+	if (vpninfo->dump_http_traffic)
+		dump_buf(vpninfo, '>', buf->data);
+
+	for (i = 0; i < buf->pos; i += 16384) {
+		result = vpninfo->ssl_write(vpninfo, buf->data + i, MIN(buf->pos - i, 16384) );
+		if (result < 0) {
+			openconnect_close_https(vpninfo, 0);
+			goto out;
+		}
+	}
+	result = 0;
+
+ out:
+	buf_free(buf);
+	return result;
+}
+
+/* Whether 'resp' holds a whole HTTP response. One whose body runs until
+   the connection closes never does; that is noticed by the reader. */
+static int http_response_complete(const char *resp, int len)
+{
+	const char *body = strstr(resp, "\r\n\r\n");
+	const char *line, *end, *te;
+	int bodylen = -1, chunked = 0;
+
+	if (!body)
+		return 0;
+	body += 4;
+
+	for (line = strstr(resp, "\r\n"); line && line < body - 4; line = end) {
+		line += 2;
+		end = strstr(line, "\r\n");
+		if (!strncasecmp(line, "Content-Length:", 15))
+			bodylen = atoi(line + 15);
+		else if (!strncasecmp(line, "Transfer-Encoding:", 18) &&
+			 (te = strstr(line, "chunked")) && te < end)
+			chunked = 1;
+	}
+
+	len -= body - resp;
+	if (chunked)
+		return (len == 5 && !strcmp(body, "0\r\n\r\n")) ||
+			(len > 5 && !strcmp(body + len - 6, "\n0\r\n\r\n"));
+	return bodylen >= 0 && len >= bodylen;
+}
+
+/* Read what has arrived of the answer to start_https_request(), without
+   waiting for more. Returns non-zero once it's all here, or if the
+   connection has failed, so that finish_https_request() won't block. */
+int https_response_ready(struct openconnect_info *vpninfo)
+{
+	struct oc_text_buf *resp = vpninfo->https_resp;
+	char buf[4096];
+	int ret;
+
+	if (!resp || !openconnect_https_connected(vpninfo))
+		return 1;
+
+	while ((ret = ssl_nonblock_read(vpninfo, buf, sizeof(buf))) > 0)
+		buf_append_bytes(resp, buf, ret);
+
+	/* Anything bigger than this has overrun ssl_rbuf */
+	if (ret < 0 || buf_error(resp) || resp->pos > SSL_RBUF_SIZE)
+		return 1;
+	return resp->pos && http_response_complete(resp->data, resp->pos);
+}
+
+/* Returns the length of the body in *form_buf, as do_https_request() */
+int finish_https_request(struct openconnect_info *vpninfo, char **form_buf)
+{
+	struct oc_text_buf *resp = vpninfo->https_resp;
+	struct oc_text_buf *buf;
+	int result;
+
+	*form_buf = NULL;
+	vpninfo->https_resp = NULL;
+	if (!resp || !openconnect_https_connected(vpninfo)) {
+		buf_free(resp);
+		return -ENOTCONN;
+	}
+	if (buf_error(resp) || resp->pos > SSL_RBUF_SIZE) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Response from server is too large\n"));
+		buf_free(resp);
+		return -EINVAL;
+	}
+
+	/* Parse what https_response_ready() read, from memory */
+	if (!vpninfo->ssl_rbuf &&
+	    !(vpninfo->ssl_rbuf = malloc(SSL_RBUF_SIZE))) {
+		buf_free(resp);
+		return -ENOMEM;
+	}
+	memcpy(vpninfo->ssl_rbuf, resp->data, resp->pos);
+	vpninfo->ssl_rbuf_pos = 0;
+	vpninfo->ssl_rbuf_len = resp->pos;
+	buf_free(resp);
+
+	buf = buf_alloc();
+	result = process_http_response(vpninfo, 0, NULL, buf);
+	if (result < 0)
+		goto out;
+	if (vpninfo->dump_http_traffic && buf->pos)
+		dump_buf(vpninfo, '<', buf->data);
+
+	if (!buf->pos || result != 200) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Unexpected %d result from server\n"),
+			     result);
+		result = -EINVAL;
+		goto out;
+	}
+
+	*form_buf = buf->data;
+	buf->data = NULL;
+	result = buf->pos;
+
+ out:
+	buf_free(buf);
+	return result;
+}
+
 char *openconnect_create_useragent(const char *base)
 {
 	char *uagent;
@@ -1342,6 +1562,17 @@ static int process_http_proxy(struct openconnect_info *vpninfo)
 		     _("Requesting HTTP proxy connection to %s:%d\n"),
 		     vpninfo->hostname, vpninfo->port);
 
+	/* If the proxy accepted a method last time, it will want it again.
+	   Start with it rather than waiting for a 407 to offer it. */
+	if (!auth && vpninfo->proxy_auth_preempt >= 0 &&
+	    vpninfo->proxy_auth[vpninfo->proxy_auth_preempt].state == AUTH_UNSEEN) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Sending proxy credentials without waiting to be asked\n"));
+		vpninfo->proxy_auth[vpninfo->proxy_auth_preempt].state = AUTH_AVAILABLE;
+		auth = 1;
+	}
+	vpninfo->proxy_auth_last = -1;
+
  retry:
 	reqbuf = buf_alloc();
 	buf_append(reqbuf, "CONNECT %s:%d HTTP/1.1\r\n", vpninfo->hostname, vpninfo->port);
@@ -1393,8 +1624,12 @@ static int process_http_proxy(struct openconnect_info *vpninfo)
 		goto retry;
 	}
 
-	if (result == 200)
+	if (result == 200) {
+		/* Digest needs a fresh nonce from a challenge each time */
+		if (vpninfo->proxy_auth_last != AUTH_TYPE_DIGEST)
+			vpninfo->proxy_auth_preempt = vpninfo->proxy_auth_last;
 		return 0;
+	}
 
 	vpn_progress(vpninfo, PRG_ERR,
 		     _("Proxy CONNECT request failed: %d\n"), result);
@@ -1441,6 +1676,7 @@ int openconnect_set_http_proxy(struct openconnect_info *vpninfo,
 	vpninfo->proxy_type = NULL;
 	free(vpninfo->proxy);
 	vpninfo->proxy = NULL;
+	vpninfo->proxy_auth_preempt = -1;
 
 	ret = internal_parse_url(url, &vpninfo->proxy_type, &vpninfo->proxy,
 				 &vpninfo->proxy_port, NULL, 80);
@@ -0,0 +1,191 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * When a packet from the tun device is larger than the tunnel MTU, for
+ * example because path MTU discovery has just lowered it, answer with
+ * an ICMP "fragmentation needed" (RFC 792) or ICMPv6 "packet too big"
+ * (RFC 4443) as a router would, so the sender's stack adapts at once
+ * instead of waiting for its own timers. The reply comes from the
+ * original destination, since Linux treats packets from one of its own
+ * addresses as martians. IPv4 packets without DF are left alone.
+ */
+
+#define PTB_RATE	10	/* Replies per second, */
+#define PTB_BURST	10	/* after an initial burst of this many */
+
+#define IPV4_MIN_MTU	576
+#define IPV6_MIN_MTU	1280
+
+#ifndef IPPROTO_ICMP
+#define IPPROTO_ICMP 1
+#endif
+#ifndef IPPROTO_ICMPV6
+#define IPPROTO_ICMPV6 58
+#endif
+
+/* Token bucket, so a bulk transfer can't flood the tun device with them */
+static int ptb_allowed(struct openconnect_info *vpninfo)
+{
+	uint64_t now = monotonic_usec();
+	uint64_t earned = (now - vpninfo->ptb_last) * PTB_RATE / 1000000;
+
+	if (earned) {
+		vpninfo->ptb_tokens = MIN(vpninfo->ptb_tokens + earned, PTB_BURST);
+		vpninfo->ptb_last = now;
+	}
+	if (!vpninfo->ptb_tokens)
+		return 0;
+	vpninfo->ptb_tokens--;
+	return 1;
+}
+
+static struct pkt *ptb_alloc(int len)
+{
+	struct pkt *pkt = calloc(1, sizeof(*pkt) + len);
+
+	if (pkt)
+		pkt->len = len;
+	return pkt;
+}
+
+static struct pkt *build_ptb4(const unsigned char *iph, int len, int mtu)
+{
+	/* As much of the original as fits in the minimum reassembly size */
+	int quote = MIN(len, IPV4_MIN_MTU - 28);
+	unsigned char *ip, *icmp;
+	struct pkt *pkt;
+
+	pkt = ptb_alloc(28 + quote);
+	if (!pkt)
+		return NULL;
+
+	ip = pkt->data;
+	ip[0] = 0x45;
+	store_be16(ip + 2, pkt->len);
+	ip[8] = 64;
+	ip[9] = IPPROTO_ICMP;
+	memcpy(ip + 12, iph + 16, 4);
+	memcpy(ip + 16, iph + 12, 4);
+	store_be16(ip + 10, ~csum_fold(csum_partial(ip, 20, 0)));
+
+	icmp = ip + 20;
+	icmp[0] = 3;	/* Destination unreachable */
+	icmp[1] = 4;	/* Fragmentation needed and DF set */
+	store_be16(icmp + 6, mtu);
+	memcpy(icmp + 8, iph, quote);
+	store_be16(icmp + 2, ~csum_fold(csum_partial(icmp, 8 + quote, 0)));
+
+	return pkt;
+}
+
+static struct pkt *build_ptb6(const unsigned char *iph, int len, int mtu)
+{
+	int quote = MIN(len, IPV6_MIN_MTU - 48);
+	unsigned char *ip, *icmp;
+	struct pkt *pkt;
+
+	pkt = ptb_alloc(48 + quote);
+	if (!pkt)
+		return NULL;
+
+	ip = pkt->data;
+	ip[0] = 0x60;
+	store_be16(ip + 4, 8 + quote);
+	ip[6] = IPPROTO_ICMPV6;
+	ip[7] = 64;
+	memcpy(ip + 8, iph + 24, 16);
+	memcpy(ip + 24, iph + 8, 16);
+
+	icmp = ip + 40;
+	icmp[0] = 2;	/* Packet too big */
+	store_be32(icmp + 4, mtu);
+	memcpy(icmp + 8, iph, quote);
+	store_be16(icmp + 2, ~csum_fold(csum_partial(icmp, 8 + quote,
+						     csum_pseudo(ip, IPPROTO_ICMPV6, 8 + quote))));
+
+	return pkt;
+}
+
+/* Never answer an ICMP error with another one (RFC 1122, RFC 4443) */
+static int is_icmp_error(const unsigned char *iph, int len)
+{
+	if ((iph[0] >> 4) == 4) {
+		int hl = (iph[0] & 0xf) * 4;
+
+		return iph[9] == IPPROTO_ICMP && len > hl &&
+			iph[hl] != 0 && iph[hl] != 8 &&		/* Echo reply/request */
+			iph[hl] != 13 && iph[hl] != 14;		/* Timestamp */
+	}
+	return iph[6] == IPPROTO_ICMPV6 && len > 40 && iph[40] < 128;
+}
+
+/* Returns non-zero if a packet from the tun device is too big for the
+   tunnel and should be dropped. If so, a reply telling the sender the
+   MTU is queued for the tun device. */
+int tun_packet_too_big(struct openconnect_info *vpninfo, const struct pkt *pkt)
+{
+	const unsigned char *iph = pkt->data;
+	int mtu = vpninfo->ip_info.mtu;
+	struct pkt *reply;
+
+	/* The transport splits offload super-packets into segments */
+	if (pkt->len <= mtu || pkt->gso_size)
+		return 0;
+
+	if (pkt->len >= 20 && (iph[0] >> 4) == 4) {
+		/* Not DF, or not the first fragment */
+		if ((load_be16(iph + 6) & 0x5fff) != 0x4000)
+			return 0;
+		if (mtu < IPV4_MIN_MTU) {
+			/* We can't tell it to go lower than this */
+			if (pkt->len <= IPV4_MIN_MTU)
+				return 0;
+			mtu = IPV4_MIN_MTU;
+		}
+	} else if (pkt->len >= 40 && (iph[0] >> 4) == 6) {
+		if (mtu < IPV6_MIN_MTU) {
+			/* We can't tell it to go lower than this */
+			if (pkt->len <= IPV6_MIN_MTU)
+				return 0;
+			mtu = IPV6_MIN_MTU;
+		}
+	} else
+		return 0;
+
+	vpninfo->ptb_dropped++;
+
+	if (is_icmp_error(iph, pkt->len) || !ptb_allowed(vpninfo))
+		return 1;
+
+	if ((iph[0] >> 4) == 4)
+		reply = build_ptb4(iph, pkt->len, mtu);
+	else
+		reply = build_ptb6(iph, pkt->len, mtu);
+	if (!reply)
+		return 1;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Packet of %d bytes is too big for the tunnel; telling sender the MTU is %d\n"),
+		     pkt->len, mtu);
+	queue_packet(&vpninfo->incoming_queue, reply);
+	return 1;
+}
@@ -64,6 +64,7 @@ struct openconnect_info *openconnect_vpninfo_new(const char *useragent,
 #endif
 #ifndef _WIN32
 	vpninfo->tun_fd = -1;
+	vpninfo->ntlm_helper_fd = -1;
 #endif
 	init_pkt_queue(&vpninfo->incoming_queue);
 	init_pkt_queue(&vpninfo->outgoing_queue);
@@ -76,6 +77,8 @@ struct openconnect_info *openconnect_vpninfo_new(const char *useragent,
 	vpninfo->cert_expire_warning = 60 * 86400;
 	vpninfo->req_compr = COMPR_STATELESS;
 	vpninfo->max_qlen = 10;
+	vpninfo->max_incoming_qlen = 64;
+	aqm_default_dscp_bands(vpninfo);
 	vpninfo->localname = strdup("localhost");
 	vpninfo->useragent = openconnect_create_useragent(useragent);
 	vpninfo->validate_peer_cert = validate_peer_cert;
@@ -87,6 +90,7 @@ struct openconnect_info *openconnect_vpninfo_new(const char *useragent,
 	vpninfo->verbose = PRG_TRACE;
 	vpninfo->try_http_auth = 1;
 	vpninfo->proxy_auth[AUTH_TYPE_BASIC].state = AUTH_DEFAULT_DISABLED;
+	vpninfo->proxy_auth_preempt = -1;
 	vpninfo->http_auth[AUTH_TYPE_BASIC].state = AUTH_DEFAULT_DISABLED;
 	openconnect_set_reported_os(vpninfo, NULL);
 
@@ -123,6 +127,7 @@ const struct vpn_proto openconnect_protos[] = {
 		.udp_mainloop = dtls_mainloop,
 		.udp_close = dtls_close,
 		.udp_shutdown = dtls_shutdown,
+		.udp_send_mtu_probe = dtls_send_mtu_probe,
 #endif
 	}, {
 		.name = "nc",
@@ -162,6 +167,7 @@ const struct vpn_proto openconnect_protos[] = {
 		.udp_shutdown = esp_shutdown,
 		.udp_send_probes = esp_send_probes_gp,
 		.udp_catch_probe = esp_catch_probe_gp,
+		.udp_send_mtu_probe = esp_send_mtu_probe_gp,
 #endif
 	},
 	{ /* NULL */ }
@@ -328,6 +334,7 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free_optlist(vpninfo->cstp_options);
 	free_optlist(vpninfo->dtls_options);
 	free_split_routes(vpninfo);
+	free_split_policy(vpninfo);
 	free(vpninfo->hostname);
 	free(vpninfo->unique_hostname);
 	free(vpninfo->urlpath);
@@ -337,9 +344,11 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free(vpninfo->proxy);
 	free(vpninfo->proxy_user);
 	free(vpninfo->proxy_pass);
+	ntlm_helper_close(vpninfo);
 	free(vpninfo->vpnc_script);
 	free(vpninfo->cafile);
 	free(vpninfo->ifname);
+	free(vpninfo->handover_path);
 	free(vpninfo->dtls_cipher);
 #ifdef OPENCONNECT_GNUTLS
 	gnutls_free(vpninfo->cstp_cipher); /* In OpenSSL this is const */
@@ -362,6 +371,7 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free(vpninfo->csd_starturl);
 	free(vpninfo->csd_waiturl);
 	free(vpninfo->csd_preurl);
+	free_hip_report(vpninfo);
 	free(vpninfo->platname);
 	if (vpninfo->opaque_srvdata)
 		xmlFreeNode(vpninfo->opaque_srvdata);
@@ -433,7 +443,15 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	deflateEnd(&vpninfo->deflate_strm);
 
 	free(vpninfo->deflate_pkt);
+	aqm_free(vpninfo);
+	dns_cache_free(vpninfo);
+	free(vpninfo->ssl_rbuf);
+	buf_free(vpninfo->https_resp);
 	free(vpninfo->tun_pkt);
+	free(vpninfo->tun_gro_pkt);
+	free(vpninfo->esp_gro_buf);
+	while (vpninfo->esp_batch_nr)
+		free(vpninfo->esp_batch[--vpninfo->esp_batch_nr]);
 	free(vpninfo->dtls_pkt);
 	free(vpninfo->cstp_pkt);
 	free(vpninfo);
@@ -507,12 +525,14 @@ int openconnect_set_cafile(struct openconnect_info *vpninfo, const char *cafile)
 	UTF8CHECK(cafile);
 
 	STRDUP(vpninfo->cafile, cafile);
+	verify_cache_clear(vpninfo);
 	return 0;
 }
 
 void openconnect_set_system_trust(struct openconnect_info *vpninfo, unsigned val)
 {
 	vpninfo->no_system_trust = !val;
+	verify_cache_clear(vpninfo);
 }
 
 const char *openconnect_get_ifname(struct openconnect_info *vpninfo)
@@ -88,6 +88,11 @@ static int allow_stdin_read;
 
 static char *token_filename;
 static char *server_cert = NULL;
+static char *session_state;
+static char *session_state_key;
+static char *take_over;
+static int fastest_host;
+static char *fastest_host_cache;
 
 static char *username;
 static char *password;
@@ -190,6 +195,20 @@ enum {
 	OPT_SERVER,
 	OPT_PASSTOS,
 	OPT_REQUEST_IP,
+	OPT_INCOMING_QLEN,
+	OPT_UDP_DROP_POLICY,
+	OPT_AQM,
+	OPT_DSCP_PRIORITY,
+	OPT_TUN_OFFLOAD,
+	OPT_UDP_SOCKBUF,
+	OPT_SESSION_STATE,
+	OPT_SESSION_STATE_KEY,
+	OPT_HANDOVER_SOCKET,
+	OPT_TAKE_OVER,
+	OPT_NETLINK_CONFIG,
+	OPT_ENFORCE_SPLIT,
+	OPT_CLAMP_MSS,
+	OPT_FASTEST_HOST,
 };
 
 #ifdef __sun__
@@ -211,6 +230,8 @@ static const struct option long_options[] = {
 	OPTION("syslog", 0, 'l'),
 	OPTION("csd-user", 1, OPT_CSD_USER),
 	OPTION("csd-wrapper", 1, OPT_CSD_WRAPPER),
+	OPTION("handover-socket", 1, OPT_HANDOVER_SOCKET),
+	OPTION("take-over", 1, OPT_TAKE_OVER),
 #endif
 	OPTION("pfs", 0, OPT_PFS),
 	OPTION("certificate", 1, 'c'),
@@ -244,7 +265,18 @@ static const struct option long_options[] = {
 	OPTION("printcookie", 0, OPT_PRINTCOOKIE),
 	OPTION("quiet", 0, 'q'),
 	OPTION("queue-len", 1, 'Q'),
+	OPTION("incoming-queue-len", 1, OPT_INCOMING_QLEN),
+	OPTION("udp-drop-policy", 1, OPT_UDP_DROP_POLICY),
+	OPTION("aqm", 1, OPT_AQM),
+	OPTION("dscp-priority", 2, OPT_DSCP_PRIORITY),
+	OPTION("tun-offload", 0, OPT_TUN_OFFLOAD),
+	OPTION("enforce-split", 0, OPT_ENFORCE_SPLIT),
+	OPTION("clamp-mss", 0, OPT_CLAMP_MSS),
+#ifdef HAVE_LINUX_RTNETLINK_H
+	OPTION("netlink-config", 0, OPT_NETLINK_CONFIG),
+#endif
 	OPTION("xmlconfig", 1, 'x'),
+	OPTION("fastest-host", 2, OPT_FASTEST_HOST),
 	OPTION("cookie-on-stdin", 0, OPT_COOKIE_ON_STDIN),
 	OPTION("passwd-on-stdin", 0, OPT_PASSWORD_ON_STDIN),
 	OPTION("no-passwd", 0, OPT_NO_PASSWD),
@@ -252,6 +284,8 @@ static const struct option long_options[] = {
 	OPTION("dtls-ciphers", 1, OPT_DTLS_CIPHERS),
 	OPTION("authgroup", 1, OPT_AUTHGROUP),
 	OPTION("servercert", 1, OPT_SERVERCERT),
+	OPTION("session-state", 1, OPT_SESSION_STATE),
+	OPTION("session-state-key", 1, OPT_SESSION_STATE_KEY),
 	OPTION("resolve", 1, OPT_RESOLVE),
 	OPTION("key-password-from-fsid", 0, OPT_KEY_PASSWORD_FROM_FSID),
 	OPTION("useragent", 1, OPT_USERAGENT),
@@ -264,6 +298,7 @@ static const struct option long_options[] = {
 	OPTION("force-dpd", 1, OPT_FORCE_DPD),
 	OPTION("non-inter", 0, OPT_NON_INTER),
 	OPTION("dtls-local-port", 1, OPT_DTLS_LOCAL_PORT),
+	OPTION("udp-sockbuf", 1, OPT_UDP_SOCKBUF),
 	OPTION("token-mode", 1, OPT_TOKEN_MODE),
 	OPTION("token-secret", 1, OPT_TOKEN_SECRET),
 	OPTION("os", 1, OPT_OS),
@@ -829,6 +864,7 @@ static void usage(void)
 	printf("      --resolve=HOST:IP           %s\n", _("Use IP when connecting to HOST"));
 	printf("      --passtos                   %s\n", _("copy TOS / TCLASS when using DTLS"));
 	printf("      --dtls-local-port=PORT      %s\n", _("Set local port for DTLS datagrams"));
+	printf("      --udp-sockbuf=BYTES         %s\n", _("Set DTLS/ESP socket buffer size"));
 
 	printf("\n%s:\n", _("Authentication (two-phase)"));
 	printf("  -C, --cookie=COOKIE             %s\n", _("Use WebVPN cookie COOKIE"));
@@ -836,12 +872,16 @@ static void usage(void)
 	printf("      --authenticate              %s\n", _("Authenticate only and print login info"));
 	printf("      --cookieonly                %s\n", _("Fetch webvpn cookie only; don't connect"));
 	printf("      --printcookie               %s\n", _("Print webvpn cookie before connecting"));
+	printf("      --session-state=FILE        %s\n", _("Reuse the session saved in FILE, if possible"));
+	printf("      --session-state-key=FILE    %s\n", _("Key for encrypting the session state"));
 
 #ifndef _WIN32
 	printf("\n%s:\n", _("Process control"));
 	printf("  -b, --background                %s\n", _("Continue in background after startup"));
 	printf("      --pid-file=PIDFILE          %s\n", _("Write the daemon's PID to this file"));
 	printf("  -U, --setuid=USER               %s\n", _("Drop privileges after connecting"));
+	printf("      --handover-socket=PATH      %s\n", _("On SIGHUP, hand the session to --take-over at PATH"));
+	printf("      --take-over=PATH            %s\n", _("Take over a session handed over on PATH"));
 #endif
 
 	printf("\n%s:\n", _("Logging (two-phase)"));
@@ -855,6 +895,12 @@ static void usage(void)
 
 	printf("\n%s:\n", _("VPN configuration script"));
 	printf("  -i, --interface=IFNAME          %s\n", _("Use IFNAME for tunnel interface"));
+#ifdef __linux__
+	printf("      --tun-offload               %s\n", _("Exchange TCP super-packets with the tun device"));
+#endif
+#ifdef HAVE_LINUX_RTNETLINK_H
+	printf("      --netlink-config            %s\n", _("Set addresses and routes directly; run script only if given"));
+#endif
 	printf("  -s, --script=SCRIPT             %s\n", _("Shell command line for using a vpnc-compatible config script"));
 	printf("                                  %s: \"%s\"\n", _("default"), default_vpncscript);
 #ifndef _WIN32
@@ -863,7 +909,10 @@ static void usage(void)
 
 	printf("\n%s:\n", _("Tunnel control"));
 	printf("      --disable-ipv6              %s\n", _("Do not ask for IPv6 connectivity"));
+	printf("      --enforce-split             %s\n", _("Drop traffic which the split tunnel routes don't include"));
+	printf("      --clamp-mss                 %s\n", _("Lower the MSS of TCP connections to fit the tunnel"));
 	printf("  -x, --xmlconfig=CONFIG          %s\n", _("XML config file"));
+	printf("      --fastest-host[=FILE]       %s\n", _("Connect to the XML config host which answers first"));
 	printf("  -m, --mtu=MTU                   %s\n", _("Request MTU from server (legacy servers only)"));
 	printf("      --base-mtu=MTU              %s\n", _("Indicate path MTU to/from server"));
 	printf("  -d, --deflate                   %s\n", _("Enable stateful compression (default is stateless only)"));
@@ -873,6 +922,10 @@ static void usage(void)
 	printf("      --no-dtls                   %s\n", _("Disable DTLS"));
 	printf("      --dtls-ciphers=LIST         %s\n", _("OpenSSL ciphers to support for DTLS"));
 	printf("  -Q, --queue-len=LEN             %s\n", _("Set packet queue limit to LEN pkts"));
+	printf("      --incoming-queue-len=LEN    %s\n", _("Set incoming packet queue limit to LEN pkts"));
+	printf("      --udp-drop-policy=POLICY    %s\n", _("Set UDP overflow policy (none, oldest, newest)"));
+	printf("      --aqm=MODE                  %s\n", _("Outgoing queue management (none, codel, fq_codel)"));
+	printf("      --dscp-priority[=LIST]      %s\n", _("Send EF/CS6/CS7 and LIST DSCP classes first"));
 	printf("      --request-ip=IP             %s\n", _("Request a specific IPv4 address"));
 
 	printf("\n%s:\n", _("Local system information"));
@@ -916,6 +969,30 @@ static char *xstrdup(const char *arg)
 	return ret;
 }
 
+/* Accept numeric DSCP values or the usual names: CSn, AFxy, EF, VA, LE */
+static int parse_dscp(const char *str)
+{
+	char *end;
+	long val;
+
+	if (!strncasecmp(str, "CS", 2) && str[2] >= '0' && str[2] <= '7' && !str[3])
+		return (str[2] - '0') << 3;
+	if (!strncasecmp(str, "AF", 2) && str[2] >= '1' && str[2] <= '4' &&
+	    str[3] >= '1' && str[3] <= '3' && !str[4])
+		return ((str[2] - '0') << 3) | ((str[3] - '0') << 1);
+	if (!strcasecmp(str, "EF"))
+		return DSCP_EF;
+	if (!strcasecmp(str, "VA"))
+		return DSCP_VA;
+	if (!strcasecmp(str, "LE"))
+		return DSCP_LE;
+
+	val = strtol(str, &end, 0);
+	if (end == str || *end || val < 0 || val > 63)
+		return -1;
+	return val;
+}
+
 /* There are three ways to handle config_arg:
  *
  * 1. We only care about it transiently and it can be lost entirely
@@ -1100,7 +1177,14 @@ int main(int argc, char **argv)
 	char *token_str = NULL;
 	oc_token_mode_t token_mode = OC_TOKEN_MODE_NONE;
 	int reconnect_timeout = 300;
+	int qlen_set = 0;
 	int ret;
+	char *state_server = NULL, *state_cert = NULL;
+	char *orig_host = NULL, *orig_path = NULL;
+	char *server;
+	int orig_port = 0;
+	char *handover_cert = NULL;
+	int handover_udp = 0;
 #ifdef HAVE_NL_LANGINFO
 	char *charset;
 #endif
@@ -1186,6 +1270,12 @@ int main(int argc, char **argv)
 		case OPT_CSD_WRAPPER:
 			vpninfo->csd_wrapper = keep_config_arg();
 			break;
+		case OPT_HANDOVER_SOCKET:
+			vpninfo->handover_path = dup_config_arg();
+			break;
+		case OPT_TAKE_OVER:
+			take_over = keep_config_arg();
+			break;
 #endif /* !_WIN32 */
 		case OPT_PROTOCOL:
 			if (openconnect_set_protocol(vpninfo, config_arg))
@@ -1244,6 +1334,12 @@ int main(int argc, char **argv)
 			server_cert = keep_config_arg();
 			openconnect_set_system_trust(vpninfo, 0);
 			break;
+		case OPT_SESSION_STATE:
+			session_state = keep_config_arg();
+			break;
+		case OPT_SESSION_STATE_KEY:
+			session_state_key = keep_config_arg();
+			break;
 		case OPT_RESOLVE:
 			ip = strchr(config_arg, ':');
 			if (!ip) {
@@ -1395,12 +1491,78 @@ int main(int argc, char **argv)
 			vpninfo->disable_ipv6 = 1;
 			break;
 		case 'Q':
+			qlen_set = 1;
 			vpninfo->max_qlen = atol(config_arg);
 			if (!vpninfo->max_qlen) {
 				fprintf(stderr, _("Queue length zero not permitted; using 1\n"));
 				vpninfo->max_qlen = 1;
 			}
 			break;
+		case OPT_INCOMING_QLEN:
+			vpninfo->max_incoming_qlen = atol(config_arg);
+			if (!vpninfo->max_incoming_qlen) {
+				fprintf(stderr, _("Queue length zero not permitted; using 1\n"));
+				vpninfo->max_incoming_qlen = 1;
+			}
+			break;
+		case OPT_UDP_DROP_POLICY:
+			if (!strcmp(config_arg, "none"))
+				vpninfo->udp_drop_policy = UDP_DROP_NONE;
+			else if (!strcmp(config_arg, "oldest"))
+				vpninfo->udp_drop_policy = UDP_DROP_OLDEST;
+			else if (!strcmp(config_arg, "newest"))
+				vpninfo->udp_drop_policy = UDP_DROP_NEWEST;
+			else {
+				fprintf(stderr, _("Invalid UDP drop policy '%s'\n"),
+					config_arg);
+				exit(1);
+			}
+			break;
+		case OPT_AQM:
+			if (!strcmp(config_arg, "none"))
+				vpninfo->aqm_mode = AQM_NONE;
+			else if (!strcmp(config_arg, "codel"))
+				vpninfo->aqm_mode = AQM_CODEL;
+			else if (!strcmp(config_arg, "fq_codel"))
+				vpninfo->aqm_mode = AQM_FQ_CODEL;
+			else {
+				fprintf(stderr, _("Invalid AQM mode '%s'\n"),
+					config_arg);
+				exit(1);
+			}
+			break;
+		case OPT_TUN_OFFLOAD:
+			vpninfo->tun_offload = 1;
+			break;
+		case OPT_ENFORCE_SPLIT:
+			vpninfo->split_enforce = 1;
+			break;
+		case OPT_CLAMP_MSS:
+			vpninfo->clamp_mss = 1;
+			break;
+#ifdef HAVE_LINUX_RTNETLINK_H
+		case OPT_NETLINK_CONFIG:
+			vpninfo->netlink_config = 1;
+			break;
+#endif
+		case OPT_DSCP_PRIORITY:
+			vpninfo->dscp_prio = 1;
+			while (config_arg && *config_arg) {
+				char *sep = strchr(config_arg, ',');
+				int dscp;
+
+				if (sep)
+					*sep = 0;
+				dscp = parse_dscp(config_arg);
+				if (dscp < 0) {
+					fprintf(stderr, _("Invalid DSCP class '%s'\n"),
+						config_arg);
+					exit(1);
+				}
+				vpninfo->dscp_band[dscp] = AQM_BAND_HIGH;
+				config_arg = sep ? sep + 1 : NULL;
+			}
+			break;
 		case 'q':
 			verbose = PRG_ERR;
 			break;
@@ -1419,6 +1581,11 @@ int main(int argc, char **argv)
 			vpninfo->xmlconfig = keep_config_arg();
 			vpninfo->write_new_config = write_new_config;
 			break;
+		case OPT_FASTEST_HOST:
+			fastest_host = 1;
+			if (config_arg)
+				fastest_host_cache = keep_config_arg();
+			break;
 		case OPT_KEY_PASSWORD_FROM_FSID:
 			do_passphrase_from_fsid = 1;
 			break;
@@ -1435,6 +1602,9 @@ int main(int argc, char **argv)
 		case OPT_DTLS_LOCAL_PORT:
 			vpninfo->dtls_local_port = atoi(config_arg);
 			break;
+		case OPT_UDP_SOCKBUF:
+			vpninfo->udp_sockbuf = atoi(config_arg);
+			break;
 		case OPT_TOKEN_MODE:
 			if (strcasecmp(config_arg, "rsa") == 0) {
 				token_mode = OC_TOKEN_MODE_STOKEN;
@@ -1487,12 +1657,22 @@ int main(int argc, char **argv)
 	if (gai_overrides)
 		openconnect_override_getaddrinfo(vpninfo, gai_override_cb);
 
+	/* AQM controls delay by dropping; it needs room in the queue to do so */
+	if (vpninfo->aqm_mode != AQM_NONE && !qlen_set)
+		vpninfo->max_qlen = AQM_DEFAULT_QLEN;
+
 	if (optind < argc - 1) {
 		fprintf(stderr, _("Too many arguments on command line\n"));
 		usage();
-	} else if (optind > argc - 1 && !vpninfo->hostname) {
+	} else if (optind > argc - 1 && !vpninfo->hostname && !take_over && !fastest_host) {
 		fprintf(stderr, _("No server specified\n"));
 		usage();
+	} else if (take_over && optind < argc) {
+		fprintf(stderr, _("The server comes from the session being taken over\n"));
+		usage();
+	} else if (fastest_host && !vpninfo->xmlconfig) {
+		fprintf(stderr, _("--fastest-host needs an XML config file\n"));
+		usage();
 	}
 
 	if (!vpninfo->sslkey)
@@ -1543,14 +1723,41 @@ int main(int argc, char **argv)
 	if (vpninfo->sslkey && do_passphrase_from_fsid)
 		openconnect_passphrase_from_fsid(vpninfo);
 
-	if (config_lookup_host(vpninfo, argv[optind]))
+#ifndef _WIN32
+	if (take_over) {
+		/* This brings the cookie and the server with it */
+		ret = openconnect_handover_recv(vpninfo, take_over, &handover_cert);
+		if (ret < 0)
+			exit(1);
+		handover_udp = ret;
+		if (!server_cert)
+			server_cert = handover_cert;
+	}
+#endif
+
+	server = argv[optind];
+	if (!take_over && fastest_host) {
+		/* Any server given on the command line is the fallback if
+		   none of the hosts in the XML config answers */
+		char *fastest = config_fastest_host(vpninfo, fastest_host_cache);
+
+		if (fastest) {
+			free(vpninfo->hostname);
+			vpninfo->hostname = NULL;
+			server = fastest;
+		} else if (!server && !vpninfo->hostname) {
+			exit(1);
+		}
+	}
+
+	if (!take_over && config_lookup_host(vpninfo, server))
 		exit(1);
 
 	/* The last argument without a corresponding --option is taken
 	 * to be the server URL and overrides any --server option on the
 	 * command line or from a --config */
-	if (!vpninfo->hostname || optind < argc) {
-		char *url = strdup(argv[optind]);
+	if (!take_over && (!vpninfo->hostname || (optind < argc && server == argv[optind]))) {
+		char *url = strdup(server);
 
 		if (openconnect_parse_url(vpninfo, url))
 			exit(1);
@@ -1567,6 +1774,25 @@ int main(int argc, char **argv)
 	}
 	free(urlpath);
 
+	if (session_state && !vpninfo->cookie && !cookieonly) {
+		if (!session_state_key &&
+		    asprintf(&session_state_key, "%s.key", session_state) == -1)
+			exit(1);
+		/* The state is only used for the server it was saved for */
+		if (asprintf(&state_server, "%s:%d/%s", vpninfo->hostname,
+			     vpninfo->port, vpninfo->urlpath ? : "") == -1)
+			exit(1);
+		orig_host = xstrdup(vpninfo->hostname);
+		orig_path = vpninfo->urlpath ? xstrdup(vpninfo->urlpath) : NULL;
+		orig_port = vpninfo->port;
+
+		if (!openconnect_load_session_state(vpninfo, session_state,
+						    session_state_key,
+						    state_server, &state_cert) &&
+		    !server_cert)
+			server_cert = state_cert;
+	}
+
 	if (!vpninfo->cookie && openconnect_obtain_cookie(vpninfo)) {
 		if (vpninfo->csd_scriptname) {
 			unlink(vpninfo->csd_scriptname);
@@ -1592,18 +1818,57 @@ int main(int argc, char **argv)
 			exit(0);
 		}
 	}
-	if (openconnect_make_cstp_connection(vpninfo)) {
+	/* With ESP handed over and running, the HTTPS connection can be
+	   made again from the main loop without holding up traffic */
+	if (handover_udp)
+		ret = 0;
+	else
+		ret = openconnect_make_cstp_connection(vpninfo);
+	if (ret == -EPERM && state_cert) {
+		/* The saved cookie has expired, or been revoked */
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Saved session was rejected; authenticating again\n"));
+		openconnect_set_hostname(vpninfo, orig_host);
+		openconnect_set_urlpath(vpninfo, orig_path);
+		vpninfo->port = orig_port;
+		if (server_cert == state_cert)
+			server_cert = NULL;
+		free(state_cert);
+		state_cert = NULL;
+		free(vpninfo->cookie);
+		vpninfo->cookie = NULL;
+
+		if (openconnect_obtain_cookie(vpninfo)) {
+			fprintf(stderr, _("Failed to obtain WebVPN cookie\n"));
+			openconnect_vpninfo_free(vpninfo);
+			exit(1);
+		}
+		ret = openconnect_make_cstp_connection(vpninfo);
+	}
+	if (ret) {
 		fprintf(stderr, _("Creating SSL connection failed\n"));
 		openconnect_vpninfo_free(vpninfo);
 		exit(1);
 	}
 
-	if (!vpnc_script)
+	/* Only a freshly obtained cookie needs saving */
+	if (state_server && !state_cert)
+		openconnect_save_session_state(vpninfo, session_state,
+					       session_state_key, state_server);
+	free(state_server);
+	free(orig_host);
+	free(orig_path);
+
+	if (!vpnc_script
+#ifdef HAVE_LINUX_RTNETLINK_H
+	    && !vpninfo->netlink_config
+#endif
+	    )
 		vpnc_script = xstrdup(default_vpncscript);
 
 	STRDUP(vpninfo->vpnc_script, vpnc_script);
 
-	if (vpninfo->dtls_state != DTLS_DISABLED &&
+	if (vpninfo->dtls_state != DTLS_DISABLED && !handover_udp &&
 	    openconnect_setup_dtls(vpninfo, 60)) {
 		/* Disable DTLS if we cannot set it up, otherwise
 		 * reconnects end up in infinite loop trying to connect
@@ -1626,8 +1891,16 @@ int main(int argc, char **argv)
 		     (vpninfo->dtls_state == DTLS_DISABLED || vpninfo->dtls_state == DTLS_NOSECRET ? _("disabled") : _("in progress")));
 
 	if (!vpninfo->vpnc_script) {
-		vpn_progress(vpninfo, PRG_INFO,
-			     _("No --script argument provided; DNS and routing are not configured\n"));
+		int routed = 0;
+#ifdef HAVE_LINUX_RTNETLINK_H
+		routed = vpninfo->netlink_config;
+#endif
+		if (routed)
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("No --script argument provided; DNS is not configured\n"));
+		else
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("No --script argument provided; DNS and routing are not configured\n"));
 		vpn_progress(vpninfo, PRG_INFO,
 			     _("See http://www.infradead.org/openconnect/vpnc-script.html\n"));
 	}
@@ -1674,7 +1947,8 @@ int main(int argc, char **argv)
 		vpn_progress(vpninfo, PRG_INFO, _("User requested reconnect\n"));
 	}
 
-	if (fp)
+	/* The new process may have written its own PID there already */
+	if (fp && !vpninfo->handed_over)
 		unlink(pidfile);
 
 	switch (ret) {
@@ -1691,7 +1965,10 @@ int main(int argc, char **argv)
 		ret = 0;
 		break;
 	case -ECONNABORTED:
-		vpn_progress(vpninfo, PRG_INFO, _("User detached from session (SIGHUP); exiting.\n"));
+		if (vpninfo->handed_over)
+			vpn_progress(vpninfo, PRG_INFO, _("Session handed over (SIGHUP); exiting.\n"));
+		else
+			vpn_progress(vpninfo, PRG_INFO, _("User detached from session (SIGHUP); exiting.\n"));
 		ret = 0;
 		break;
 	default:
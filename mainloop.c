@@ -43,6 +43,68 @@ int queue_new_packet(struct pkt_q *q, void *buf, int len)
 	return 0;
 }
 
+/* The network side calls this before reading another packet. If the
+   queue towards the tun device is already full, the caller should stop
+   monitoring its socket; tun_mainloop() will start it again once the
+   queue has drained. For TCP that pushes back on the server through the
+   receive window, instead of letting the queue grow without bound. */
+int incoming_queue_full(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->incoming_queue.count < vpninfo->max_incoming_qlen)
+		return 0;
+
+	if (!vpninfo->incoming_stalled)
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Incoming queue full; pausing network reads\n"));
+	vpninfo->incoming_stalled = 1;
+	return 1;
+}
+
+/* UDP can't push back on the peer, so unless we've been asked to stop
+   reading (and let the kernel drop packets), make room according to
+   the configured policy. Returns zero if the packet was queued, or
+   -ENOSPC if it was not and still belongs to the caller. */
+int queue_incoming_udp_packet(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	if (vpninfo->udp_drop_policy != UDP_DROP_NONE &&
+	    vpninfo->incoming_queue.count >= vpninfo->max_incoming_qlen) {
+		if (vpninfo->udp_drop_policy == UDP_DROP_NEWEST) {
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("Incoming queue full; dropping %d byte packet\n"),
+				     pkt->len);
+			return -ENOSPC;
+		}
+		while (vpninfo->incoming_queue.count >= vpninfo->max_incoming_qlen) {
+			struct pkt *old = dequeue_packet(&vpninfo->incoming_queue);
+
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("Incoming queue full; dropping oldest %d byte packet\n"),
+				     old->len);
+			free(old);
+		}
+	}
+	queue_packet(&vpninfo->incoming_queue, pkt);
+	return 0;
+}
+
+/* Let the network side read again once the incoming queue has drained.
+   Returns non-zero if it did, in which case the caller must make sure
+   the network side gets a chance to run before we sleep; the TLS library
+   may already hold data which select() won't tell us about. */
+static int resume_incoming(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->incoming_stalled ||
+	    vpninfo->incoming_queue.count >= vpninfo->max_incoming_qlen)
+		return 0;
+
+	vpninfo->incoming_stalled = 0;
+	if (vpninfo->ssl_fd != -1)
+		monitor_read_fd(vpninfo, ssl);
+	if (vpninfo->dtls_fd != -1)
+		monitor_read_fd(vpninfo, dtls);
+	return 1;
+}
+
 /* This is here because it's generic and hence can't live in either of the
    tun*.c files for specific platforms */
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
@@ -55,13 +117,18 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		while ((this = dequeue_packet(&vpninfo->incoming_queue)))
 			free(this);
 
-		return 0;
+		return resume_incoming(vpninfo);
 	}
 
 	if (read_fd_monitored(vpninfo, tun)) {
 		struct pkt *out_pkt = vpninfo->tun_pkt;
 		while (1) {
-			int len = vpninfo->ip_info.mtu;
+			int len = max_tunnel_mtu(vpninfo);
+
+			/* With offload, the kernel may give us a whole TCP
+			   super-packet instead of MTU-sized segments */
+			if (vpninfo->tun_vnet_hdr)
+				len = TUN_GSO_MAX;
 
 			if (!out_pkt) {
 				out_pkt = malloc(sizeof(struct pkt) + len + vpninfo->pkt_trailer);
@@ -71,16 +138,43 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 				}
 				out_pkt->len = len;
 			}
+			out_pkt->gso_size = 0;
 
 			if (os_read_tun(vpninfo, out_pkt))
 				break;
 
+			if (vpninfo->split_trie4 && split_policy_drop(vpninfo, out_pkt)) {
+				free(out_pkt);
+				out_pkt = NULL;
+				continue;
+			}
+
+			if (tun_packet_too_big(vpninfo, out_pkt)) {
+				free(out_pkt);
+				out_pkt = NULL;
+				work_done = 1;
+				continue;
+			}
+
+			if (vpninfo->clamp_mss)
+				tcp_clamp_mss(vpninfo, out_pkt);
+
+			if (len > out_pkt->len + 4096) {
+				/* Don't hold on to a 64KiB buffer for a small packet */
+				struct pkt *small = realloc(out_pkt, sizeof(struct pkt) +
+							    out_pkt->len + vpninfo->pkt_trailer);
+				if (small)
+					out_pkt = small;
+			}
+
 			vpninfo->stats.tx_pkts++;
 			vpninfo->stats.tx_bytes += out_pkt->len;
 			work_done = 1;
 
-			if (queue_packet(&vpninfo->outgoing_queue, out_pkt) ==
-			    vpninfo->max_qlen) {
+			/* With AQM the queue makes room for itself by dropping,
+			   so there's no need to stop reading. */
+			if (queue_outgoing_packet(vpninfo, out_pkt) >=
+			    vpninfo->max_qlen && vpninfo->aqm_mode == AQM_NONE) {
 				out_pkt = NULL;
 				unmonitor_read_fd(vpninfo, tun);
 				break;
@@ -88,7 +182,7 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			out_pkt = NULL;
 		}
 		vpninfo->tun_pkt = out_pkt;
-	} else if (vpninfo->outgoing_queue.count < vpninfo->max_qlen) {
+	} else if (outgoing_queue_len(vpninfo) < vpninfo->max_qlen) {
 		monitor_read_fd(vpninfo, tun);
 	}
 
@@ -96,6 +190,9 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 		unmonitor_write_fd(vpninfo, tun);
 
+		if (vpninfo->clamp_mss)
+			tcp_clamp_mss(vpninfo, this);
+
 		if (os_write_tun(vpninfo, this)) {
 			requeue_packet(&vpninfo->incoming_queue, this);
 			break;
@@ -106,35 +203,16 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 		free(this);
 	}
+
+	if (resume_incoming(vpninfo))
+		work_done = 1;
+
 	/* Work is not done if we just got rid of packets off the queue */
 	return work_done;
 }
 
-static int setup_tun_device(struct openconnect_info *vpninfo)
+int drop_privileges(struct openconnect_info *vpninfo)
 {
-	int ret;
-
-	if (vpninfo->setup_tun) {
-		vpninfo->setup_tun(vpninfo->cbdata);
-		if (tun_is_up(vpninfo))
-			return 0;
-	}
-
-#ifndef _WIN32
-	if (vpninfo->use_tun_script) {
-		ret = openconnect_setup_tun_script(vpninfo, vpninfo->vpnc_script);
-		if (ret) {
-			fprintf(stderr, _("Set up tun script failed\n"));
-			return ret;
-		}
-	} else
-#endif
-	ret = openconnect_setup_tun_device(vpninfo, vpninfo->vpnc_script, vpninfo->ifname);
-	if (ret) {
-		fprintf(stderr, _("Set up tun device failed\n"));
-		return ret;
-	}
-
 #if !defined(_WIN32) && !defined(__native_client__)
 	if (vpninfo->uid != getuid()) {
 		int e;
@@ -164,6 +242,34 @@ static int setup_tun_device(struct openconnect_info *vpninfo)
 	return 0;
 }
 
+static int setup_tun_device(struct openconnect_info *vpninfo)
+{
+	int ret;
+
+	if (vpninfo->setup_tun) {
+		vpninfo->setup_tun(vpninfo->cbdata);
+		if (tun_is_up(vpninfo))
+			return 0;
+	}
+
+#ifndef _WIN32
+	if (vpninfo->use_tun_script) {
+		ret = openconnect_setup_tun_script(vpninfo, vpninfo->vpnc_script);
+		if (ret) {
+			fprintf(stderr, _("Set up tun script failed\n"));
+			return ret;
+		}
+	} else
+#endif
+	ret = openconnect_setup_tun_device(vpninfo, vpninfo->vpnc_script, vpninfo->ifname);
+	if (ret) {
+		fprintf(stderr, _("Set up tun device failed\n"));
+		return ret;
+	}
+
+	return drop_privileges(vpninfo);
+}
+
 /* Return value:
  *  = 0, when successfully paused (may call again)
  *  = -EINTR, if aborted locally via OC_CMD_CANCEL
@@ -234,6 +340,8 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			break;
 		did_work += ret;
 
+		dns_refresh(vpninfo, &timeout);
+
 		/* Tun must be last because it will set/clear its bit
 		   in the select_rfds according to the queue length */
 		did_work += tun_mainloop(vpninfo, &timeout);
@@ -247,6 +355,15 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 				ret = -EINTR;
 			} else {
 				ret = -ECONNABORTED;
+#ifndef _WIN32
+				/* If nobody takes the session, keep it */
+				if (vpninfo->handover_path && handover_send(vpninfo)) {
+					vpn_progress(vpninfo, PRG_ERR,
+						     _("Handover failed; continuing with the session\n"));
+					vpninfo->got_cancel_cmd = 0;
+					continue;
+				}
+#endif
 			}
 			vpninfo->got_cancel_cmd = 0;
 			break;
@@ -256,6 +373,7 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			/* close all connections and wait for the user to call
 			   openconnect_mainloop() again */
 			openconnect_close_https(vpninfo, 0);
+			vpninfo->reconnect_pending = 0;
 			if (vpninfo->dtls_state != DTLS_DISABLED) {
 				vpninfo->proto->udp_close(vpninfo);
 				vpninfo->new_dtls_started = 0;
@@ -307,9 +425,12 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 #endif
 	}
 
+	aqm_report_stats(vpninfo);
+
 	if (vpninfo->quit_reason && vpninfo->proto->vpn_close_session)
 		vpninfo->proto->vpn_close_session(vpninfo, vpninfo->quit_reason);
 
+	/* After a handover, the tun device belongs to the new process */
 	if (tun_is_up(vpninfo))
 		os_shutdown_tun(vpninfo);
 	return ret < 0 ? ret : -EIO;
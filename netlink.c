@@ -0,0 +1,544 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * Configure the tun device directly over rtnetlink, instead of leaving
+ * it all to vpnc-script. Thousands of split routes then cost a handful
+ * of sendmsg() calls, instead of a fork and exec of ip(8) each.
+ *
+ * This covers the link, addresses and routes, much as vpnc-script does:
+ *
+ *  - the link is brought up with the tunnel MTU,
+ *  - the internal IPv4 address is added as a /32, with a route to the
+ *    internal network if there's a netmask, and IPv6 with its prefix,
+ *  - a host route to the VPN server is pinned to the path it had before,
+ *  - split includes are routed to the tun device, or if there are none,
+ *    0/1 and 128/1 (::/1 and 8000::/1) override the default route
+ *    without replacing it,
+ *  - split excludes are routed the way they were before we started.
+ *
+ * Routes through the tun device go away with it. Only the host route
+ * and the excludes need removing on disconnect. DNS and anything else
+ * is left to the script, if one was given.
+ */
+
+#define NL_BATCH_SIZE	32768
+#define NL_MSG_MAX	256	/* Largest single message we build */
+
+struct nl_batch {
+	int fd;
+	unsigned char buf[NL_BATCH_SIZE];
+	int len;
+	uint32_t seq;
+	int nr;		/* Messages awaiting an ACK */
+	int ignore_err;	/* e.g. -EEXIST or -ESRCH, which don't matter */
+	int errors;
+};
+
+struct nl_prefix {
+	int family;
+	unsigned char addr[16];
+	int len;
+};
+
+static int nl_open(struct nl_batch *b)
+{
+	struct sockaddr_nl snl;
+	int one = 1, bufsize = 1 << 20;
+
+	memset(b, 0, sizeof(*b));
+	b->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (b->fd < 0)
+		return -errno;
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	if (bind(b->fd, (void *)&snl, sizeof(snl))) {
+		int err = -errno;
+		close(b->fd);
+		return err;
+	}
+	/* Room for a whole batch of ACKs, without the requests echoed */
+	setsockopt(b->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+#ifdef NETLINK_CAP_ACK
+	setsockopt(b->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#else
+	(void)one;
+#endif
+	b->seq = time(NULL);
+	return 0;
+}
+
+/* Send what's batched up, and collect an ACK or error for each message */
+static int nl_flush(struct openconnect_info *vpninfo, struct nl_batch *b)
+{
+	unsigned char rbuf[8192];
+	int ret;
+
+	if (!b->nr)
+		return 0;
+
+	if (send(b->fd, b->buf, b->len, 0) != b->len) {
+		ret = -errno;
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to send netlink message: %s\n"),
+			     strerror(errno));
+		return ret;
+	}
+	b->len = 0;
+
+	while (b->nr) {
+		struct nlmsghdr *n;
+		int len = recv(b->fd, rbuf, sizeof(rbuf), 0);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			vpn_progress(vpninfo, PRG_ERR, _("Failed to receive netlink reply: %s\n"),
+				     strerror(errno));
+			return ret;
+		}
+
+		for (n = (void *)rbuf; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+			struct nlmsgerr *e = NLMSG_DATA(n);
+
+			if (n->nlmsg_type != NLMSG_ERROR)
+				continue;
+			b->nr--;
+			if (e->error && e->error != b->ignore_err) {
+				if (!b->errors++)
+					vpn_progress(vpninfo, PRG_ERR,
+						     _("Netlink request failed: %s\n"),
+						     strerror(-e->error));
+			}
+		}
+	}
+	return 0;
+}
+
+static struct nlmsghdr *nl_msg(struct openconnect_info *vpninfo, struct nl_batch *b,
+			       int type, int flags, const void *hdr, int hdrlen)
+{
+	struct nlmsghdr *n;
+
+	if (b->len + NL_MSG_MAX > sizeof(b->buf) && nl_flush(vpninfo, b))
+		return NULL;
+
+	n = (void *)(b->buf + b->len);
+	memset(n, 0, NLMSG_SPACE(hdrlen));
+	n->nlmsg_len = NLMSG_LENGTH(hdrlen);
+	n->nlmsg_type = type;
+	n->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	n->nlmsg_seq = ++b->seq;
+	memcpy(NLMSG_DATA(n), hdr, hdrlen);
+	return n;
+}
+
+static void nl_attr(struct nlmsghdr *n, int type, const void *data, int len)
+{
+	struct rtattr *rta = (void *)((char *)n + NLMSG_ALIGN(n->nlmsg_len));
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static void nl_done(struct nl_batch *b, struct nlmsghdr *n)
+{
+	b->len += NLMSG_ALIGN(n->nlmsg_len);
+	b->nr++;
+}
+
+static int addr_len(int family)
+{
+	return family == AF_INET6 ? 16 : 4;
+}
+
+static int parse_prefix(const char *str, struct nl_prefix *p)
+{
+	int bits;
+
+	memset(p, 0, sizeof(*p));
+	bits = parse_ip_prefix(str, p->addr, &p->len);
+	if (bits < 0)
+		return bits;
+	p->family = bits == 128 ? AF_INET6 : AF_INET;
+	return 0;
+}
+
+static int nl_route(struct openconnect_info *vpninfo, struct nl_batch *b, int cmd,
+		    const struct nl_prefix *dst, int ifindex, const unsigned char *gw)
+{
+	struct rtmsg rtm;
+	struct nlmsghdr *n;
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = dst->family;
+	rtm.rtm_dst_len = dst->len;
+	rtm.rtm_table = RT_TABLE_MAIN;
+	rtm.rtm_protocol = RTPROT_STATIC;
+	rtm.rtm_scope = gw ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+	rtm.rtm_type = RTN_UNICAST;
+
+	n = nl_msg(vpninfo, b, cmd,
+		   cmd == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+		   &rtm, sizeof(rtm));
+	if (!n)
+		return -EIO;
+	nl_attr(n, RTA_DST, dst->addr, addr_len(dst->family));
+	nl_attr(n, RTA_OIF, &ifindex, sizeof(ifindex));
+	if (gw)
+		nl_attr(n, RTA_GATEWAY, gw, addr_len(dst->family));
+	nl_done(b, n);
+	return 0;
+}
+
+/* Find how 'dst' is routed now, like 'ip route get' */
+static int nl_route_get(struct openconnect_info *vpninfo, const struct nl_prefix *dst,
+			int *oif, unsigned char *gw, int *has_gw)
+{
+	struct nl_batch *b;
+	struct rtmsg rtm;
+	struct nlmsghdr *n;
+	int ret, len;
+
+	b = malloc(sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+	ret = nl_open(b);
+	if (ret) {
+		free(b);
+		return ret;
+	}
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = dst->family;
+	rtm.rtm_dst_len = addr_len(dst->family) * 8;
+	n = nl_msg(vpninfo, b, RTM_GETROUTE, 0, &rtm, sizeof(rtm));
+	n->nlmsg_flags &= ~NLM_F_ACK;
+	nl_attr(n, RTA_DST, dst->addr, addr_len(dst->family));
+
+	ret = -ENOENT;
+	*has_gw = 0;
+	if (send(b->fd, n, n->nlmsg_len, 0) != n->nlmsg_len)
+		goto out;
+	len = recv(b->fd, b->buf, sizeof(b->buf), 0);
+	for (n = (void *)b->buf; len > 0 && NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+		struct rtmsg *r = NLMSG_DATA(n);
+		struct rtattr *rta;
+		int alen;
+
+		if (n->nlmsg_type != RTM_NEWROUTE)
+			continue;
+		alen = RTM_PAYLOAD(n);
+		for (rta = RTM_RTA(r); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+			if (rta->rta_type == RTA_OIF) {
+				memcpy(oif, RTA_DATA(rta), sizeof(*oif));
+				ret = 0;
+			} else if (rta->rta_type == RTA_GATEWAY &&
+				   RTA_PAYLOAD(rta) == addr_len(dst->family)) {
+				memcpy(gw, RTA_DATA(rta), RTA_PAYLOAD(rta));
+				*has_gw = 1;
+			}
+		}
+	}
+ out:
+	close(b->fd);
+	free(b);
+	return ret;
+}
+
+static int sockaddr_prefix(const struct sockaddr *sa, struct nl_prefix *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->family = sa->sa_family;
+	if (p->family == AF_INET) {
+		memcpy(p->addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+		p->len = 32;
+	} else if (p->family == AF_INET6) {
+		memcpy(p->addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+		p->len = 128;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int server_prefix(struct openconnect_info *vpninfo, struct nl_prefix *p)
+{
+	/* With a proxy, this is the proxy's address; that connection
+	   must stay out of the tunnel too */
+	if (!vpninfo->peer_addr)
+		return -EINVAL;
+	return sockaddr_prefix(vpninfo->peer_addr, p);
+}
+
+/* How traffic for each address family left before the VPN came up. Kept
+   so that the same routes can be removed on disconnect. */
+static int find_bypass(struct openconnect_info *vpninfo)
+{
+	struct oc_split_include *exc;
+	struct nl_prefix p;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (vpninfo->nl_bypass[i].oif)
+			continue;
+		/* The server's own path is the natural one to use... */
+		if (!server_prefix(vpninfo, &p) &&
+		    p.family == (i ? AF_INET6 : AF_INET))
+			goto found;
+		/* ...otherwise, however the first exclude would have gone */
+		for (exc = vpninfo->ip_info.split_excludes; exc; exc = exc->next)
+			if (!parse_prefix(exc->route, &p) &&
+			    p.family == (i ? AF_INET6 : AF_INET))
+				goto found;
+		continue;
+	found:
+		nl_route_get(vpninfo, &p, &vpninfo->nl_bypass[i].oif,
+			     vpninfo->nl_bypass[i].gw, &vpninfo->nl_bypass[i].has_gw);
+	}
+	return 0;
+}
+
+static int bypass_route(struct openconnect_info *vpninfo, struct nl_batch *b,
+			int cmd, const struct nl_prefix *p)
+{
+	int i = p->family == AF_INET6;
+
+	if (!vpninfo->nl_bypass[i].oif)
+		return 0;
+	return nl_route(vpninfo, b, cmd, p, vpninfo->nl_bypass[i].oif,
+			vpninfo->nl_bypass[i].has_gw ? vpninfo->nl_bypass[i].gw : NULL);
+}
+
+/* Remove the host route to the server which we added last time, if any */
+static void del_server_route(struct openconnect_info *vpninfo, struct nl_batch *b)
+{
+	struct nl_prefix p;
+
+	if (!sockaddr_prefix((void *)&vpninfo->nl_server, &p))
+		bypass_route(vpninfo, b, RTM_DELROUTE, &p);
+	memset(&vpninfo->nl_server, 0, sizeof(vpninfo->nl_server));
+}
+
+static int nl_add_addr(struct openconnect_info *vpninfo, struct nl_batch *b,
+		       int ifindex, const struct nl_prefix *p)
+{
+	struct ifaddrmsg ifa;
+	struct nlmsghdr *n;
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = p->family;
+	ifa.ifa_prefixlen = p->len;
+	ifa.ifa_index = ifindex;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+
+	n = nl_msg(vpninfo, b, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof(ifa));
+	if (!n)
+		return -EIO;
+	nl_attr(n, IFA_LOCAL, p->addr, addr_len(p->family));
+	nl_attr(n, IFA_ADDRESS, p->addr, addr_len(p->family));
+	nl_done(b, n);
+	return 0;
+}
+
+static int nl_link_up(struct openconnect_info *vpninfo, struct nl_batch *b, int ifindex)
+{
+	struct ifinfomsg ifi;
+	struct nlmsghdr *n;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = ifindex;
+	ifi.ifi_flags = IFF_UP;
+	ifi.ifi_change = IFF_UP;
+
+	n = nl_msg(vpninfo, b, RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+	if (!n)
+		return -EIO;
+	if (vpninfo->ip_info.mtu) {
+		uint32_t mtu = vpninfo->ip_info.mtu;
+		nl_attr(n, IFLA_MTU, &mtu, sizeof(mtu));
+	}
+	nl_done(b, n);
+	return 0;
+}
+
+static void route_split(struct openconnect_info *vpninfo, struct nl_batch *b,
+			int include, int ifindex, int *incs)
+{
+	struct oc_split_include *this;
+	struct nl_prefix p;
+
+	this = include ? vpninfo->ip_info.split_includes : vpninfo->ip_info.split_excludes;
+	for (; this; this = this->next) {
+		if (parse_prefix(this->route, &p)) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     include ? _("Discard bad split include: \"%s\"\n") :
+				     _("Discard bad split exclude: \"%s\"\n"),
+				     this->route);
+			continue;
+		}
+		if (include) {
+			nl_route(vpninfo, b, RTM_NEWROUTE, &p, ifindex, NULL);
+			incs[p.family == AF_INET6]++;
+		} else {
+			bypass_route(vpninfo, b, ifindex ? RTM_NEWROUTE : RTM_DELROUTE, &p);
+		}
+	}
+}
+
+static int nl_connect(struct openconnect_info *vpninfo, struct nl_batch *b, int ifindex)
+{
+	static const struct nl_prefix half_routes[] = {
+		{ AF_INET, { 0 }, 1 },
+		{ AF_INET, { 0x80 }, 1 },
+		{ AF_INET6, { 0 }, 1 },
+		{ AF_INET6, { 0x80 }, 1 },
+	};
+	struct oc_ip_info *ip = &vpninfo->ip_info;
+	struct nl_prefix p, net;
+	char netstr[40];
+	int incs[2] = { 0, 0 };
+	int i;
+
+	/* Before any of our routes can get in the way */
+	find_bypass(vpninfo);
+
+	nl_link_up(vpninfo, b, ifindex);
+
+	if (ip->addr && !parse_prefix(ip->addr, &p)) {
+		nl_add_addr(vpninfo, b, ifindex, &p);
+		if (ip->netmask &&
+		    snprintf(netstr, sizeof(netstr), "%s/%s", ip->addr, ip->netmask) < sizeof(netstr) &&
+		    !parse_prefix(netstr, &net) && net.len < 32) {
+			for (i = net.len; i < 32; i++)
+				net.addr[i / 8] &= ~(0x80 >> (i % 8));
+			nl_route(vpninfo, b, RTM_NEWROUTE, &net, ifindex, NULL);
+		}
+	}
+	/* netmask6 is really "address/prefixlen" */
+	if ((ip->netmask6 && !parse_prefix(ip->netmask6, &p)) ||
+	    (ip->addr6 && !parse_prefix(ip->addr6, &p)))
+		nl_add_addr(vpninfo, b, ifindex, &p);
+
+	/* On reconnect, the server's address may have changed */
+	if (vpninfo->nl_server.ss_family &&
+	    (!vpninfo->peer_addr ||
+	     memcmp(&vpninfo->nl_server, vpninfo->peer_addr, vpninfo->peer_addrlen))) {
+		b->ignore_err = -ESRCH;
+		del_server_route(vpninfo, b);
+	}
+	if (!server_prefix(vpninfo, &p) &&
+	    vpninfo->peer_addrlen <= sizeof(vpninfo->nl_server)) {
+		bypass_route(vpninfo, b, RTM_NEWROUTE, &p);
+		memcpy(&vpninfo->nl_server, vpninfo->peer_addr, vpninfo->peer_addrlen);
+	}
+
+	route_split(vpninfo, b, 1, ifindex, incs);
+	route_split(vpninfo, b, 0, ifindex, NULL);
+
+	/* Everything else, if there are no split includes */
+	for (i = 0; i < 4; i++) {
+		int v6 = half_routes[i].family == AF_INET6;
+
+		if (incs[v6])
+			continue;
+		if (v6 ? !(ip->addr6 || ip->netmask6) : !ip->addr)
+			continue;
+		nl_route(vpninfo, b, RTM_NEWROUTE, &half_routes[i], ifindex, NULL);
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Configured %s with %d IPv4 and %d IPv6 split routes over netlink\n"),
+		     vpninfo->ifname, incs[0], incs[1]);
+	return 0;
+}
+
+static int nl_disconnect(struct openconnect_info *vpninfo, struct nl_batch *b)
+{
+	/* Routes via the tun device will go with it */
+	b->ignore_err = -ESRCH;
+	del_server_route(vpninfo, b);
+	route_split(vpninfo, b, 0, 0, NULL);
+	memset(vpninfo->nl_bypass, 0, sizeof(vpninfo->nl_bypass));
+	return 0;
+}
+
+int netlink_config_tun(struct openconnect_info *vpninfo, const char *reason)
+{
+	struct nl_batch *b;
+	int ifindex, ret;
+
+	if (strcmp(reason, "connect") && strcmp(reason, "reconnect") &&
+	    strcmp(reason, "disconnect"))
+		return 0;
+
+	ifindex = vpninfo->ifname ? if_nametoindex(vpninfo->ifname) : 0;
+	if (!ifindex) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Cannot find interface '%s' to configure\n"),
+			     vpninfo->ifname ? : "");
+		return -ENODEV;
+	}
+
+	b = malloc(sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+	ret = nl_open(b);
+	if (ret) {
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to open netlink socket: %s\n"),
+			     strerror(-ret));
+		free(b);
+		return ret;
+	}
+
+	if (!strcmp(reason, "disconnect"))
+		ret = nl_disconnect(vpninfo, b);
+	else
+		ret = nl_connect(vpninfo, b, ifindex);
+	if (!ret)
+		ret = nl_flush(vpninfo, b);
+	if (!ret && b->errors) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("%d netlink requests failed for %s\n"),
+			     b->errors, reason);
+		ret = -EIO;
+	}
+
+	close(b->fd);
+	free(b);
+	return ret;
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
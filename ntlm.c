@@ -137,8 +137,60 @@ void cleanup_ntlm_auth(struct openconnect_info *vpninfo,
 	}
 }
 
+void ntlm_helper_close(struct openconnect_info *vpninfo)
+{
+}
+
 #else /* !_WIN32 */
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* The helper may have gone away while it was idle; don't die of SIGPIPE */
+static int helper_write(int fd, const char *str)
+{
+	int len = strlen(str);
+
+	return send(fd, str, len, MSG_NOSIGNAL) == len ? 0 : -EIO;
+}
+
+/* The ntlm_auth helper is kept for the life of vpninfo, since starting
+   it (and its handshake with winbindd) is most of the cost of NTLM
+   single-sign-on. Each exchange starts with "YR", which resets it. */
+void ntlm_helper_close(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->ntlm_helper_fd != -1) {
+		close(vpninfo->ntlm_helper_fd);
+		vpninfo->ntlm_helper_fd = -1;
+	}
+	free(vpninfo->ntlm_helper_user);
+	vpninfo->ntlm_helper_user = NULL;
+}
+
+/* Get the type 1 message to start a new exchange */
+static int ntlm_helper_start(struct openconnect_info *vpninfo, int proxy,
+			     struct http_auth_state *auth_state,
+			     struct oc_text_buf *buf)
+{
+	char helperbuf[4096];
+	int len;
+
+	if (helper_write(vpninfo->ntlm_helper_fd, "YR\n"))
+		return -EIO;
+
+	len = read(vpninfo->ntlm_helper_fd, helperbuf, sizeof(helperbuf));
+	if (len < 4 || helperbuf[0] != 'Y' || helperbuf[1] != 'R' ||
+	    helperbuf[2] != ' ' || helperbuf[len - 1] != '\n')
+		return -EIO;
+
+	helperbuf[len - 1] = 0;
+	buf_append(buf, "%sAuthorization: NTLM %s\r\n", proxy ? "Proxy-" : "",
+		   helperbuf + 3);
+	auth_state->ntlm_helper_fd = vpninfo->ntlm_helper_fd;
+	return 0;
+}
+
 static int ntlm_helper_spawn(struct openconnect_info *vpninfo, int proxy,
 			     struct http_auth_state *auth_state,
 			     struct oc_text_buf *buf)
@@ -146,11 +198,6 @@ static int ntlm_helper_spawn(struct openconnect_info *vpninfo, int proxy,
 	char *username;
 	int pipefd[2];
 	pid_t pid;
-	char helperbuf[4096];
-	int len;
-
-	if (access("/usr/bin/ntlm_auth", X_OK))
-		return -errno;
 
 	username = vpninfo->proxy_user;
 	if (!username)
@@ -160,6 +207,19 @@ static int ntlm_helper_spawn(struct openconnect_info *vpninfo, int proxy,
 	if (!username)
 		return -EINVAL;
 
+	if (vpninfo->ntlm_helper_fd != -1) {
+		if (!strcmp(username, vpninfo->ntlm_helper_user) &&
+		    !ntlm_helper_start(vpninfo, proxy, auth_state, buf)) {
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Reusing ntlm_auth helper\n"));
+			return 0;
+		}
+		ntlm_helper_close(vpninfo);
+	}
+
+	if (access("/usr/bin/ntlm_auth", X_OK))
+		return -errno;
+
 #ifdef SOCK_CLOEXEC
 	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pipefd))
 #endif
@@ -212,21 +272,13 @@ static int ntlm_helper_spawn(struct openconnect_info *vpninfo, int proxy,
 	waitpid(pid, NULL, 0);
 	close(pipefd[0]);
 
-	if (write(pipefd[1], "YR\n", 3) != 3) {
-		close(pipefd[1]);
+	vpninfo->ntlm_helper_fd = pipefd[1];
+	vpninfo->ntlm_helper_user = strdup(username);
+	if (!vpninfo->ntlm_helper_user ||
+	    ntlm_helper_start(vpninfo, proxy, auth_state, buf)) {
+		ntlm_helper_close(vpninfo);
 		return -EIO;
 	}
-
-	len = read(pipefd[1], helperbuf, sizeof(helperbuf));
-	if (len < 4 || helperbuf[0] != 'Y' || helperbuf[1] != 'R' ||
-	    helperbuf[2] != ' ' || helperbuf[len - 1] != '\n') {
-		close(pipefd[1]);
-		return -EIO;
-	}
-	helperbuf[len - 1] = 0;
-	buf_append(buf, "%sAuthorization: NTLM %s\r\n", proxy ? "Proxy-" : "",
-		   helperbuf + 3);
-	auth_state->ntlm_helper_fd = pipefd[1];
 	return 0;
 }
 
@@ -238,14 +290,13 @@ static int ntlm_helper_challenge(struct openconnect_info *vpninfo, int proxy,
 	int len;
 
 	if (!auth_state->challenge ||
-	    write(auth_state->ntlm_helper_fd, "TT ", 3) != 3 ||
-	    write(auth_state->ntlm_helper_fd, auth_state->challenge,
-		  strlen(auth_state->challenge)) != strlen(auth_state->challenge) ||
-	    write(auth_state->ntlm_helper_fd, "\n", 1) != 1) {
+	    helper_write(auth_state->ntlm_helper_fd, "TT ") ||
+	    helper_write(auth_state->ntlm_helper_fd, auth_state->challenge) ||
+	    helper_write(auth_state->ntlm_helper_fd, "\n")) {
 	err:
 		vpn_progress(vpninfo, PRG_ERR, _("Error communicating with ntlm_auth helper\n"));
-		close(auth_state->ntlm_helper_fd);
 		auth_state->ntlm_helper_fd = -1;
+		ntlm_helper_close(vpninfo);
 		return -EAGAIN;
 	}
 	len = read(auth_state->ntlm_helper_fd, helperbuf, sizeof(helperbuf));
@@ -274,10 +325,9 @@ static int ntlm_helper_challenge(struct openconnect_info *vpninfo, int proxy,
 void cleanup_ntlm_auth(struct openconnect_info *vpninfo,
 		       struct http_auth_state *auth_state)
 {
-	if (auth_state->state == NTLM_SSO_REQ) {
-		close(auth_state->ntlm_helper_fd);
+	/* The helper itself stays with vpninfo for next time */
+	if (auth_state->state == NTLM_SSO_REQ)
 		auth_state->ntlm_helper_fd = -1;
-	}
 }
 #endif /* !_WIN32 */
 
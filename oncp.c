@@ -907,6 +907,11 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		   handle that */
 		int receive_mtu = MAX(16384, vpninfo->ip_info.mtu);
 
+		if (incoming_queue_full(vpninfo)) {
+			unmonitor_read_fd(vpninfo, ssl);
+			break;
+		}
+
 		len = receive_mtu + vpninfo->pkt_trailer;
 		if (!vpninfo->cstp_pkt) {
 			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + len);
@@ -1080,18 +1085,26 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 					 vpninfo->current_ssl_pkt->len + 22);
 		if (ret < 0) {
 		do_reconnect:
-			/* XXX: Do we have to do this or can we leave it open?
-			 * Perhaps we could even reconnect asynchronously while
-			 * the ESP is still running? */
-#ifdef HAVE_ESP
-			esp_shutdown(vpninfo);
-#endif
-			ret = ssl_reconnect(vpninfo);
+			/* ESP keeps running on its existing keys while we
+			 * reconnect. The new connection negotiates new keys
+			 * (keeping the old inbound SA for stragglers), and ESP
+			 * must then be enabled again. */
+			ret = ssl_reconnect(vpninfo, timeout);
+			if (ret == -EAGAIN)
+				return work_done;
 			if (ret) {
 				vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 				vpninfo->quit_reason = "oNCP reconnect failed";
 				return ret;
 			}
+#ifdef HAVE_ESP
+			if (vpninfo->dtls_state == DTLS_CONNECTED) {
+				/* Switch straight over to the new keys */
+				queue_esp_control(vpninfo, 1);
+				return 1;
+			}
+			esp_close(vpninfo);
+#endif
 			vpninfo->dtls_need_reconnect = 1;
 			return 1;
 		} else if (!ret) {
@@ -1176,7 +1189,9 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("CSTP Dead Peer Detection detected dead peer!\n"));
 	do_reconnect:
-		ret = cstp_reconnect(vpninfo);
+		ret = cstp_reconnect(vpninfo, timeout);
+		if (ret == -EAGAIN)
+			return work_done;
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 			vpninfo->quit_reason = "CSTP reconnect failed";
@@ -1220,7 +1235,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	/* Service outgoing packet queue, if no DTLS */
 	while (vpninfo->dtls_state != DTLS_CONNECTED &&
-	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
+	       (vpninfo->current_ssl_pkt = dequeue_outgoing_packet(vpninfo))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
 		/* Little-endian overall record length */
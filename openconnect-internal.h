@@ -128,6 +128,8 @@
 /****************************************************************************/
 
 struct pkt {
+	uint64_t tstamp; /* When it was queued, for AQM */
+	uint16_t gso_size; /* TCP segment size of a tun offload super-packet */
 	int len;
 	struct pkt *next;
 	union {
@@ -171,6 +173,30 @@ struct pkt {
 #define DTLS_CONNECTING	4	/* ESP probe received; must tell server */
 #define DTLS_CONNECTED	5	/* Server informed and should be sending ESP */
 
+#define UDP_DROP_NONE	0	/* Stop reading UDP when the incoming queue is full */
+#define UDP_DROP_OLDEST	1	/* Discard from the head of the incoming queue */
+#define UDP_DROP_NEWEST	2	/* Discard the packet just received */
+
+#define TUN_GSO_MAX	65535	/* Largest super-packet to/from the tun device */
+
+#define AQM_NONE	0
+#define AQM_CODEL	1
+#define AQM_FQ_CODEL	2
+#define AQM_DEFAULT_QLEN 1024	/* Unless the user set --queue-len */
+
+/* Priority bands, in the order they are served */
+#define AQM_BAND_HIGH	0
+#define AQM_BAND_NORMAL	1
+#define AQM_BAND_LOW	2
+#define AQM_NR_BANDS	3
+
+#define DSCP_LE		1
+#define DSCP_CS1	8
+#define DSCP_VA		44
+#define DSCP_EF		46
+#define DSCP_CS6	48
+#define DSCP_CS7	56
+
 #define COMPR_DEFLATE	(1<<0)
 #define COMPR_LZS	(1<<1)
 #define COMPR_LZ4	(1<<2)
@@ -197,12 +223,42 @@ struct keepalive_info {
 	time_t last_dpd;
 };
 
+#define PMTUD_IDLE	0	/* Not started on this UDP connection */
+#define PMTUD_FAILED	1	/* Peer doesn't answer probes */
+#define PMTUD_BASE	2	/* Confirming that PMTUD_BASE_MTU works */
+#define PMTUD_SEARCHING	3
+#define PMTUD_COMPLETE	4
+
+struct pmtud_info {
+	int state;
+	int max;		/* Negotiated MTU, which probing never exceeds */
+	int good;		/* Largest size known to get through */
+	int bad;		/* Smallest size known not to */
+	int probe_size;		/* Size of the probe in flight, or zero */
+	int probe_count;	/* Lost probes of this size so far */
+	uint32_t probe_id;
+	time_t probe_due;	/* Next probe, or timeout of the one in flight */
+	time_t raise_due;	/* Look for a larger MTU again */
+};
+
 struct pin_cache {
 	struct pin_cache *next;
 	char *token;
 	char *pin;
 };
 
+/* A server certificate chain which verified successfully, so reconnecting
+   to the same server needn't verify it again until this expires. */
+#define VERIFY_CACHE_SIZE 4
+#define VERIFY_CACHE_TTL 3600	/* At most, in case of revocation */
+
+struct verify_cache {
+	unsigned char key[SHA256_SIZE];	/* Hostname and DER of the chain */
+	uint8_t peer_cert_sha1_raw[SHA1_SIZE];
+	uint8_t peer_cert_sha256_raw[SHA256_SIZE];
+	time_t expires;
+};
+
 struct oc_text_buf {
 	char *data;
 	int pos;
@@ -212,6 +268,7 @@ struct oc_text_buf {
 
 #define RECONNECT_INTERVAL_MIN	10
 #define RECONNECT_INTERVAL_MAX	100
+#define SSL_RBUF_SIZE		16384
 
 #define REDIR_TYPE_NONE		0
 #define REDIR_TYPE_NEWHOST	1
@@ -298,6 +355,10 @@ struct vpn_proto {
 
 	/* Catch probe packet confirming the (UDP) session */
 	int (*udp_catch_probe)(struct openconnect_info *vpninfo, struct pkt *p);
+
+	/* Send a packet of 'size' bytes of tunnel MTU which the peer will
+	   answer, calling pmtud_probe_acked() with 'id' */
+	int (*udp_send_mtu_probe)(struct openconnect_info *vpninfo, int size, uint32_t id);
 };
 
 struct pkt_q {
@@ -356,8 +417,17 @@ struct esp {
 	uint32_t spi; /* Stored network-endian */
 	unsigned char enc_key[0x40]; /* Encryption key */
 	unsigned char hmac_key[0x40]; /* HMAC key */
+	time_t installed; /* When the keys were set up... */
+	uint64_t bytes; /* ...and how much they've protected since */
+	time_t retire; /* Inbound SA superseded; accept packets until then */
 };
 
+/* Inbound SAs kept at once, so that a rekey can overlap with packets
+   still arriving under the previous keys */
+#define ESP_NR_SA_IN 4
+
+#define ESP_GSO_MAX_SEGS	64	/* UDP_MAX_SEGMENTS in the kernel */
+
 struct openconnect_info {
 	const struct vpn_proto *proto;
 
@@ -376,12 +446,14 @@ struct openconnect_info {
 	uint32_t esp_lifetime_seconds;
 	uint32_t esp_ssl_fallback;
 	int current_esp_in;
-	int old_esp_maxseq;
-	struct esp esp_in[2];
+	struct esp esp_in[ESP_NR_SA_IN];
 	struct esp esp_out;
 	int enc_key_len;
 	int hmac_key_len;
 	uint32_t esp_magic;  /* GlobalProtect magic ping address (network-endian) */
+	uint64_t esp_wait_start;	/* GlobalProtect: when we started waiting for ESP */
+	int esp_wait_probes;		/* ... and how many rounds of probes we sent */
+	int esp_wait_failed;		/* ESP didn't answer last time */
 
 	int tncc_fd; /* For Juniper TNCC */
 	const char *csd_xmltag;
@@ -396,6 +468,11 @@ struct openconnect_info {
 	char *csd_starturl;
 	char *csd_waiturl;
 	char *csd_preurl;
+	char *hip_report;		/* GlobalProtect HIP report last accepted, */
+	char *hip_report_ip;		/* ... the client IP it was made for, */
+	unsigned char hip_report_hash[16];	/* ... and its MD5 */
+	int hip_check_pending;		/* Answer to HIP check not read yet */
+	int hip_report_stale;		/* Gateway wants a new HIP report */
 
 	char *csd_scriptname;
 	xmlNode *opaque_srvdata;
@@ -417,6 +494,12 @@ struct openconnect_info {
 	int try_http_auth;
 	struct http_auth_state http_auth[MAX_AUTH_TYPES];
 	struct http_auth_state proxy_auth[MAX_AUTH_TYPES];
+	int proxy_auth_last;		/* Auth type of the last Proxy-Authorization: */
+	int proxy_auth_preempt;		/* ... and the one the proxy accepted */
+#ifndef _WIN32
+	int ntlm_helper_fd;		/* Persistent ntlm_auth helper */
+	char *ntlm_helper_user;
+#endif
 
 	char *localname;
 	char *hostname;
@@ -503,12 +586,16 @@ struct openconnect_info {
 	PKCS11_SLOT *pkcs11_cert_slot;
 	unsigned char *pkcs11_cert_id;
 	size_t pkcs11_cert_id_len;
+	PKCS11_SLOT *pkcs11_key_slot;	/* To log in again if the token logs us out */
  #endif
+	int pkcs11_relogin_tried;	/* Already retrying after logging in again */
 	X509 *cert_x509;
 	SSL_CTX *https_ctx;
 	SSL *https_ssl;
+	SSL_SESSION *https_sess_cache;	/* For resumption on reconnect */
 #elif defined(OPENCONNECT_GNUTLS)
 	gnutls_session_t https_sess;
+	gnutls_datum_t https_sess_data;	/* For resumption on reconnect */
 	gnutls_certificate_credentials_t https_cred;
 	gnutls_psk_client_credentials_t psk_cred;
 	char local_cert_md5[MD5_SIZE * 2 + 1]; /* For CSD */
@@ -521,6 +608,10 @@ struct openconnect_info {
 	TSS_HPOLICY tpm_key_policy;
 #endif
 #endif /* OPENCONNECT_GNUTLS */
+	char *https_sess_host;		/* Server the cached session is for */
+	int https_sess_port;
+	struct verify_cache verify_cache[VERIFY_CACHE_SIZE];
+	uint64_t https_rtt_usec;	/* Quickest HTTP request, as an upper bound on RTT */
 	struct pin_cache *pin_cache;
 	struct keepalive_info ssl_times;
 	int owe_ssl_dpd_response;
@@ -535,6 +626,7 @@ struct openconnect_info {
 	struct pkt *cstp_pkt;
 	struct pkt *dtls_pkt;
 	struct pkt *tun_pkt;
+	struct pkt *tun_gro_pkt; /* For coalescing incoming TCP segments into */
 	int pkt_trailer; /* How many bytes after payload for encryption (ESP HMAC) */
 
 	z_stream inflate_strm;
@@ -545,6 +637,10 @@ struct openconnect_info {
 	int disable_ipv6;
 	int reconnect_timeout;
 	int reconnect_interval;
+	int reconnect_pending;	/* TCP reconnection in progress... */
+	time_t reconnect_due;	/* ...with the next attempt due at this time */
+	int reconnect_left;
+	int reconnect_cur_interval;
 	int dtls_attempt_period;
 	time_t new_dtls_started;
 #if defined(OPENCONNECT_OPENSSL)
@@ -579,6 +675,17 @@ struct openconnect_info {
 #endif
 	int use_tun_script;
 	int script_tun;
+#ifdef HAVE_LINUX_RTNETLINK_H
+	int netlink_config;	/* Set up addresses and routes ourselves */
+	struct {
+		int oif, has_gw;
+		unsigned char gw[16];
+	} nl_bypass[2];		/* Pre-VPN path for IPv4, IPv6 */
+	struct sockaddr_storage nl_server;	/* Whose host route we added */
+#endif
+	int split_enforce;	/* Drop tun packets outside split includes */
+	struct split_trie *split_trie4, *split_trie6;
+	uint64_t split_dropped;
 	char *ifname;
 	char *cmd_ifname;
 
@@ -587,6 +694,11 @@ struct openconnect_info {
 
 	struct oc_ip_info ip_info;
 	int cstp_basemtu; /* Returned by server */
+	struct pmtud_info pmtud;
+	uint64_t ptb_last;	/* ICMP too-big replies to the tun device */
+	int ptb_tokens;
+	uint64_t ptb_dropped;
+	int clamp_mss;		/* Rewrite the MSS of TCP SYNs to fit */
 
 #ifdef _WIN32
 	long dtls_monitored, ssl_monitored, cmd_monitored, tun_monitored;
@@ -621,10 +733,22 @@ struct openconnect_info {
 	int got_cancel_cmd;
 	int got_pause_cmd;
 	char cancel_type;
+	char *handover_path;	/* Hand the session over here on detach */
+	int handed_over;
+
+	int tun_offload;	/* User asked for GSO/GRO with the tun device */
+	int tun_vnet_hdr;	/* Tun packets have a virtio_net_hdr prefix */
 
 	struct pkt_q incoming_queue;
 	struct pkt_q outgoing_queue;
 	int max_qlen;
+	int max_incoming_qlen;
+	int incoming_stalled;
+	int udp_drop_policy;
+	int aqm_mode;
+	int dscp_prio;
+	unsigned char dscp_band[64];
+	struct oc_aqm *aqm;
 	struct oc_stats stats;
 	openconnect_stats_vfn stats_handler;
 
@@ -633,12 +757,24 @@ struct openconnect_info {
 	struct sockaddr *dtls_addr;
 
 	int dtls_local_port;
+	int udp_sockbuf;	/* SO_SNDBUF/SO_RCVBUF for DTLS/ESP, if set by user */
+	int esp_udp_gso;	/* ESP socket accepts UDP_SEGMENT */
+	int esp_udp_gro;	/* ESP socket returns coalesced datagrams */
+	unsigned char *esp_gro_buf;
+	/* Encrypted ESP packets to be sent together with UDP_SEGMENT. The
+	   first esp_batch_stalled of them are waiting for room in the socket,
+	   and the rest for the next batch. */
+	struct pkt *esp_batch[ESP_GSO_MAX_SEGS + 1];
+	int esp_batch_len[ESP_GSO_MAX_SEGS + 1];
+	int esp_batch_nr;
+	int esp_batch_stalled;
 
 	int req_compr; /* What we requested */
 	int cstp_compr; /* Accepted for CSTP */
 	int dtls_compr; /* Accepted for DTLS */
 
 	int is_dyndns; /* Attempt to redo DNS lookup on each CSTP reconnect */
+	struct oc_dns_entry *dns_cache;
 	char *useragent;
 
 	const char *quit_reason;
@@ -657,6 +793,12 @@ struct openconnect_info {
 	int (*ssl_read)(struct openconnect_info *vpninfo, char *buf, size_t len);
 	int (*ssl_gets)(struct openconnect_info *vpninfo, char *buf, size_t len);
 	int (*ssl_write)(struct openconnect_info *vpninfo, char *buf, size_t len);
+
+	/* Read-ahead from the HTTPS connection, for openconnect_SSL_gets() */
+	unsigned char *ssl_rbuf;
+	int ssl_rbuf_pos;
+	int ssl_rbuf_len;
+	struct oc_text_buf *https_resp;	/* Answer to start_https_request() so far */
 };
 
 #ifdef _WIN32
@@ -772,6 +914,12 @@ static inline int tun_is_up(struct openconnect_info *vpninfo)
 #endif
 }
 
+/* For receive buffers, which must not shrink while probing the MTU */
+static inline int max_tunnel_mtu(struct openconnect_info *vpninfo)
+{
+	return MAX(vpninfo->ip_info.mtu, vpninfo->pmtud.max);
+}
+
 #ifdef _WIN32
 #define pipe(fds) _pipe(fds, 4096, O_BINARY)
 int openconnect__win32_sock_init();
@@ -821,13 +969,35 @@ int script_setenv_int(struct openconnect_info *vpninfo, const char *opt, int val
 void prepare_script_env(struct openconnect_info *vpninfo);
 int script_config_tun(struct openconnect_info *vpninfo, const char *reason);
 int apply_script_env(struct oc_vpn_option *envs);
+int parse_ip_prefix(const char *route, unsigned char *addr, int *plen);
 void free_split_routes(struct openconnect_info *vpninfo);
+int setup_split_policy(struct openconnect_info *vpninfo);
+void free_split_policy(struct openconnect_info *vpninfo);
+int split_policy_drop(struct openconnect_info *vpninfo, const struct pkt *pkt);
+
+/* split-trie.c */
+#define SPLIT_INCLUDE	1
+#define SPLIT_EXCLUDE	2
+struct split_trie;
+struct split_trie *split_trie_new(int bits);
+int split_trie_insert(struct split_trie *t, const unsigned char *addr,
+		      int plen, unsigned char val);
+int split_trie_compile(struct split_trie *t);
+int split_trie_lookup(const struct split_trie *t, const unsigned char *addr);
+size_t split_trie_size(const struct split_trie *t);
+void split_trie_free(struct split_trie *t);
+
+/* netlink.c */
+#ifdef HAVE_LINUX_RTNETLINK_H
+int netlink_config_tun(struct openconnect_info *vpninfo, const char *reason);
+#endif
 
 /* tun.c / tun-win32.c */
 void os_shutdown_tun(struct openconnect_info *vpninfo);
 int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt);
 int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt);
 intptr_t os_setup_tun(struct openconnect_info *vpninfo);
+int os_set_tun_mtu(struct openconnect_info *vpninfo);
 
 /* {gnutls,openssl}-dtls.c */
 int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd);
@@ -841,7 +1011,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout);
 void dtls_close(struct openconnect_info *vpninfo);
 void dtls_shutdown(struct openconnect_info *vpninfo);
 void append_dtls_ciphers(struct openconnect_info *vpninfo, struct oc_text_buf *buf);
-void dtls_detect_mtu(struct openconnect_info *vpninfo);
+int dtls_send_mtu_probe(struct openconnect_info *vpninfo, int size, uint32_t id);
 int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t len, unsigned ms);
 int openconnect_dtls_write(struct openconnect_info *vpninfo, void *buf, size_t len);
 char *openconnect_bin2hex(const char *prefix, const uint8_t *data, unsigned len);
@@ -877,6 +1047,7 @@ int gpst_xml_or_error(struct openconnect_info *vpninfo, int result, char *respon
 					  char **prompt, char **inputStr);
 int gpst_setup(struct openconnect_info *vpninfo);
 int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout);
+void free_hip_report(struct openconnect_info *vpninfo);
 
 /* lzs.c */
 int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
@@ -885,11 +1056,23 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 /* ssl.c */
 unsigned string_is_hostname(const char* str);
 int connect_https_socket(struct openconnect_info *vpninfo);
+int https_sess_cache_valid(struct openconnect_info *vpninfo);
+int https_sess_cache_set_host(struct openconnect_info *vpninfo);
+int openconnect_probe_servers(struct openconnect_info *vpninfo, char **servers,
+			      int nr_servers, uint64_t *rtt_usec);
+int verify_cache_key(struct openconnect_info *vpninfo, const struct oc_cert *chain,
+		     int nr_certs, unsigned char *key);
+int verify_cache_lookup(struct openconnect_info *vpninfo, const unsigned char *key);
+void verify_cache_add(struct openconnect_info *vpninfo, const unsigned char *key,
+		      time_t not_after);
+void verify_cache_clear(struct openconnect_info *vpninfo);
 int __attribute__ ((format(printf, 4, 5)))
     request_passphrase(struct openconnect_info *vpninfo, const char *label,
 		       char **response, const char *fmt, ...);
 int  __attribute__ ((format (printf, 2, 3)))
     openconnect_SSL_printf(struct openconnect_info *vpninfo, const char *fmt, ...);
+int ssl_rbuf_read(struct openconnect_info *vpninfo, void *buf, int len);
+int openconnect_SSL_gets(struct openconnect_info *vpninfo, char *buf, size_t len);
 int openconnect_print_err_cb(const char *str, size_t len, void *ptr);
 #define openconnect_report_ssl_errors(v) ERR_print_errors_cb(openconnect_print_err_cb, (v))
 #if defined(FAKE_ANDROID_KEYSTORE) || defined(__ANDROID__)
@@ -909,17 +1092,19 @@ FILE *openconnect_fopen_utf8(struct openconnect_info *vpninfo,
 			     const char *fname, const char *mode);
 int udp_sockaddr(struct openconnect_info *vpninfo, int port);
 int udp_connect(struct openconnect_info *vpninfo);
-int ssl_reconnect(struct openconnect_info *vpninfo);
+int ssl_reconnect(struct openconnect_info *vpninfo, int *timeout);
 void openconnect_clear_cookies(struct openconnect_info *vpninfo);
 
 /* openssl-pkcs11.c */
 int load_pkcs11_key(struct openconnect_info *vpninfo);
 int load_pkcs11_certificate(struct openconnect_info *vpninfo);
+int pkcs11_relogin(struct openconnect_info *vpninfo);
 
 /* esp.c */
 int verify_packet_seqno(struct openconnect_info *vpninfo,
 			struct esp *esp, uint32_t seq);
 int esp_setup(struct openconnect_info *vpninfo, int dtls_attempt_period);
+struct esp *esp_new_sa_in(struct openconnect_info *vpninfo);
 int esp_mainloop(struct openconnect_info *vpninfo, int *timeout);
 void esp_close(struct openconnect_info *vpninfo);
 void esp_close_secret(struct openconnect_info *vpninfo);
@@ -929,6 +1114,7 @@ int esp_send_probes(struct openconnect_info *vpninfo);
 int esp_send_probes_gp(struct openconnect_info *vpninfo);
 int esp_catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt);
 int esp_catch_probe_gp(struct openconnect_info *vpninfo, struct pkt *pkt);
+int esp_send_mtu_probe_gp(struct openconnect_info *vpninfo, int size, uint32_t id);
 
 /* {gnutls,openssl}-esp.c */
 int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys);
@@ -947,6 +1133,9 @@ int get_cert_md5_fingerprint(struct openconnect_info *vpninfo, void *cert,
 int openconnect_sha1(unsigned char *result, void *data, int len);
 int openconnect_sha256(unsigned char *result, void *data, int len);
 int openconnect_md5(unsigned char *result, void *data, int len);
+int openconnect_aes_gcm(int encrypt, const unsigned char *key,
+			const unsigned char *iv, const void *aad, int aadlen,
+			void *buf, int len, unsigned char *tag);
 int openconnect_random(void *bytes, int len);
 int openconnect_local_cert_md5(struct openconnect_info *vpninfo,
 			       char *buf);
@@ -958,21 +1147,76 @@ int openconnect_hash_yubikey_password(struct openconnect_info *vpninfo,
 int hotp_hmac(struct openconnect_info *vpninfo, const void *challenge);
 #if defined(OPENCONNECT_OPENSSL)
 #define openconnect_https_connected(_v) ((_v)->https_ssl)
+#define openconnect_https_pending(_v) SSL_pending((_v)->https_ssl)
 #elif defined (OPENCONNECT_GNUTLS)
 #define openconnect_https_connected(_v) ((_v)->https_sess)
+#define openconnect_https_pending(_v) gnutls_record_check_pending((_v)->https_sess)
 #endif
 
 /* mainloop.c */
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout);
 int queue_new_packet(struct pkt_q *q, void *buf, int len);
+int incoming_queue_full(struct openconnect_info *vpninfo);
+int queue_incoming_udp_packet(struct openconnect_info *vpninfo, struct pkt *pkt);
 int keepalive_action(struct keepalive_info *ka, int *timeout);
 int ka_stalled_action(struct keepalive_info *ka, int *timeout);
 int ka_check_deadline(int *timeout, time_t now, time_t due);
+int drop_privileges(struct openconnect_info *vpninfo);
+
+/* pmtud.c */
+int pmtud_mainloop(struct openconnect_info *vpninfo, int *timeout);
+void pmtud_probe_acked(struct openconnect_info *vpninfo, uint32_t id);
+void pmtud_too_big(struct openconnect_info *vpninfo);
+void pmtud_stop(struct openconnect_info *vpninfo);
+void pmtud_reset(struct openconnect_info *vpninfo);
+
+/* aqm.c */
+uint64_t monotonic_usec(void);
+int queue_outgoing_packet(struct openconnect_info *vpninfo, struct pkt *pkt);
+struct pkt *dequeue_outgoing_packet(struct openconnect_info *vpninfo);
+int outgoing_queue_len(struct openconnect_info *vpninfo);
+void aqm_default_dscp_bands(struct openconnect_info *vpninfo);
+void aqm_setup_socket(struct openconnect_info *vpninfo, int fd);
+void aqm_report_stats(struct openconnect_info *vpninfo);
+void aqm_free(struct openconnect_info *vpninfo);
+
+/* icmp.c */
+int tun_packet_too_big(struct openconnect_info *vpninfo, const struct pkt *pkt);
+
+/* gso.c */
+uint32_t csum_partial(const void *buf, int len, uint32_t sum);
+uint16_t csum_fold(uint32_t sum);
+uint32_t csum_pseudo(const unsigned char *iph, int proto, int l4len);
+struct pkt *gso_segment(struct openconnect_info *vpninfo, struct pkt *pkt);
+int gro_coalesce(struct openconnect_info *vpninfo, struct pkt *pkt, struct pkt *out);
+void tcp_clamp_mss(struct openconnect_info *vpninfo, struct pkt *pkt);
+
+/* resolve.c */
+int dns_lookup(struct openconnect_info *vpninfo, const char *host, const char *port,
+	       const struct addrinfo *hints, struct addrinfo **res);
+void dns_prefetch(struct openconnect_info *vpninfo, const char *host, const char *port,
+		  const struct addrinfo *hints);
+void dns_refresh(struct openconnect_info *vpninfo, int *timeout);
+void dns_cache_free(struct openconnect_info *vpninfo);
+
+/* handover.c */
+int handover_send(struct openconnect_info *vpninfo);
+int openconnect_handover_recv(struct openconnect_info *vpninfo, const char *path,
+			      char **fingerprint);
+
+/* state.c */
+int openconnect_save_session_state(struct openconnect_info *vpninfo,
+				   const char *fname, const char *keyfname,
+				   const char *server);
+int openconnect_load_session_state(struct openconnect_info *vpninfo,
+				   const char *fname, const char *keyfname,
+				   const char *server, char **fingerprint);
 
 /* xml.c */
 ssize_t read_file_into_string(struct openconnect_info *vpninfo, const char *fname,
 			      char **ptr);
 int config_lookup_host(struct openconnect_info *vpninfo, const char *host);
+char *config_fastest_host(struct openconnect_info *vpninfo, const char *cache_file);
 
 /* oath.c */
 int set_totp_mode(struct openconnect_info *vpninfo, const char *token_str);
@@ -1051,6 +1295,10 @@ int internal_parse_url(const char *url, char **res_proto, char **res_host,
 int do_https_request(struct openconnect_info *vpninfo, const char *method,
 		     const char *request_body_type, struct oc_text_buf *request_body,
 		     char **form_buf, int fetch_redirect);
+int start_https_request(struct openconnect_info *vpninfo, const char *method,
+			const char *request_body_type, struct oc_text_buf *request_body);
+int https_response_ready(struct openconnect_info *vpninfo);
+int finish_https_request(struct openconnect_info *vpninfo, char **form_buf);
 int http_add_cookie(struct openconnect_info *vpninfo, const char *option,
 		    const char *value, int replace);
 int process_http_response(struct openconnect_info *vpninfo, int connect,
@@ -1071,6 +1319,7 @@ int gen_authorization_hdr(struct openconnect_info *vpninfo, int proxy,
 /* ntlm.c */
 int ntlm_authorization(struct openconnect_info *vpninfo, int proxy, struct http_auth_state *auth_state, struct oc_text_buf *buf);
 void cleanup_ntlm_auth(struct openconnect_info *vpninfo, struct http_auth_state *auth_state);
+void ntlm_helper_close(struct openconnect_info *vpninfo);
 
 /* gssapi.c */
 int gssapi_authorization(struct openconnect_info *vpninfo, int proxy, struct http_auth_state *auth_state, struct oc_text_buf *buf);
@@ -587,7 +587,6 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 		 * trying to disable. So do nothing...
 		 */
 #endif
-		dtls_detect_mtu(vpninfo);
 		return 0;
 	}
 
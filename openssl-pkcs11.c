@@ -344,7 +344,12 @@ int load_pkcs11_certificate(struct openconnect_info *vpninfo)
 		return -EINVAL;
 	}
 
-	if (PKCS11_enumerate_slots(ctx, &slot_list, &slot_count) < 0) {
+	/* If the SSL context has been recreated, the slots we enumerated
+	   before (and any login to them) are still good. */
+	if (vpninfo->pkcs11_slot_list) {
+		slot_list = vpninfo->pkcs11_slot_list;
+		slot_count = vpninfo->pkcs11_slot_count;
+	} else if (PKCS11_enumerate_slots(ctx, &slot_list, &slot_count) < 0) {
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("Failed to enumerate PKCS#11 slots\n"));
 		openconnect_report_ssl_errors(vpninfo);
@@ -424,6 +429,8 @@ int load_pkcs11_certificate(struct openconnect_info *vpninfo)
 			slot_list = NULL;
 		}
 		/* Also remember the ID of the cert, in case it helps us find the matching key */
+		free(vpninfo->pkcs11_cert_id);
+		vpninfo->pkcs11_cert_id_len = 0;
 		vpninfo->pkcs11_cert_id = malloc(cert->id_len);
 		if (vpninfo->pkcs11_cert_id) {
 			vpninfo->pkcs11_cert_id_len = cert->id_len;
@@ -440,7 +447,7 @@ int load_pkcs11_certificate(struct openconnect_info *vpninfo)
 	}
 	free(cert_id);
 	free(cert_label);
-	if (slot_list)
+	if (slot_list && slot_list != vpninfo->pkcs11_slot_list)
 		PKCS11_release_all_slots(ctx, slot_list, slot_count);
 
 	return ret;
@@ -686,6 +693,7 @@ int load_pkcs11_key(struct openconnect_info *vpninfo)
 		   others. */
 		vpninfo->pkcs11_slot_list = slot_list;
 		vpninfo->pkcs11_slot_count = slot_count;
+		vpninfo->pkcs11_key_slot = slot;
 		slot_list = NULL;
 	}
  out:
@@ -698,12 +706,42 @@ int load_pkcs11_key(struct openconnect_info *vpninfo)
 	}
 	free(key_id);
 	free(key_label);
-	if (slot_list)
+	if (slot_list && slot_list != vpninfo->pkcs11_slot_list)
 		PKCS11_release_all_slots(ctx, slot_list, slot_count);
 
 	return ret;
 }
+
+static int not_logged_in(unsigned long err)
+{
+	return ERR_GET_LIB(err) == ERR_LIB_PKCS11 &&
+		ERR_GET_REASON(err) == CKR_USER_NOT_LOGGED_IN;
+}
+
+/* The key and the login to its token are kept for as long as the SSL
+   context, so reconnecting doesn't need them again. But if the token has
+   logged us out since (another application logged out, or the session
+   was closed), signing fails. Returns zero if that's what happened and
+   we have logged in again, so the handshake is worth retrying. */
+int pkcs11_relogin(struct openconnect_info *vpninfo)
+{
+	PKCS11_SLOT *slot = vpninfo->pkcs11_key_slot;
+
+	if (!slot || !vpninfo->pkcs11_ctx ||
+	    (!not_logged_in(ERR_peek_error()) &&
+	     !not_logged_in(ERR_peek_last_error())))
+		return -EINVAL;
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Logged out of PKCS#11 slot '%s'; logging in again\n"),
+		     slot->description);
+	return slot_login(vpninfo, vpninfo->pkcs11_ctx, slot);
+}
 #else
+int pkcs11_relogin(struct openconnect_info *vpninfo)
+{
+	return -EINVAL;
+}
 int load_pkcs11_key(struct openconnect_info *vpninfo)
 {
 	vpn_progress(vpninfo, PRG_ERR,
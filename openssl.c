@@ -88,6 +88,39 @@ int openconnect_md5(unsigned char *result, void *data, int len)
 	return 0;
 }
 
+/* AES-256-GCM in place, with a 12-byte IV and 16-byte tag. On decryption
+   the tag is checked, and -EBADMSG returned if it doesn't match. */
+int openconnect_aes_gcm(int encrypt, const unsigned char *key,
+			const unsigned char *iv, const void *aad, int aadlen,
+			void *buf, int len, unsigned char *tag)
+{
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	int outl, ret = -EIO;
+
+	if (!ctx)
+		return -ENOMEM;
+
+	if (!EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv, encrypt))
+		goto out;
+	if (!encrypt && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag))
+		goto out;
+	if (aadlen && !EVP_CipherUpdate(ctx, NULL, &outl, aad, aadlen))
+		goto out;
+	if (len && !EVP_CipherUpdate(ctx, buf, &outl, buf, len))
+		goto out;
+	if (!EVP_CipherFinal_ex(ctx, (unsigned char *)buf + len, &outl)) {
+		if (!encrypt)
+			ret = -EBADMSG;
+		goto out;
+	}
+	if (encrypt && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag))
+		goto out;
+	ret = 0;
+ out:
+	EVP_CIPHER_CTX_free(ctx);
+	return ret;
+}
+
 int openconnect_get_peer_cert_DER(struct openconnect_info *vpninfo,
 				  unsigned char **buf)
 {
@@ -214,6 +247,10 @@ static int _openconnect_openssl_read(SSL *ssl, int fd, struct openconnect_info *
 
 static int openconnect_openssl_read(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
+	int ret = ssl_rbuf_read(vpninfo, buf, len);
+
+	if (ret)
+		return ret;
 	return _openconnect_openssl_read(vpninfo->https_ssl, vpninfo->ssl_fd, vpninfo, buf, len, 0);
 }
 
@@ -222,66 +259,14 @@ int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t le
 	return _openconnect_openssl_read(vpninfo->dtls_ssl, vpninfo->dtls_fd, vpninfo, buf, len, ms);
 }
 
-static int openconnect_openssl_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
-{
-	int i = 0;
-	int ret;
-
-	if (len < 2)
-		return -EINVAL;
-
-	while (1) {
-		ret = SSL_read(vpninfo->https_ssl, buf + i, 1);
-		if (ret == 1) {
-			if (buf[i] == '\n') {
-				buf[i] = 0;
-				if (i && buf[i-1] == '\r') {
-					buf[i-1] = 0;
-					i--;
-				}
-				return i;
-			}
-			i++;
-
-			if (i >= len - 1) {
-				buf[i] = 0;
-				return i;
-			}
-		} else {
-			fd_set rd_set, wr_set;
-			int maxfd = vpninfo->ssl_fd;
-
-			FD_ZERO(&rd_set);
-			FD_ZERO(&wr_set);
-
-			ret = SSL_get_error(vpninfo->https_ssl, ret);
-			if (ret == SSL_ERROR_WANT_READ)
-				FD_SET(vpninfo->ssl_fd, &rd_set);
-			else if (ret == SSL_ERROR_WANT_WRITE)
-				FD_SET(vpninfo->ssl_fd, &wr_set);
-			else {
-				vpn_progress(vpninfo, PRG_ERR, _("Failed to read from SSL socket\n"));
-				openconnect_report_ssl_errors(vpninfo);
-				ret = -EIO;
-				break;
-			}
-			cmd_fd_set(vpninfo, &rd_set, &maxfd);
-			select(maxfd + 1, &rd_set, &wr_set, NULL, NULL);
-			if (is_cancel_pending(vpninfo, &rd_set)) {
-				vpn_progress(vpninfo, PRG_ERR, _("SSL read cancelled\n"));
-				ret = -EINTR;
-				break;
-			}
-		}
-	}
-	buf[i] = 0;
-	return i ?: ret;
-}
-
 int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
 {
 	int len, ret;
 
+	len = ssl_rbuf_read(vpninfo, buf, maxlen);
+	if (len)
+		return len;
+
 	len = SSL_read(vpninfo->https_ssl, buf, maxlen);
 	if (len > 0)
 		return len;
@@ -1522,11 +1507,64 @@ void openconnect_free_peer_cert_chain(struct openconnect_info *vpninfo,
 	free(chain);
 }
 
+static int peer_chain_key(struct openconnect_info *vpninfo,
+			  STACK_OF(X509) *untrusted, unsigned char *key)
+{
+	int i, nr_certs = sk_X509_num(untrusted);
+	struct oc_cert *chain;
+	int ret = -ENOMEM;
+
+	if (nr_certs <= 0)
+		return -EINVAL;
+
+	chain = calloc(nr_certs, sizeof(*chain));
+	if (!chain)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_certs; i++) {
+		chain[i].der_len = i2d_X509(sk_X509_value(untrusted, i),
+					    &chain[i].der_data);
+		if (chain[i].der_len < 0)
+			goto out;
+	}
+	ret = verify_cache_key(vpninfo, chain, nr_certs, key);
+ out:
+	for (i = 0; i < nr_certs; i++)
+		OPENSSL_free(chain[i].der_data);
+	free(chain);
+	return ret;
+}
+
+/* When the first certificate in the chain expires */
+static time_t peer_chain_expiry(STACK_OF(X509) *untrusted)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(LIBRESSL_VERSION_NUMBER)
+	time_t now = time(NULL), expiry = 0, t;
+	int i, days, secs;
+
+	for (i = 0; i < sk_X509_num(untrusted); i++) {
+		if (!ASN1_TIME_diff(&days, &secs, NULL,
+				    X509_get0_notAfter(sk_X509_value(untrusted, i))))
+			return 0;
+		t = now + (time_t)days * 86400 + secs;
+		if (!i || t < expiry)
+			expiry = t;
+	}
+	return expiry;
+#else
+	/* Not worth parsing ASN1_TIME ourselves; just don't cache */
+	return 0;
+#endif
+}
+
 static int ssl_app_verify_callback(X509_STORE_CTX *ctx, void *arg)
 {
 	struct openconnect_info *vpninfo = arg;
 	const char *err_string = NULL;
 	X509 *cert = X509_STORE_CTX_get0_cert(ctx);
+	STACK_OF(X509) *untrusted = X509_STORE_CTX_get0_untrusted(ctx);
+	unsigned char cache_key[SHA256_SIZE];
+	int have_key;
 #ifdef X509_V_FLAG_PARTIAL_CHAIN
 	X509_VERIFY_PARAM *param;
 #endif
@@ -1545,7 +1583,12 @@ static int ssl_app_verify_callback(X509_STORE_CTX *ctx, void *arg)
 	vpninfo->peer_cert = cert;
 	X509_up_ref(cert);
 
-	set_peer_cert_hash(vpninfo);
+	have_key = !peer_chain_key(vpninfo, untrusted, cache_key);
+	if (have_key && verify_cache_lookup(vpninfo, cache_key))
+		return 1;
+
+	if (set_peer_cert_hash(vpninfo))
+		have_key = 0;
 
 #ifdef X509_V_FLAG_PARTIAL_CHAIN
 	param = X509_STORE_CTX_get0_param(ctx);
@@ -1573,8 +1616,12 @@ static int ssl_app_verify_callback(X509_STORE_CTX *ctx, void *arg)
 
 		if (match_cert_hostname(vpninfo, vpninfo->peer_cert, addrbuf, addrlen))
 			err_string = _("certificate does not match hostname");
-		else
+		else {
+			if (have_key)
+				verify_cache_add(vpninfo, cache_key,
+						 peer_chain_expiry(untrusted));
 			return 1;
+		}
 	}
 
 	vpn_progress(vpninfo, PRG_INFO,
@@ -1643,6 +1690,7 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 {
 	SSL *https_ssl;
 	BIO *https_bio;
+	uint64_t handshake_start;
 	int ssl_sock;
 	int err;
 
@@ -1692,7 +1740,12 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 #endif
 
 		if (vpninfo->cert) {
+			uint64_t start = monotonic_usec();
+
 			err = load_certificate(vpninfo);
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Loading certificate took %lu ms\n"),
+				     (unsigned long)((monotonic_usec() - start) / 1000));
 			if (!err && !SSL_CTX_check_private_key(vpninfo->https_ctx)) {
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("SSL certificate and key do not match\n"));
@@ -1817,9 +1870,15 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 #endif
 	SSL_set_verify(https_ssl, SSL_VERIFY_PEER, NULL);
 
+	/* Offer the session from last time, if there was one. If the server
+	   no longer accepts it, this is just a full handshake. */
+	if (vpninfo->https_sess_cache && https_sess_cache_valid(vpninfo))
+		SSL_set_session(https_ssl, vpninfo->https_sess_cache);
+
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
 
+	handshake_start = monotonic_usec();
 	while ((err = SSL_connect(https_ssl)) <= 0) {
 		fd_set wr_set, rd_set;
 		int maxfd = ssl_sock;
@@ -1832,7 +1891,15 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 			FD_SET(ssl_sock, &rd_set);
 		else if (err == SSL_ERROR_WANT_WRITE)
 			FD_SET(ssl_sock, &wr_set);
-		else {
+		else if (!vpninfo->pkcs11_relogin_tried && !pkcs11_relogin(vpninfo)) {
+			/* Once only, in case the token keeps logging us out */
+			SSL_free(https_ssl);
+			closesocket(ssl_sock);
+			vpninfo->pkcs11_relogin_tried = 1;
+			err = openconnect_open_https(vpninfo);
+			vpninfo->pkcs11_relogin_tried = 0;
+			return err;
+		} else {
 			vpn_progress(vpninfo, PRG_ERR, _("SSL connection failure\n"));
 			openconnect_report_ssl_errors(vpninfo);
 			SSL_free(https_ssl);
@@ -1850,6 +1917,24 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		}
 	}
 
+	if (SSL_session_reused(https_ssl)) {
+		/* The verify callback wasn't called, so it didn't set this */
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Resumed previous TLS session with %s\n"),
+			     vpninfo->hostname);
+		vpninfo->peer_cert = SSL_get_peer_certificate(https_ssl);
+		if (!vpninfo->peer_cert) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("No server certificate in resumed TLS session\n"));
+			SSL_free(https_ssl);
+			SSL_SESSION_free(vpninfo->https_sess_cache);
+			vpninfo->https_sess_cache = NULL;
+			closesocket(ssl_sock);
+			return -EIO;
+		}
+		set_peer_cert_hash(vpninfo);
+	}
+
 	vpninfo->cstp_cipher = (char *)SSL_get_cipher_name(https_ssl);
 
 	vpninfo->ssl_fd = ssl_sock;
@@ -1857,11 +1942,13 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 
 	vpninfo->ssl_read = openconnect_openssl_read;
 	vpninfo->ssl_write = openconnect_openssl_write;
-	vpninfo->ssl_gets = openconnect_openssl_gets;
+	vpninfo->ssl_gets = openconnect_SSL_gets;
 
 
 	vpn_progress(vpninfo, PRG_INFO, _("Connected to HTTPS on %s\n"),
 		     vpninfo->hostname);
+	vpn_progress(vpninfo, PRG_DEBUG, _("TLS handshake took %lu ms\n"),
+		     (unsigned long)((monotonic_usec() - handshake_start) / 1000));
 
 	return 0;
 }
@@ -1874,9 +1961,26 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
 	if (vpninfo->https_ssl) {
+		SSL_SESSION *sess = SSL_get1_session(vpninfo->https_ssl);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+		if (sess && !SSL_SESSION_is_resumable(sess)) {
+			SSL_SESSION_free(sess);
+			sess = NULL;
+		}
+#endif
+		if (sess) {
+			SSL_SESSION_free(vpninfo->https_sess_cache);
+			vpninfo->https_sess_cache = sess;
+			if (https_sess_cache_set_host(vpninfo)) {
+				SSL_SESSION_free(vpninfo->https_sess_cache);
+				vpninfo->https_sess_cache = NULL;
+			}
+		}
 		SSL_free(vpninfo->https_ssl);
 		vpninfo->https_ssl = NULL;
 	}
+	vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
 	if (vpninfo->ssl_fd != -1) {
 		closesocket(vpninfo->ssl_fd);
 		unmonitor_read_fd(vpninfo, ssl);
@@ -1885,6 +1989,12 @@ void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 		vpninfo->ssl_fd = -1;
 	}
 	if (final) {
+		if (vpninfo->https_sess_cache) {
+			SSL_SESSION_free(vpninfo->https_sess_cache);
+			vpninfo->https_sess_cache = NULL;
+		}
+		free(vpninfo->https_sess_host);
+		vpninfo->https_sess_host = NULL;
 		if (vpninfo->https_ctx) {
 			SSL_CTX_free(vpninfo->https_ctx);
 			vpninfo->https_ctx = NULL;
@@ -0,0 +1,287 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * Packetization Layer Path MTU Discovery (RFC 8899) for the UDP
+ * transports, run from their mainloops instead of holding up the
+ * connection while the MTU is found.
+ *
+ * The tunnel keeps the negotiated MTU while a probe of a small size,
+ * which should work everywhere, checks that the peer answers them. Then
+ * larger probes are sent, one at a time: the negotiated MTU first since
+ * it usually works, then a binary search. Only when a probe is lost is
+ * the MTU of the tunnel, including the tun device, lowered to the
+ * largest size known to work; each answered probe raises it again.
+ *
+ * Once the search is complete, a probe of the current size is sent now
+ * and then. If those go unanswered, large packets are getting lost, so
+ * we go back to the base MTU and search again. A larger MTU is also
+ * looked for occasionally, in case the path has changed.
+ *
+ * If the peer never answers even the base probe, it doesn't support
+ * them and we just use the negotiated MTU, as we always did.
+ *
+ * With IPv6 on the tunnel the base is 1280 bytes, the IPv6 minimum;
+ * below that Linux drops the IPv6 addresses and routes of the device.
+ */
+
+#define PMTUD_BASE_MTU		1200
+#define PMTUD_BASE_MTU6		1280
+#define PMTUD_MAX_PROBES	3
+#define PMTUD_PROBE_TIMER	2	/* Seconds to wait for an answer */
+#define PMTUD_CONFIRM_TIMER	60	/* Check that the current MTU works */
+#define PMTUD_RAISE_TIMER	600	/* Look for a larger MTU */
+#define PMTUD_GRANULARITY	8	/* Close enough to stop searching */
+
+static int pmtud_base_mtu(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->ip_info.addr6 || vpninfo->ip_info.netmask6)
+		return PMTUD_BASE_MTU6;
+	return PMTUD_BASE_MTU;
+}
+
+static void pmtud_set_mtu(struct openconnect_info *vpninfo, int mtu)
+{
+	if (mtu == vpninfo->ip_info.mtu)
+		return;
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Tunnel MTU set to %d bytes (was %d)\n"),
+		     mtu, vpninfo->ip_info.mtu);
+	vpninfo->ip_info.mtu = mtu;
+
+	if (tun_is_up(vpninfo))
+		os_set_tun_mtu(vpninfo);
+}
+
+static void pmtud_search_done(struct openconnect_info *vpninfo, time_t now)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Path MTU discovery complete: %d bytes\n"), p->good);
+	p->state = PMTUD_COMPLETE;
+	p->probe_due = now + PMTUD_CONFIRM_TIMER;
+	p->raise_due = now + PMTUD_RAISE_TIMER;
+}
+
+static void pmtud_probe_lost(struct openconnect_info *vpninfo, time_t now)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	int size = p->probe_size;
+
+	p->probe_size = 0;
+	p->probe_due = now;
+
+	/* Any single probe might just have been unlucky */
+	if (++p->probe_count < PMTUD_MAX_PROBES)
+		return;
+	p->probe_count = 0;
+
+	switch (p->state) {
+	case PMTUD_BASE:
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("No answer to MTU probes; using negotiated MTU\n"));
+		p->state = PMTUD_FAILED;
+		pmtud_set_mtu(vpninfo, p->max);
+		break;
+
+	case PMTUD_SEARCHING:
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("MTU probe of %d bytes lost\n"), size);
+		p->bad = size;
+		if (vpninfo->ip_info.mtu >= size)
+			pmtud_set_mtu(vpninfo, p->good);
+		if (p->bad - p->good <= PMTUD_GRANULARITY)
+			pmtud_search_done(vpninfo, now);
+		break;
+
+	case PMTUD_COMPLETE:
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Packets of %d bytes no longer get through; finding MTU again\n"),
+			     size);
+		p->state = PMTUD_BASE;
+		p->good = 0;
+		p->bad = size;
+		pmtud_set_mtu(vpninfo, pmtud_base_mtu(vpninfo));
+		break;
+	}
+}
+
+void pmtud_probe_acked(struct openconnect_info *vpninfo, uint32_t id)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	time_t now = time(NULL);
+	int size = p->probe_size;
+
+	if (!size || id != p->probe_id)
+		return;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("MTU probe of %d bytes answered\n"), size);
+	p->probe_size = 0;
+	p->probe_count = 0;
+	p->probe_due = now;
+
+	switch (p->state) {
+	case PMTUD_BASE:
+		p->state = PMTUD_SEARCHING;
+		/* fall through */
+	case PMTUD_SEARCHING:
+		p->good = size;
+		if (size > vpninfo->ip_info.mtu)
+			pmtud_set_mtu(vpninfo, size);
+		if (p->bad - p->good <= PMTUD_GRANULARITY)
+			pmtud_search_done(vpninfo, now);
+		break;
+
+	case PMTUD_COMPLETE:
+		p->probe_due = now + PMTUD_CONFIRM_TIMER;
+		break;
+	}
+}
+
+static void pmtud_start(struct openconnect_info *vpninfo, time_t now)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	int base = pmtud_base_mtu(vpninfo);
+
+	/* Kept across UDP reconnections, until the server tells us again */
+	if (!p->max)
+		p->max = vpninfo->ip_info.mtu;
+
+	if (!vpninfo->proto->udp_send_mtu_probe || p->max <= base) {
+		p->state = PMTUD_FAILED;
+		return;
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Starting path MTU discovery (base %d, max %d)\n"),
+		     base, p->max);
+	p->state = PMTUD_BASE;
+	p->good = 0;
+	p->bad = p->max + 1;
+	p->probe_size = 0;
+	p->probe_count = 0;
+	p->probe_due = now;
+}
+
+/* Called by the UDP mainloop while it is connected */
+int pmtud_mainloop(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	time_t now = time(NULL);
+	uint32_t id;
+	int size;
+
+	if (p->state == PMTUD_IDLE)
+		pmtud_start(vpninfo, now);
+	if (p->state == PMTUD_FAILED)
+		return 0;
+
+	if (p->probe_size) {
+		if (!ka_check_deadline(timeout, now, p->probe_due))
+			return 0;
+		pmtud_probe_lost(vpninfo, now);
+		if (p->state == PMTUD_FAILED)
+			return 1;
+	}
+
+	if (p->state == PMTUD_COMPLETE && p->good < p->max &&
+	    ka_check_deadline(timeout, now, p->raise_due)) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Looking for a larger path MTU\n"));
+		p->state = PMTUD_SEARCHING;
+		p->bad = p->max + 1;
+		p->raise_due = now + PMTUD_RAISE_TIMER;
+		p->probe_due = now;
+	}
+
+	if (!ka_check_deadline(timeout, now, p->probe_due))
+		return 0;
+
+	if (p->state == PMTUD_BASE)
+		size = pmtud_base_mtu(vpninfo);
+	else if (p->state == PMTUD_COMPLETE)
+		size = p->good;
+	else if (p->bad > p->max)
+		size = p->max;
+	else
+		size = (p->good + p->bad) / 2;
+
+	if (openconnect_random(&id, sizeof(id)))
+		return 0;
+
+	p->probe_size = size;
+	p->probe_id = id;
+	p->probe_due = now + PMTUD_PROBE_TIMER;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Sending MTU probe of %d bytes\n"), size);
+	if (vpninfo->proto->udp_send_mtu_probe(vpninfo, size, id) < 0) {
+		/* Too big for the local interface, or the DTLS library */
+		p->probe_count = PMTUD_MAX_PROBES - 1;
+		pmtud_probe_lost(vpninfo, now);
+	}
+
+	ka_check_deadline(timeout, now, p->probe_due);
+	return 1;
+}
+
+/* A packet couldn't be sent because the kernel has heard (from an ICMP
+   Packet Too Big) that the path MTU is smaller than ours. */
+void pmtud_too_big(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+	int base = pmtud_base_mtu(vpninfo);
+
+	if ((p->state != PMTUD_SEARCHING && p->state != PMTUD_COMPLETE) ||
+	    vpninfo->ip_info.mtu <= base)
+		return;
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Path MTU has shrunk below %d; finding MTU again\n"),
+		     vpninfo->ip_info.mtu);
+	p->state = PMTUD_BASE;
+	p->good = 0;
+	p->bad = vpninfo->ip_info.mtu;
+	p->probe_size = 0;
+	p->probe_count = 0;
+	p->probe_due = time(NULL);
+	pmtud_set_mtu(vpninfo, base);
+}
+
+/* The UDP transport was closed; start again when it reconnects */
+void pmtud_stop(struct openconnect_info *vpninfo)
+{
+	struct pmtud_info *p = &vpninfo->pmtud;
+
+	if (p->state != PMTUD_IDLE && p->max)
+		pmtud_set_mtu(vpninfo, p->max);
+	p->state = PMTUD_IDLE;
+	p->probe_size = 0;
+}
+
+/* The server has given us a new MTU */
+void pmtud_reset(struct openconnect_info *vpninfo)
+{
+	memset(&vpninfo->pmtud, 0, sizeof(vpninfo->pmtud));
+}
@@ -0,0 +1,303 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "openconnect-internal.h"
+
+/*
+ * Cache of getaddrinfo() results for the server and proxy.
+ *
+ * getaddrinfo() doesn't tell us the TTL of the records it found, so
+ * results are kept for DNS_CACHE_TTL. When the server has said it uses
+ * dynamic DNS, its entry is looked up again in a background thread a
+ * little before it expires, so that a reconnect never has to wait for
+ * DNS with the data path stopped. If the refresh fails, the previous
+ * result carries on being used.
+ *
+ * An application's getaddrinfo override is always called synchronously
+ * from the thread running the main loop, as before, since we can't know
+ * that it's safe to call from anywhere else. Results from it are still
+ * cached, but not refreshed in the background.
+ */
+
+#define DNS_CACHE_TTL		60	/* seconds */
+#define DNS_REFRESH_MARGIN	10	/* Refresh this long before expiry */
+#define DNS_RETRY_INTERVAL	10	/* After a failed background refresh */
+
+struct oc_dns_entry {
+	struct oc_dns_entry *next;
+	struct openconnect_info *vpninfo;
+	char *host;
+	char *port;
+	struct addrinfo hints;
+	struct addrinfo *result;
+	time_t expires;
+
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int refreshing;		/* Thread has been started... */
+	int done;		/* ...and has finished, under lock */
+	int new_err;
+	struct addrinfo *new_result;
+#endif
+};
+
+static struct oc_dns_entry *dns_find(struct openconnect_info *vpninfo,
+				     const char *host, const char *port)
+{
+	struct oc_dns_entry *e;
+
+	for (e = vpninfo->dns_cache; e; e = e->next)
+		if (!strcasecmp(e->host, host) && !strcmp(e->port, port))
+			return e;
+	return NULL;
+}
+
+static void dns_install(struct oc_dns_entry *e, struct addrinfo *result)
+{
+	if (e->result)
+		freeaddrinfo(e->result);
+	e->result = result;
+	e->expires = time(NULL) + DNS_CACHE_TTL;
+}
+
+#ifdef HAVE_PTHREAD
+static void *dns_thread(void *arg)
+{
+	struct oc_dns_entry *e = arg;
+	struct addrinfo *result = NULL;
+	int err;
+
+	/* Only the lookup happens here. Everything else, including the
+	   logging, is left for the main thread in dns_poll(). */
+	err = getaddrinfo(e->host, e->port, &e->hints, &result);
+
+	pthread_mutex_lock(&e->lock);
+	e->new_err = err;
+	e->new_result = err ? NULL : result;
+	e->done = 1;
+	pthread_mutex_unlock(&e->lock);
+	return NULL;
+}
+
+/* Collect the result of a background lookup, if there is one. With
+   'wait', block until it's finished. Returns the getaddrinfo() error
+   if it failed. */
+static int dns_poll(struct oc_dns_entry *e, int wait)
+{
+	struct openconnect_info *vpninfo = e->vpninfo;
+	int done;
+
+	if (!e->refreshing)
+		return 0;
+
+	pthread_mutex_lock(&e->lock);
+	done = e->done;
+	pthread_mutex_unlock(&e->lock);
+	if (!done && !wait)
+		return 0;
+
+	pthread_join(e->thread, NULL);
+	e->refreshing = e->done = 0;
+
+	if (e->new_err) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Background DNS lookup for '%s' failed: %s\n"),
+			     e->host, gai_strerror(e->new_err));
+		e->expires = time(NULL) + DNS_RETRY_INTERVAL;
+		return e->new_err;
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Refreshed DNS cache for '%s'\n"), e->host);
+	dns_install(e, e->new_result);
+	e->new_result = NULL;
+	return 0;
+}
+
+static int dns_start_refresh(struct oc_dns_entry *e)
+{
+	if (e->refreshing)
+		return 0;
+
+	e->done = 0;
+	if (pthread_create(&e->thread, NULL, dns_thread, e))
+		return -EAGAIN;
+
+	e->refreshing = 1;
+	return 0;
+}
+#else
+static inline int dns_poll(struct oc_dns_entry *e, int wait)
+{
+	return 0;
+}
+#define dns_start_refresh(e) (-EOPNOTSUPP)
+#endif
+
+static struct oc_dns_entry *dns_new_entry(struct openconnect_info *vpninfo,
+					  const char *host, const char *port,
+					  const struct addrinfo *hints)
+{
+	struct oc_dns_entry *e = calloc(1, sizeof(*e));
+
+	if (!e)
+		return NULL;
+	e->host = strdup(host);
+	e->port = strdup(port);
+	if (!e->host || !e->port) {
+		free(e->host);
+		free(e->port);
+		free(e);
+		return NULL;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&e->lock, NULL);
+#endif
+	e->vpninfo = vpninfo;
+	e->hints = *hints;
+	e->next = vpninfo->dns_cache;
+	vpninfo->dns_cache = e;
+	return e;
+}
+
+/* Like getaddrinfo(), except that the result is owned by the cache and
+   mustn't be freed. It remains valid until the next call into this file
+   from the main loop. */
+int dns_lookup(struct openconnect_info *vpninfo, const char *host, const char *port,
+	       const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct oc_dns_entry *e = dns_find(vpninfo, host, port);
+	struct addrinfo *result = NULL;
+	int err;
+
+	if (e) {
+		/* If a refresh is in flight, it's fresher than what we have */
+		err = dns_poll(e, !e->result || time(NULL) >= e->expires);
+		if (err && !e->result)
+			return err; /* From dns_prefetch(); don't ask twice */
+		if (e->result && time(NULL) < e->expires) {
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("Using cached DNS result for '%s'\n"), host);
+			*res = e->result;
+			return 0;
+		}
+	}
+
+	if (vpninfo->getaddrinfo_override)
+		err = vpninfo->getaddrinfo_override(vpninfo->cbdata, host, port, hints, &result);
+	else
+		err = getaddrinfo(host, port, hints, &result);
+	if (err)
+		return err;
+
+	if (!e && !(e = dns_new_entry(vpninfo, host, port, hints)))
+		goto nocache;
+
+	dns_install(e, result);
+	*res = result;
+	return 0;
+
+ nocache:
+	vpn_progress(vpninfo, PRG_ERR, _("Failed to allocate DNS cache entry\n"));
+	freeaddrinfo(result);
+	return EAI_MEMORY;
+}
+
+/* Start looking 'host' up in the background, for a dns_lookup() to
+   come. Lets several names be resolved at once. */
+void dns_prefetch(struct openconnect_info *vpninfo, const char *host, const char *port,
+		  const struct addrinfo *hints)
+{
+	struct oc_dns_entry *e = dns_find(vpninfo, host, port);
+
+	if (vpninfo->getaddrinfo_override)
+		return;
+	if (e && e->result && time(NULL) < e->expires)
+		return;
+	if (!e && !(e = dns_new_entry(vpninfo, host, port, hints)))
+		return;
+	dns_start_refresh(e);
+}
+
+/* Called from the main loop. Keep the server's address fresh in the
+   background if it uses dynamic DNS. */
+void dns_refresh(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct oc_dns_entry *e;
+	char port[6];
+	time_t now;
+
+	if (!vpninfo->is_dyndns || vpninfo->proxy || vpninfo->getaddrinfo_override)
+		return;
+
+	snprintf(port, sizeof(port), "%d", vpninfo->port);
+	e = dns_find(vpninfo, vpninfo->hostname, port);
+	if (!e)
+		return;
+
+	dns_poll(e, 0);
+
+	now = time(NULL);
+#ifdef HAVE_PTHREAD
+	if (e->refreshing) {
+		/* Look again soon to collect the result */
+		if (*timeout > 1000)
+			*timeout = 1000;
+		return;
+	}
+#endif
+	if (now >= e->expires - DNS_REFRESH_MARGIN) {
+		if (!dns_start_refresh(e)) {
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("Refreshing DNS for '%s' in the background\n"),
+				     e->host);
+			if (*timeout > 1000)
+				*timeout = 1000;
+			return;
+		}
+		/* No threads; the next reconnect will have to look it up */
+		return;
+	}
+	ka_check_deadline(timeout, now, e->expires - DNS_REFRESH_MARGIN);
+}
+
+void dns_cache_free(struct openconnect_info *vpninfo)
+{
+	struct oc_dns_entry *e, *next;
+
+	for (e = vpninfo->dns_cache; e; e = next) {
+		next = e->next;
+#ifdef HAVE_PTHREAD
+		dns_poll(e, 1);
+		pthread_mutex_destroy(&e->lock);
+#endif
+		if (e->result)
+			freeaddrinfo(e->result);
+		free(e->host);
+		free(e->port);
+		free(e);
+	}
+	vpninfo->dns_cache = NULL;
+}
@@ -374,6 +374,156 @@ void free_split_routes(struct openconnect_info *vpninfo)
 		vpninfo->ip_info.split_excludes = NULL;
 }
 
+/* Parse "A.B.C.D", "A.B.C.D/N", "A.B.C.D/M.M.M.M" or an IPv6 address
+   with an optional "/N" into 'addr' (16 bytes) and '*plen'. Returns the
+   address length in bits, or -EINVAL. */
+int parse_ip_prefix(const char *route, unsigned char *addr, int *plen)
+{
+	char buf[INET6_ADDRSTRLEN + 20], *slash, *endp;
+	struct in_addr mask;
+
+	if (strlen(route) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, route);
+	slash = strchr(buf, '/');
+	if (slash)
+		*(slash++) = 0;
+
+	if (strchr(buf, ':')) {
+		if (inet_pton(AF_INET6, buf, addr) != 1)
+			return -EINVAL;
+		*plen = slash ? strtol(slash, &endp, 10) : 128;
+		if (slash && (*endp || *plen < 0 || *plen > 128))
+			return -EINVAL;
+		return 128;
+	}
+
+	if (!inet_aton(buf, (struct in_addr *)addr))
+		return -EINVAL;
+	if (!slash)
+		*plen = 32;
+	else if ((*plen = strtol(slash, &endp, 10)) <= 32 && *plen >= 0 && !*endp)
+		; /* mask is /N */
+	else if (inet_aton(slash, &mask))
+		*plen = netmasklen(mask);
+	else
+		return -EINVAL;
+	return 32;
+}
+
+static void add_split_prefix(struct openconnect_info *vpninfo, const char *route,
+			     unsigned char val, int *count)
+{
+	unsigned char addr[16];
+	int bits, plen;
+
+	bits = parse_ip_prefix(route, addr, &plen);
+	if (bits < 0)
+		return;
+	if (!split_trie_insert(bits == 32 ? vpninfo->split_trie4 : vpninfo->split_trie6,
+			       addr, plen, val) && count)
+		count[bits == 128]++;
+}
+
+void free_split_policy(struct openconnect_info *vpninfo)
+{
+	split_trie_free(vpninfo->split_trie4);
+	split_trie_free(vpninfo->split_trie6);
+	vpninfo->split_trie4 = vpninfo->split_trie6 = NULL;
+}
+
+/* With --enforce-split, packets from the tun device which the split
+   configuration doesn't route into the VPN are dropped, rather than
+   relying on the OS routing table to be complete and up to date. */
+int setup_split_policy(struct openconnect_info *vpninfo)
+{
+	static const unsigned char any[16];
+	struct oc_split_include *this;
+	int incs[2] = { 0, 0 }, excs[2] = { 0, 0 };
+	char buf[64];
+	int i, ret;
+
+	free_split_policy(vpninfo);
+	if (!vpninfo->split_enforce)
+		return 0;
+
+	vpninfo->split_trie4 = split_trie_new(32);
+	vpninfo->split_trie6 = split_trie_new(128);
+	if (!vpninfo->split_trie4 || !vpninfo->split_trie6) {
+		free_split_policy(vpninfo);
+		return -ENOMEM;
+	}
+
+	for (this = vpninfo->ip_info.split_includes; this; this = this->next)
+		add_split_prefix(vpninfo, this->route, SPLIT_INCLUDE, incs);
+
+	/* Without split includes, everything goes to the VPN */
+	if (!incs[0])
+		split_trie_insert(vpninfo->split_trie4, any, 0, SPLIT_INCLUDE);
+	if (!incs[1])
+		split_trie_insert(vpninfo->split_trie6, any, 0, SPLIT_INCLUDE);
+
+	for (this = vpninfo->ip_info.split_excludes; this; this = this->next)
+		add_split_prefix(vpninfo, this->route, SPLIT_EXCLUDE, excs);
+
+	/* The VPN's own network and nameservers are always reachable */
+	if (vpninfo->ip_info.addr && vpninfo->ip_info.netmask &&
+	    snprintf(buf, sizeof(buf), "%s/%s", vpninfo->ip_info.addr,
+		     vpninfo->ip_info.netmask) < sizeof(buf))
+		add_split_prefix(vpninfo, buf, SPLIT_INCLUDE, NULL);
+	if (vpninfo->ip_info.netmask6)
+		add_split_prefix(vpninfo, vpninfo->ip_info.netmask6, SPLIT_INCLUDE, NULL);
+	for (i = 0; i < 3; i++) {
+		if (vpninfo->ip_info.dns[i])
+			add_split_prefix(vpninfo, vpninfo->ip_info.dns[i], SPLIT_INCLUDE, NULL);
+	}
+
+	ret = split_trie_compile(vpninfo->split_trie4);
+	if (!ret)
+		ret = split_trie_compile(vpninfo->split_trie6);
+	if (ret) {
+		free_split_policy(vpninfo);
+		return ret;
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Enforcing split tunnel with %d/%d IPv4 and %d/%d IPv6 includes/excludes (%lu bytes)\n"),
+		     incs[0], excs[0], incs[1], excs[1],
+		     (unsigned long)(split_trie_size(vpninfo->split_trie4) +
+				     split_trie_size(vpninfo->split_trie6)));
+	return 0;
+}
+
+/* Returns non-zero if a packet from the tun device should be dropped */
+int split_policy_drop(struct openconnect_info *vpninfo, const struct pkt *pkt)
+{
+	const struct split_trie *t;
+	const unsigned char *dst;
+
+	if (pkt->len >= 20 && (pkt->data[0] >> 4) == 4) {
+		t = vpninfo->split_trie4;
+		dst = pkt->data + 16;
+	} else if (pkt->len >= 40 && (pkt->data[0] >> 4) == 6) {
+		t = vpninfo->split_trie6;
+		dst = pkt->data + 24;
+	} else
+		return 0;
+
+	if (!t || split_trie_lookup(t, dst) == SPLIT_INCLUDE)
+		return 0;
+
+	vpninfo->split_dropped++;
+	if (vpninfo->verbose >= PRG_TRACE) {
+		char buf[INET6_ADDRSTRLEN];
+
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Dropping packet to %s outside the split tunnel\n"),
+			     inet_ntop(t == vpninfo->split_trie4 ? AF_INET : AF_INET6,
+				       (void *)dst, buf, sizeof(buf)));
+	}
+	return 1;
+}
+
 
 #ifdef _WIN32
 static wchar_t *create_script_env(struct openconnect_info *vpninfo)
@@ -540,6 +690,13 @@ int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
 	int ret;
 	pid_t pid;
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+	if (vpninfo->netlink_config && !vpninfo->script_tun) {
+		ret = netlink_config_tun(vpninfo, reason);
+		if (ret)
+			return ret;
+	}
+#endif
 	if (!vpninfo->vpnc_script || vpninfo->script_tun)
 		return 0;
 
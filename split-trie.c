@@ -0,0 +1,276 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * Longest-prefix match over the split include/exclude lists, so that
+ * packets from the tun device can be checked against them.
+ *
+ * Prefixes are first inserted into a plain binary trie, which is then
+ * compiled into the Poptrie layout (Asai & Ohara, SIGCOMM 2015): each
+ * node covers six bits of the address with two 64-bit vectors. Bit N of
+ * 'vector' is set if slot N leads to another node; those nodes are
+ * contiguous from 'base1', and the popcount of the vector below N gives
+ * the offset. The remaining slots are leaves, stored in 'leaves' from
+ * 'base0' with runs of the same value compressed: 'leafvec' marks the
+ * slot at which each run starts.
+ *
+ * A lookup of an IPv4 address touches at most six nodes, and an IPv6
+ * address twenty-two, each of them 24 bytes, however many routes there
+ * are. Twenty thousand IPv4 routes take less than 1MiB.
+ */
+
+#define STRIDE 6
+
+struct build_node {
+	struct build_node *child[2];
+	unsigned char val;
+	unsigned char has_val;
+};
+
+struct trie_node {
+	uint64_t vector;
+	uint64_t leafvec;
+	uint32_t base0;
+	uint32_t base1;
+};
+
+struct split_trie {
+	int bits;
+	struct build_node *root;
+	struct trie_node *nodes;
+	unsigned char *leaves;
+	uint32_t nr_nodes, nodes_alloc;
+	uint32_t nr_leaves, leaves_alloc;
+};
+
+struct split_trie *split_trie_new(int bits)
+{
+	struct split_trie *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return NULL;
+	t->bits = bits;
+	t->root = calloc(1, sizeof(*t->root));
+	if (!t->root) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+static void free_build_node(struct build_node *n)
+{
+	if (!n)
+		return;
+	free_build_node(n->child[0]);
+	free_build_node(n->child[1]);
+	free(n);
+}
+
+void split_trie_free(struct split_trie *t)
+{
+	if (!t)
+		return;
+	free_build_node(t->root);
+	free(t->nodes);
+	free(t->leaves);
+	free(t);
+}
+
+/* A more specific prefix takes precedence; for the same prefix, the
+   last one inserted wins. */
+int split_trie_insert(struct split_trie *t, const unsigned char *addr,
+		      int plen, unsigned char val)
+{
+	struct build_node *n = t->root;
+	int i;
+
+	if (!n || plen < 0 || plen > t->bits)
+		return -EINVAL;
+
+	for (i = 0; i < plen; i++) {
+		int bit = (addr[i / 8] >> (7 - (i % 8))) & 1;
+
+		if (!n->child[bit]) {
+			n->child[bit] = calloc(1, sizeof(*n));
+			if (!n->child[bit])
+				return -ENOMEM;
+		}
+		n = n->child[bit];
+	}
+	n->val = val;
+	n->has_val = 1;
+	return 0;
+}
+
+static int grow(void **arr, uint32_t *alloc, uint32_t need, size_t size)
+{
+	uint32_t newalloc;
+	void *new;
+
+	if (need <= *alloc)
+		return 0;
+
+	newalloc = *alloc ? *alloc : 64;
+	while (newalloc < need)
+		newalloc *= 2;
+	new = realloc(*arr, (size_t)newalloc * size);
+	if (!new)
+		return -ENOMEM;
+	*arr = new;
+	*alloc = newalloc;
+	return 0;
+}
+
+/* Fill in node 'slot' for the STRIDE bits below binary node 'n', whose
+   longest matching prefix so far has value 'def'. */
+static int compile_node(struct split_trie *t, struct build_node *n,
+			unsigned char def, uint32_t slot)
+{
+	struct build_node *sub[1 << STRIDE];
+	unsigned char val[1 << STRIDE];
+	uint64_t vector = 0, leafvec = 0;
+	uint32_t base0, base1, nr_sub = 0;
+	int idx, prev = -1, ret;
+
+	for (idx = 0; idx < (1 << STRIDE); idx++) {
+		struct build_node *p = n;
+		unsigned char v = def;
+		int b;
+
+		for (b = STRIDE - 1; b >= 0 && p; b--) {
+			p = p->child[(idx >> b) & 1];
+			if (p && p->has_val)
+				v = p->val;
+		}
+		val[idx] = v;
+		if (p && (p->child[0] || p->child[1])) {
+			sub[idx] = p;
+			vector |= 1ULL << idx;
+			nr_sub++;
+		} else {
+			sub[idx] = NULL;
+		}
+	}
+
+	base1 = t->nr_nodes;
+	if (grow((void **)&t->nodes, &t->nodes_alloc, base1 + nr_sub, sizeof(*t->nodes)))
+		return -ENOMEM;
+	t->nr_nodes += nr_sub;
+
+	base0 = t->nr_leaves;
+	for (idx = 0; idx < (1 << STRIDE); idx++) {
+		if (sub[idx] || val[idx] == prev)
+			continue;
+		if (grow((void **)&t->leaves, &t->leaves_alloc, t->nr_leaves + 1, 1))
+			return -ENOMEM;
+		t->leaves[t->nr_leaves++] = val[idx];
+		leafvec |= 1ULL << idx;
+		prev = val[idx];
+	}
+
+	t->nodes[slot].vector = vector;
+	t->nodes[slot].leafvec = leafvec;
+	t->nodes[slot].base0 = base0;
+	t->nodes[slot].base1 = base1;
+
+	for (idx = 0; idx < (1 << STRIDE); idx++) {
+		if (!sub[idx])
+			continue;
+		ret = compile_node(t, sub[idx], val[idx], base1++);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Build the lookup tables. No more prefixes can be inserted after this. */
+int split_trie_compile(struct split_trie *t)
+{
+	int ret;
+
+	if (!t->root)
+		return -EINVAL;
+
+	t->nr_nodes = 1;
+	if (grow((void **)&t->nodes, &t->nodes_alloc, 1, sizeof(*t->nodes)))
+		return -ENOMEM;
+
+	ret = compile_node(t, t->root, t->root->has_val ? t->root->val : 0, 0);
+
+	free_build_node(t->root);
+	t->root = NULL;
+	return ret;
+}
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+		((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+		((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+		((uint64_t)p[6] << 8) | p[7];
+}
+
+/* Returns the value of the longest prefix matching 'addr', or zero */
+int split_trie_lookup(const struct split_trie *t, const unsigned char *addr)
+{
+	const struct trie_node *n = t->nodes;
+	uint64_t hi, lo = 0;
+	int off = 0;
+
+	if (t->bits == 32)
+		hi = ((uint64_t)addr[0] << 56) | ((uint64_t)addr[1] << 48) |
+			((uint64_t)addr[2] << 40) | ((uint64_t)addr[3] << 32);
+	else {
+		hi = load_be64(addr);
+		lo = load_be64(addr + 8);
+	}
+
+	while (1) {
+		unsigned int idx;
+		uint64_t below;
+
+		/* The next STRIDE bits of the 128-bit key, zero-padded */
+		if (off <= 64 - STRIDE)
+			idx = hi >> (64 - STRIDE - off);
+		else if (off < 64)
+			idx = (hi << (off - (64 - STRIDE))) | (lo >> (128 - STRIDE - off));
+		else if (off <= 128 - STRIDE)
+			idx = lo >> (128 - STRIDE - off);
+		else
+			idx = lo << (off - (128 - STRIDE));
+		idx &= (1 << STRIDE) - 1;
+
+		/* Slots 0..idx inclusive */
+		below = (2ULL << idx) - 1;
+		if (!(n->vector & (1ULL << idx)))
+			return t->leaves[n->base0 + __builtin_popcountll(n->leafvec & below) - 1];
+
+		n = &t->nodes[n->base1 + __builtin_popcountll(n->vector & below) - 1];
+		off += STRIDE;
+	}
+}
+
+size_t split_trie_size(const struct split_trie *t)
+{
+	return t->nr_nodes * sizeof(*t->nodes) + t->nr_leaves;
+}
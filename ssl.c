@@ -38,6 +38,10 @@
 #include <sys/statfs.h>
 #endif
 
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
 #include "openconnect-internal.h"
 
 #ifdef ANDROID_KEYSTORE
@@ -64,15 +68,9 @@ static inline int connect_pending()
  * negative value, that's a normal errno and should be handled with
  * strerror(). No, you can't just pass the latter value (negated) to
  * openconnect__win32_strerror() because it gives nonsense results. */
-static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
-			       const struct sockaddr *addr, socklen_t addrlen)
+static int start_connect(struct openconnect_info *vpninfo, int sockfd,
+			 const struct sockaddr *addr, socklen_t addrlen)
 {
-	struct sockaddr_storage peer;
-	socklen_t peerlen = sizeof(peer);
-	fd_set wr_set, rd_set, ex_set;
-	int maxfd = sockfd;
-	int err;
-
 	set_sock_nonblock(sockfd);
 	if (vpninfo->protect_socket)
 		vpninfo->protect_socket(vpninfo->cbdata, sockfd);
@@ -84,23 +82,16 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 		return -errno;
 #endif
 	}
+	return 0;
+}
 
-	do {
-		FD_ZERO(&wr_set);
-		FD_ZERO(&rd_set);
-		FD_ZERO(&ex_set);
-		FD_SET(sockfd, &wr_set);
-#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
-		FD_SET(sockfd, &ex_set);
-#endif
-		cmd_fd_set(vpninfo, &rd_set, &maxfd);
-		select(maxfd + 1, &rd_set, &wr_set, &ex_set, NULL);
-		if (is_cancel_pending(vpninfo, &rd_set)) {
-			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
-			return -EINTR;
-		}
-	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
-		 !vpninfo->got_pause_cmd);
+/* Once select() says so, find out whether a non-blocking connect()
+   succeeded or failed. */
+static int connect_result(int sockfd)
+{
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	int err;
 
 	/* Check whether connect() succeeded or failed by using
 	   getpeername(). See http://cr.yp.to/docs/connect.html */
@@ -131,6 +122,37 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 	return err;
 }
 
+static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
+			       const struct sockaddr *addr, socklen_t addrlen)
+{
+	fd_set wr_set, rd_set, ex_set;
+	int maxfd = sockfd;
+	int err;
+
+	err = start_connect(vpninfo, sockfd, addr, addrlen);
+	if (err)
+		return err;
+
+	do {
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		FD_SET(sockfd, &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+		FD_SET(sockfd, &ex_set);
+#endif
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, NULL);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			return -EINTR;
+		}
+	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
+		 !vpninfo->got_pause_cmd);
+
+	return connect_result(sockfd);
+}
+
 /* checks whether the provided string is an IP or a hostname.
  */
 unsigned string_is_hostname(const char *str)
@@ -163,6 +185,478 @@ static int match_sockaddr(struct sockaddr *a, struct sockaddr *b)
 		return 0;
 }
 
+/* A cached TLS session may only be offered to the server it came from,
+   since resuming it skips verification of the server's certificate. */
+int https_sess_cache_valid(struct openconnect_info *vpninfo)
+{
+	return vpninfo->https_sess_host &&
+		vpninfo->https_sess_port == vpninfo->port &&
+		!strcasecmp(vpninfo->https_sess_host, vpninfo->hostname);
+}
+
+int https_sess_cache_set_host(struct openconnect_info *vpninfo)
+{
+	if (!https_sess_cache_valid(vpninfo)) {
+		free(vpninfo->https_sess_host);
+		vpninfo->https_sess_host = strdup(vpninfo->hostname);
+		if (!vpninfo->https_sess_host)
+			return -ENOMEM;
+		vpninfo->https_sess_port = vpninfo->port;
+	}
+	return 0;
+}
+
+/* Each certificate is preceded by its length, so that no two different
+   chains can give the same input to the hash. */
+int verify_cache_key(struct openconnect_info *vpninfo, const struct oc_cert *chain,
+		     int nr_certs, unsigned char *key)
+{
+	struct oc_text_buf *buf = buf_alloc();
+	int i, ret;
+
+	buf_append(buf, "%s:%d", vpninfo->hostname, vpninfo->port);
+	buf_append_bytes(buf, "", 1);
+	for (i = 0; i < nr_certs; i++) {
+		unsigned char len[4];
+
+		store_be32(len, chain[i].der_len);
+		buf_append_bytes(buf, len, 4);
+		buf_append_bytes(buf, chain[i].der_data, chain[i].der_len);
+	}
+
+	ret = buf_error(buf);
+	if (!ret)
+		ret = openconnect_sha256(key, buf->data, buf->pos);
+	buf_free(buf);
+	return ret;
+}
+
+/* If this chain has already been verified for this server, fill in the
+   hashes of its certificate as the verify callback would have done. */
+int verify_cache_lookup(struct openconnect_info *vpninfo, const unsigned char *key)
+{
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < VERIFY_CACHE_SIZE; i++) {
+		struct verify_cache *c = &vpninfo->verify_cache[i];
+
+		if (c->expires <= now || memcmp(c->key, key, SHA256_SIZE))
+			continue;
+
+		memcpy(vpninfo->peer_cert_sha1_raw, c->peer_cert_sha1_raw,
+		       sizeof(c->peer_cert_sha1_raw));
+		memcpy(vpninfo->peer_cert_sha256_raw, c->peer_cert_sha256_raw,
+		       sizeof(c->peer_cert_sha256_raw));
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Server certificate already verified\n"));
+		return 1;
+	}
+	return 0;
+}
+
+/* Remember a chain which has just been verified, until the first of its
+   certificates expires. The oldest (or an expired) entry is replaced. */
+void verify_cache_add(struct openconnect_info *vpninfo, const unsigned char *key,
+		      time_t not_after)
+{
+	struct verify_cache *c = &vpninfo->verify_cache[0];
+	time_t now = time(NULL);
+	int i;
+
+	if (not_after <= now)
+		return;
+
+	for (i = 1; i < VERIFY_CACHE_SIZE; i++) {
+		if (vpninfo->verify_cache[i].expires < c->expires)
+			c = &vpninfo->verify_cache[i];
+	}
+
+	memcpy(c->key, key, SHA256_SIZE);
+	memcpy(c->peer_cert_sha1_raw, vpninfo->peer_cert_sha1_raw,
+	       sizeof(c->peer_cert_sha1_raw));
+	memcpy(c->peer_cert_sha256_raw, vpninfo->peer_cert_sha256_raw,
+	       sizeof(c->peer_cert_sha256_raw));
+	c->expires = MIN(not_after, now + VERIFY_CACHE_TTL);
+}
+
+/* The trusted CAs have changed */
+void verify_cache_clear(struct openconnect_info *vpninfo)
+{
+	memset(vpninfo->verify_cache, 0, sizeof(vpninfo->verify_cache));
+}
+
+static void addrinfo_host(struct addrinfo *rp, char *host, size_t len)
+{
+	host[0] = 0;
+	if (getnameinfo(rp->ai_addr, rp->ai_addrlen, host, len, NULL, 0, NI_NUMERICHOST))
+		host[0] = 0;
+}
+
+static void report_connect_failure(struct openconnect_info *vpninfo, struct addrinfo *rp,
+				   const char *port, int err)
+{
+	char host[80];
+
+	addrinfo_host(rp, host, sizeof(host));
+	if (host[0]) {
+		char *errstr;
+#ifdef _WIN32
+		if (err > 0)
+			errstr = openconnect__win32_strerror(err);
+		else
+#endif
+			errstr = strerror(-err);
+
+		vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s: %s\n"),
+			     rp->ai_family == AF_INET6 ? "[" : "",
+			     host,
+			     rp->ai_family == AF_INET6 ? "]" : "",
+			     port, errstr);
+#ifdef _WIN32
+		if (err > 0)
+			free(errstr);
+#endif
+	}
+
+	/* If we're in DynDNS mode but this *was* the cached IP address,
+	 * don't bother falling back to it if it didn't work. */
+	if (vpninfo->peer_addr && vpninfo->peer_addrlen == rp->ai_addrlen &&
+	    match_sockaddr(vpninfo->peer_addr, rp->ai_addr)) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Forgetting non-functional previous peer address\n"));
+		free(vpninfo->peer_addr);
+		vpninfo->peer_addr = 0;
+		vpninfo->peer_addrlen = 0;
+		free(vpninfo->ip_info.gateway_addr);
+		vpninfo->ip_info.gateway_addr = NULL;
+	}
+}
+
+static int start_attempt(struct openconnect_info *vpninfo, struct addrinfo *rp,
+			 const char *port)
+{
+	char host[80];
+	int fd, err;
+
+	addrinfo_host(rp, host, sizeof(host));
+	if (host[0])
+		vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
+			     _("Attempting to connect to proxy %s%s%s:%s\n") :
+			     _("Attempting to connect to server %s%s%s:%s\n"),
+			     rp->ai_family == AF_INET6 ? "[" : "",
+			     host,
+			     rp->ai_family == AF_INET6 ? "]" : "",
+			     port);
+
+	fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+	if (fd < 0)
+		return -1;
+	set_fd_cloexec(fd);
+
+	err = start_connect(vpninfo, fd, rp->ai_addr, rp->ai_addrlen);
+	if (err) {
+		report_connect_failure(vpninfo, rp, port, err);
+		closesocket(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* RFC8305 "Connection Attempt Delay" */
+#define HAPPY_EYEBALLS_DELAY_US	250000
+
+/* Race connections to the addresses in 'result', as in RFC8305. Start
+ * with the first, alternating between address families after that, and
+ * start another attempt whenever HAPPY_EYEBALLS_DELAY_US passes without
+ * a connection or all the outstanding attempts have failed. The first
+ * to connect wins, and the rest are abandoned. So a broken IPv6 path or
+ * a dead server in the rotation costs 250ms, not a full TCP timeout.
+ *
+ * Returns the connected socket and sets *winner, or -1 on failure. */
+static int race_connect(struct openconnect_info *vpninfo, struct addrinfo *result,
+			const char *port, struct addrinfo **winner)
+{
+	struct addrinfo **cands, *pa, *pb;
+	uint64_t next_start = 0;
+	int nr_cands = 0, next = 0, first_family, i;
+	int ret = -1;
+	int *fds;
+
+	for (pa = result; pa; pa = pa->ai_next)
+		nr_cands++;
+
+	cands = calloc(nr_cands, sizeof(*cands));
+	fds = calloc(nr_cands, sizeof(*fds));
+	if (!cands || !fds)
+		goto out;
+
+	first_family = result->ai_family;
+	pa = pb = result;
+	nr_cands = 0;
+	while (1) {
+		while (pa && pa->ai_family != first_family)
+			pa = pa->ai_next;
+		while (pb && pb->ai_family == first_family)
+			pb = pb->ai_next;
+		if (!pa && !pb)
+			break;
+		if (pa) {
+			cands[nr_cands++] = pa;
+			pa = pa->ai_next;
+		}
+		if (pb) {
+			cands[nr_cands++] = pb;
+			pb = pb->ai_next;
+		}
+	}
+
+	while (1) {
+		fd_set wr_set, rd_set, ex_set;
+		struct timeval tv, *tvp = NULL;
+		uint64_t now = monotonic_usec();
+		int maxfd = 0, pending = 0;
+
+		for (i = 0; i < next; i++)
+			if (fds[i] >= 0)
+				pending++;
+
+		if (next < nr_cands && (!pending || now >= next_start)) {
+			fds[next] = start_attempt(vpninfo, cands[next], port);
+			next++;
+			next_start = now + HAPPY_EYEBALLS_DELAY_US;
+			continue;
+		}
+		if (!pending)
+			break;
+
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		for (i = 0; i < next; i++) {
+			if (fds[i] < 0)
+				continue;
+			FD_SET(fds[i], &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+			FD_SET(fds[i], &ex_set);
+#endif
+			if (fds[i] > maxfd)
+				maxfd = fds[i];
+		}
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+		if (next < nr_cands) {
+			tv.tv_sec = (next_start - now) / 1000000;
+			tv.tv_usec = (next_start - now) % 1000000;
+			tvp = &tv;
+		}
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, tvp);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			goto out;
+		}
+		if (vpninfo->got_pause_cmd)
+			goto out;
+
+		for (i = 0; i < next; i++) {
+			int err;
+
+			if (fds[i] < 0 ||
+			    (!FD_ISSET(fds[i], &wr_set) && !FD_ISSET(fds[i], &ex_set)))
+				continue;
+
+			err = connect_result(fds[i]);
+			if (!err) {
+				ret = fds[i];
+				fds[i] = -1;
+				*winner = cands[i];
+				goto out;
+			}
+			report_connect_failure(vpninfo, cands[i], port, err);
+			closesocket(fds[i]);
+			fds[i] = -1;
+		}
+	}
+ out:
+	for (i = 0; fds && i < next; i++)
+		if (fds[i] >= 0)
+			closesocket(fds[i]);
+	free(cands);
+	free(fds);
+	return ret;
+}
+
+#define PROBE_TIMEOUT_US	2000000
+
+/* Resolve a server given as in the XML config's HostAddress (a URL, or
+   just host[:port]) and start connecting to its first address. */
+/* Split 'server' into the name to look up and its port. Returns the
+   string which *name points into, for the caller to free. */
+static char *probe_host(const char *server, char **name, char *port,
+			struct addrinfo *hints)
+{
+	char *host = NULL;
+	int port_nr;
+
+	if (internal_parse_url(server, NULL, &host, &port_nr, NULL, 443))
+		return NULL;
+
+	*name = host;
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = 0;
+		(*name)++;
+	}
+
+	memset(hints, 0, sizeof(*hints));
+	hints->ai_family = AF_UNSPEC;
+	hints->ai_socktype = SOCK_STREAM;
+	hints->ai_flags = AI_NUMERICSERV;
+	snprintf(port, 6, "%d", port_nr);
+	return host;
+}
+
+static void prefetch_probe(struct openconnect_info *vpninfo, const char *server)
+{
+	struct addrinfo hints;
+	char *host, *name;
+	char port[6];
+
+	host = probe_host(server, &name, port, &hints);
+	if (host)
+		dns_prefetch(vpninfo, name, port, &hints);
+	free(host);
+}
+
+/* The result is owned by the DNS cache. Looking up other names doesn't
+   disturb it, so it lasts until the probes have all been started. */
+static struct addrinfo *resolve_probe(struct openconnect_info *vpninfo,
+				      const char *server, char *port)
+{
+	struct addrinfo hints, *result = NULL;
+	char *host, *name;
+
+	host = probe_host(server, &name, port, &hints);
+	if (!host)
+		return NULL;
+
+	/* This also leaves the answer in the DNS cache for the real connection */
+	if (dns_lookup(vpninfo, name, port, &hints, &result)) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Failed to look up server '%s'\n"), server);
+		result = NULL;
+	}
+	free(host);
+	return result;
+}
+
+/* Time a TCP connection to each of 'servers', all at once, to find out
+ * which is closest. Sets rtt_usec[i] to the time taken, or to zero if
+ * the server couldn't be reached within PROBE_TIMEOUT_US. The sockets
+ * are closed as soon as they connect.
+ *
+ * Returns the number of servers which could be reached. */
+int openconnect_probe_servers(struct openconnect_info *vpninfo, char **servers,
+			      int nr_servers, uint64_t *rtt_usec)
+{
+	uint64_t *started, deadline, now;
+	int i, pending = 0, reached = 0;
+	struct addrinfo **addrs;
+	char (*ports)[6];
+	int *fds;
+
+	fds = calloc(nr_servers, sizeof(*fds));
+	started = calloc(nr_servers, sizeof(*started));
+	addrs = calloc(nr_servers, sizeof(*addrs));
+	ports = calloc(nr_servers, sizeof(*ports));
+	if (!fds || !started || !addrs || !ports) {
+		free(fds);
+		free(started);
+		free(addrs);
+		free(ports);
+		return -ENOMEM;
+	}
+
+	/* The names are all looked up at once, where there are threads
+	   to do it, and all before any connection starts. Otherwise a
+	   connection which had already completed would be charged for the
+	   time spent waiting for the DNS answers after it. */
+	for (i = 0; i < nr_servers; i++)
+		prefetch_probe(vpninfo, servers[i]);
+	for (i = 0; i < nr_servers; i++)
+		addrs[i] = resolve_probe(vpninfo, servers[i], ports[i]);
+
+	for (i = 0; i < nr_servers; i++) {
+		rtt_usec[i] = 0;
+		fds[i] = addrs[i] ? start_attempt(vpninfo, addrs[i], ports[i]) : -1;
+		started[i] = monotonic_usec();
+		if (fds[i] >= 0)
+			pending++;
+	}
+	free(addrs);
+	free(ports);
+	deadline = monotonic_usec() + PROBE_TIMEOUT_US;
+
+	while (pending && (now = monotonic_usec()) < deadline) {
+		fd_set wr_set, rd_set, ex_set;
+		struct timeval tv;
+		int maxfd = 0;
+
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		for (i = 0; i < nr_servers; i++) {
+			if (fds[i] < 0)
+				continue;
+			FD_SET(fds[i], &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+			FD_SET(fds[i], &ex_set);
+#endif
+			if (fds[i] > maxfd)
+				maxfd = fds[i];
+		}
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+		tv.tv_sec = (deadline - now) / 1000000;
+		tv.tv_usec = (deadline - now) % 1000000;
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, &tv);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			reached = -EINTR;
+			break;
+		}
+
+		now = monotonic_usec();
+		for (i = 0; i < nr_servers; i++) {
+			if (fds[i] < 0 ||
+			    (!FD_ISSET(fds[i], &wr_set) && !FD_ISSET(fds[i], &ex_set)))
+				continue;
+
+			if (!connect_result(fds[i])) {
+				rtt_usec[i] = MAX(now - started[i], 1);
+				reached++;
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Server %s answered in %lu ms\n"), servers[i],
+					     (unsigned long)(rtt_usec[i] / 1000));
+			} else {
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Server %s is unreachable\n"), servers[i]);
+			}
+			closesocket(fds[i]);
+			fds[i] = -1;
+			pending--;
+		}
+	}
+
+	for (i = 0; i < nr_servers; i++) {
+		if (fds[i] < 0)
+			continue;
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Server %s did not answer\n"), servers[i]);
+		closesocket(fds[i]);
+	}
+	free(started);
+	free(fds);
+	return reached;
+}
+
 int connect_https_socket(struct openconnect_info *vpninfo)
 {
 	int ssl_sock = -1;
@@ -298,11 +792,8 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			hints.ai_flags |= AI_NUMERICHOST;
 		}
 
-		if (vpninfo->getaddrinfo_override)
-			err = vpninfo->getaddrinfo_override(vpninfo->cbdata, hostname, port, &hints, &result);
-		else
-			err = getaddrinfo(hostname, port, &hints, &result);
-
+		/* The result belongs to the DNS cache; don't free it */
+		err = dns_lookup(vpninfo, hostname, port, &hints, &result);
 		if (err) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("getaddrinfo failed for host '%s': %s\n"),
@@ -322,115 +813,63 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 		if (hints.ai_flags & AI_NUMERICHOST)
 			free(hostname);
 
-		for (rp = result; rp ; rp = rp->ai_next) {
+		ssl_sock = race_connect(vpninfo, result, port, &rp);
+		if (ssl_sock >= 0) {
 			char host[80];
 
-			host[0] = 0;
-			if (!getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
-					 sizeof(host), NULL, 0, NI_NUMERICHOST))
-				vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
-						     _("Attempting to connect to proxy %s%s%s:%s\n") :
-						     _("Attempting to connect to server %s%s%s:%s\n"),
-					     rp->ai_family == AF_INET6 ? "[" : "",
-					     host,
-					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port);
+			addrinfo_host(rp, host, sizeof(host));
 
-			ssl_sock = socket(rp->ai_family, rp->ai_socktype,
-					  rp->ai_protocol);
-			if (ssl_sock < 0)
-				continue;
-			set_fd_cloexec(ssl_sock);
-			err = cancellable_connect(vpninfo, ssl_sock, rp->ai_addr, rp->ai_addrlen);
-			if (!err) {
-				/* Store the peer address we actually used, so that DTLS can
-				   use it again later */
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
-
-				if (host[0]) {
-					vpninfo->ip_info.gateway_addr = strdup(host);
-					vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s\n"),
-						     rp->ai_family == AF_INET6 ? "[" : "",
-						     host,
-						     rp->ai_family == AF_INET6 ? "]" : "",
-						     port);
-				}
+			/* Store the peer address we actually used, so that DTLS can
+			   use it again later */
+			free(vpninfo->ip_info.gateway_addr);
+			vpninfo->ip_info.gateway_addr = NULL;
 
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addrlen = 0;
-				vpninfo->peer_addr = malloc(rp->ai_addrlen);
-				if (!vpninfo->peer_addr) {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Failed to allocate sockaddr storage\n"));
-					closesocket(ssl_sock);
-					ssl_sock = -ENOMEM;
-					goto out;
-				}
-				vpninfo->peer_addrlen = rp->ai_addrlen;
-				memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
-				/* If no proxy, ensure that we output *this* IP address in
-				 * authentication results because we're going to need to
-				 * reconnect to the *same* server from the rotation. And with
-				 * some trick DNS setups, it might possibly be a "rotation"
-				 * even if we only got one result from getaddrinfo() this
-				 * time.
-				 *
-				 * If there's a proxy, we're kind of screwed; we can't know
-				 * which IP address we connected to. Perhaps we ought to do
-				 * the DNS lookup locally and connect to a specific IP? */
-				if (!vpninfo->proxy && host[0]) {
-					char *p = malloc(strlen(host) + 3);
-					if (p) {
-						free(vpninfo->unique_hostname);
-						vpninfo->unique_hostname = p;
-						if (rp->ai_family == AF_INET6)
-							*p++ = '[';
-						memcpy(p, host, strlen(host));
-						p += strlen(host);
-						if (rp->ai_family == AF_INET6)
-							*p++ = ']';
-						*p = 0;
-					}
-				}
-				break;
-			}
 			if (host[0]) {
-				char *errstr;
-#ifdef _WIN32
-				if (err > 0)
-					errstr = openconnect__win32_strerror(err);
-				else
-#endif
-					errstr = strerror(-err);
-
-				vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s: %s\n"),
+				vpninfo->ip_info.gateway_addr = strdup(host);
+				vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s\n"),
 					     rp->ai_family == AF_INET6 ? "[" : "",
 					     host,
 					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port, errstr);
-#ifdef _WIN32
-				if (err > 0)
-					free(errstr);
-#endif
+					     port);
 			}
-			closesocket(ssl_sock);
-			ssl_sock = -1;
-
-			/* If we're in DynDNS mode but this *was* the cached IP address,
-			 * don't bother falling back to it if it didn't work. */
-			if (vpninfo->peer_addr && vpninfo->peer_addrlen == rp->ai_addrlen &&
-			    match_sockaddr(vpninfo->peer_addr, rp->ai_addr)) {
-				vpn_progress(vpninfo, PRG_TRACE,
-					     _("Forgetting non-functional previous peer address\n"));
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addr = 0;
-				vpninfo->peer_addrlen = 0;
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
+
+			free(vpninfo->peer_addr);
+			vpninfo->peer_addrlen = 0;
+			vpninfo->peer_addr = malloc(rp->ai_addrlen);
+			if (!vpninfo->peer_addr) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to allocate sockaddr storage\n"));
+				closesocket(ssl_sock);
+				ssl_sock = -ENOMEM;
+				goto out;
+			}
+			vpninfo->peer_addrlen = rp->ai_addrlen;
+			memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
+			/* If no proxy, ensure that we output *this* IP address in
+			 * authentication results because we're going to need to
+			 * reconnect to the *same* server from the rotation. And with
+			 * some trick DNS setups, it might possibly be a "rotation"
+			 * even if we only got one result from getaddrinfo() this
+			 * time.
+			 *
+			 * If there's a proxy, we're kind of screwed; we can't know
+			 * which IP address we connected to. Perhaps we ought to do
+			 * the DNS lookup locally and connect to a specific IP? */
+			if (!vpninfo->proxy && host[0]) {
+				char *p = malloc(strlen(host) + 3);
+				if (p) {
+					free(vpninfo->unique_hostname);
+					vpninfo->unique_hostname = p;
+					if (rp->ai_family == AF_INET6)
+						*p++ = '[';
+					memcpy(p, host, strlen(host));
+					p += strlen(host);
+					if (rp->ai_family == AF_INET6)
+						*p++ = ']';
+					*p = 0;
+				}
 			}
 		}
-		freeaddrinfo(result);
 
 		if (ssl_sock < 0) {
 			vpn_progress(vpninfo, PRG_ERR,
@@ -446,6 +885,8 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 		}
 	}
 
+	aqm_setup_socket(vpninfo, ssl_sock);
+
 	if (vpninfo->proxy) {
 		err = process_proxy(vpninfo, ssl_sock);
 		if (err) {
@@ -466,6 +907,85 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 	return ssl_sock;
 }
 
+/* Hand over any bytes that openconnect_SSL_gets() read ahead of the
+   end of the line it was asked for. Returns zero if there are none. */
+int ssl_rbuf_read(struct openconnect_info *vpninfo, void *buf, int len)
+{
+	int avail = vpninfo->ssl_rbuf_len - vpninfo->ssl_rbuf_pos;
+
+	if (avail <= 0)
+		return 0;
+	if (len > avail)
+		len = avail;
+
+	memcpy(buf, vpninfo->ssl_rbuf + vpninfo->ssl_rbuf_pos, len);
+	vpninfo->ssl_rbuf_pos += len;
+	return len;
+}
+
+/* Read a line from the TLS connection. Rather than asking the TLS
+   library for a byte at a time, read as much as it has into a buffer;
+   whatever is left over after the line is consumed by later calls to
+   this or to vpninfo->ssl_read() and ssl_nonblock_read(). */
+int openconnect_SSL_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	int i = 0;
+	int ret = 0;
+
+	if (len < 2)
+		return -EINVAL;
+
+	if (!vpninfo->ssl_rbuf) {
+		vpninfo->ssl_rbuf = malloc(SSL_RBUF_SIZE);
+		if (!vpninfo->ssl_rbuf)
+			return -ENOMEM;
+	}
+
+	while (1) {
+		unsigned char *p = vpninfo->ssl_rbuf + vpninfo->ssl_rbuf_pos;
+		int avail = vpninfo->ssl_rbuf_len - vpninfo->ssl_rbuf_pos;
+		unsigned char *nl;
+		int n;
+
+		if (!avail) {
+			vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
+			ret = vpninfo->ssl_read(vpninfo, (void *)vpninfo->ssl_rbuf, SSL_RBUF_SIZE);
+			if (ret > 0) {
+				vpninfo->ssl_rbuf_len = ret;
+				continue;
+			}
+			if (!ret) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to read from SSL socket\n"));
+				ret = -EIO;
+			}
+			break;
+		}
+
+		nl = memchr(p, '\n', avail);
+		n = nl ? nl - p + 1 : avail;
+		if (n > len - 1 - i)
+			n = len - 1 - i;
+
+		memcpy(buf + i, p, n);
+		vpninfo->ssl_rbuf_pos += n;
+		i += n;
+
+		if (buf[i - 1] == '\n') {
+			buf[--i] = 0;
+			if (i && buf[i - 1] == '\r')
+				buf[--i] = 0;
+			return i;
+		}
+		if (i >= len - 1) {
+			buf[i] = 0;
+			return i;
+		}
+	}
+	buf[i] = 0;
+	return i ?: ret;
+}
+
 int  __attribute__ ((format (printf, 2, 3)))
     openconnect_SSL_printf(struct openconnect_info *vpninfo, const char *fmt, ...)
 {
@@ -798,6 +1318,7 @@ void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
 	case OC_CMD_STATS:
 		if (vpninfo->stats_handler)
 			vpninfo->stats_handler(vpninfo->cbdata, &vpninfo->stats);
+		aqm_report_stats(vpninfo);
 	}
 }
 
@@ -930,9 +1451,42 @@ int udp_sockaddr(struct openconnect_info *vpninfo, int port)
 	return 0;
 }
 
+/* Large enough for a whole UDP_SEGMENT batch, at least */
+#define UDP_SOCKBUF_MIN_PKTS	64
+#define UDP_SOCKBUF_MAX		(4 << 20)
+
+/* Size the UDP socket buffers so that a burst of packets from the queue
+   doesn't just get ENOBUFS. Unless the user said otherwise, allow for
+   twice the bandwidth-delay product that the kernel has estimated for
+   the TCP connection to the same server. */
+static int udp_sockbuf_size(struct openconnect_info *vpninfo)
+{
+	int bufsize = vpninfo->ip_info.mtu * UDP_SOCKBUF_MIN_PKTS;
+#ifdef TCP_INFO
+	struct tcp_info ti;
+	socklen_t tilen = sizeof(ti);
+#endif
+
+	if (vpninfo->udp_sockbuf)
+		return vpninfo->udp_sockbuf;
+
+#ifdef TCP_INFO
+	if (vpninfo->ssl_fd != -1 &&
+	    !getsockopt(vpninfo->ssl_fd, IPPROTO_TCP, TCP_INFO, (void *)&ti, &tilen)) {
+		int bdp = ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("TCP cwnd %u, mss %u, rtt %uus\n"),
+			     ti.tcpi_snd_cwnd, ti.tcpi_snd_mss, ti.tcpi_rtt);
+		bufsize = MAX(bufsize, MIN(bdp * 2, UDP_SOCKBUF_MAX));
+	}
+#endif
+	return bufsize;
+}
+
 int udp_connect(struct openconnect_info *vpninfo)
 {
-	int fd, sndbuf;
+	int fd, bufsize;
 
 	fd = socket(vpninfo->peer_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
 	if (fd < 0) {
@@ -942,8 +1496,28 @@ int udp_connect(struct openconnect_info *vpninfo)
 	if (vpninfo->protect_socket)
 		vpninfo->protect_socket(vpninfo->cbdata, fd);
 
-	sndbuf = vpninfo->ip_info.mtu * 2;
-	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, sizeof(sndbuf));
+	bufsize = udp_sockbuf_size(vpninfo);
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Setting UDP socket buffers to %d bytes\n"), bufsize);
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&bufsize, sizeof(bufsize));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void *)&bufsize, sizeof(bufsize));
+
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_DO)
+	/* MTU probes mustn't be fragmented, or they'd prove nothing. And
+	   the kernel tells us with EMSGSIZE when a packet is too big. */
+	if (vpninfo->proto->udp_send_mtu_probe) {
+		int val = IP_PMTUDISC_DO;
+
+		if (vpninfo->peer_addr->sa_family == AF_INET)
+			setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, (void *)&val, sizeof(val));
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_DO)
+		else if (vpninfo->peer_addr->sa_family == AF_INET6) {
+			val = IPV6_PMTUDISC_DO;
+			setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, (void *)&val, sizeof(val));
+		}
+#endif
+	}
+#endif
 
 	if (vpninfo->dtls_local_port) {
 		union {
@@ -993,46 +1567,64 @@ int udp_connect(struct openconnect_info *vpninfo)
 	return fd;
 }
 
-int ssl_reconnect(struct openconnect_info *vpninfo)
+/* Re-establish the TCP connection, without blocking the main loop
+ * between attempts. Returns -EAGAIN while waiting to try again, having
+ * set *timeout for the next attempt, so that the caller can return to
+ * the main loop and the UDP transport keeps forwarding packets in the
+ * meantime. The connection attempt itself is still synchronous. */
+int ssl_reconnect(struct openconnect_info *vpninfo, int *timeout)
 {
+	time_t now = time(NULL);
 	int ret;
-	int timeout;
-	int interval;
 
-	openconnect_close_https(vpninfo, 0);
+	if (!vpninfo->reconnect_pending) {
+		openconnect_close_https(vpninfo, 0);
 
+		vpninfo->reconnect_pending = 1;
+		vpninfo->reconnect_due = now;
+		vpninfo->reconnect_left = vpninfo->reconnect_timeout;
+		vpninfo->reconnect_cur_interval = vpninfo->reconnect_interval;
 
-	timeout = vpninfo->reconnect_timeout;
-	interval = vpninfo->reconnect_interval;
+		free(vpninfo->dtls_pkt);
+		vpninfo->dtls_pkt = NULL;
+		free(vpninfo->tun_pkt);
+		vpninfo->tun_pkt = NULL;
+	}
 
-	free(vpninfo->dtls_pkt);
-	vpninfo->dtls_pkt = NULL;
-	free(vpninfo->tun_pkt);
-	vpninfo->tun_pkt = NULL;
+	if (!ka_check_deadline(timeout, now, vpninfo->reconnect_due))
+		return -EAGAIN;
 
-	while ((ret = vpninfo->proto->tcp_connect(vpninfo))) {
-		if (timeout <= 0)
+	ret = vpninfo->proto->tcp_connect(vpninfo);
+	if (ret) {
+		if (vpninfo->reconnect_left <= 0) {
+			vpninfo->reconnect_pending = 0;
 			return ret;
+		}
 		if (ret == -EPERM) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Cookie is no longer valid, ending session\n"));
+			vpninfo->reconnect_pending = 0;
 			return ret;
 		}
 		vpn_progress(vpninfo, PRG_INFO,
 			     _("sleep %ds, remaining timeout %ds\n"),
-			     interval, timeout);
-		poll_cmd_fd(vpninfo, interval);
-		if (vpninfo->got_cancel_cmd)
-			return -EINTR;
-		if (vpninfo->got_pause_cmd)
-			return 0;
-		timeout -= interval;
-		interval += vpninfo->reconnect_interval;
-		if (interval > RECONNECT_INTERVAL_MAX)
-			interval = RECONNECT_INTERVAL_MAX;
+			     vpninfo->reconnect_cur_interval, vpninfo->reconnect_left);
+
+		vpninfo->reconnect_due = time(NULL) + vpninfo->reconnect_cur_interval;
+		vpninfo->reconnect_left -= vpninfo->reconnect_cur_interval;
+		vpninfo->reconnect_cur_interval += vpninfo->reconnect_interval;
+		if (vpninfo->reconnect_cur_interval > RECONNECT_INTERVAL_MAX)
+			vpninfo->reconnect_cur_interval = RECONNECT_INTERVAL_MAX;
+
+		ka_check_deadline(timeout, time(NULL), vpninfo->reconnect_due);
+		return -EAGAIN;
 	}
 
+	/* The server has told us the MTU again */
+	pmtud_reset(vpninfo);
+	vpninfo->reconnect_pending = 0;
 	script_config_tun(vpninfo, "reconnect");
+	setup_split_policy(vpninfo);
 	if (vpninfo->reconnected)
 		vpninfo->reconnected(vpninfo->cbdata);
 
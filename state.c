@@ -0,0 +1,374 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * Session state file, so that a restarted process can use the cookie
+ * from a previous run instead of authenticating again.
+ *
+ * Only what's needed to call make_cstp_connection() is kept: the cookie,
+ * the address we actually connected to, and the server's certificate
+ * fingerprint. Everything else (IP configuration, DTLS and ESP keys) is
+ * negotiated afresh on connection anyway.
+ *
+ * The contents are "key=value" lines, encrypted with AES-256-GCM:
+ *
+ *   "OCSTATE1" | IV (12 bytes) | tag (16 bytes) | ciphertext
+ *
+ * with the magic as additional authenticated data. The key is 32 random
+ * bytes in a separate file, created mode 0600 on first use.
+ */
+
+#define STATE_MAGIC	"OCSTATE1"
+#define STATE_MAGIC_LEN	8
+#define STATE_KEY_LEN	32
+#define STATE_IV_LEN	12
+#define STATE_TAG_LEN	16
+#define STATE_HDR_LEN	(STATE_MAGIC_LEN + STATE_IV_LEN + STATE_TAG_LEN)
+
+/* Write to a new file and rename it into place, so that a crash can't
+   leave a truncated file behind. */
+static int write_private_file(struct openconnect_info *vpninfo, const char *fname,
+			      const void *data, int len)
+{
+	char *tmpname;
+	int fd, ret = 0;
+
+	if (asprintf(&tmpname, "%s.tmp", fname) == -1)
+		return -ENOMEM;
+
+	unlink(tmpname);
+	fd = openconnect_open_utf8(vpninfo, tmpname, O_WRONLY|O_CREAT|O_EXCL|O_BINARY);
+	if (fd < 0) {
+		ret = -errno;
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to create %s: %s\n"),
+			     tmpname, strerror(errno));
+		free(tmpname);
+		return ret;
+	}
+#ifndef _WIN32
+	/* Before anything is written to it */
+	if (fchmod(fd, 0600)) {
+		ret = -errno;
+		goto err;
+	}
+#endif
+	if (write(fd, data, len) != len) {
+		ret = -errno ? : -EIO;
+		goto err;
+	}
+	if (close(fd)) {
+		fd = -1;
+		ret = -errno;
+		goto err;
+	}
+	fd = -1;
+#ifdef _WIN32
+	/* rename() won't replace an existing file */
+	unlink(fname);
+#endif
+	if (rename(tmpname, fname)) {
+		ret = -errno;
+		goto err;
+	}
+	free(tmpname);
+	return 0;
+
+ err:
+	vpn_progress(vpninfo, PRG_ERR, _("Failed to write %s: %s\n"),
+		     tmpname, strerror(-ret));
+	if (fd >= 0)
+		close(fd);
+	unlink(tmpname);
+	free(tmpname);
+	return ret;
+}
+
+/* Like read_file_into_string() in xml.c, which isn't in the library */
+static ssize_t read_state_file(struct openconnect_info *vpninfo, const char *fname,
+			       char **ptr)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = openconnect_open_utf8(vpninfo, fname, O_RDONLY|O_BINARY);
+	if (fd < 0) {
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to open %s: %s\n"),
+			     fname, strerror(errno));
+		return -ENOENT;
+	}
+	if (fstat(fd, &st) || st.st_size > 65536) {
+		close(fd);
+		return -EINVAL;
+	}
+	buf = malloc(st.st_size + 1);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to read %s: %s\n"),
+			     fname, strerror(errno));
+		free(buf);
+		close(fd);
+		return -EIO;
+	}
+	close(fd);
+	buf[st.st_size] = 0;
+	*ptr = buf;
+	return st.st_size;
+}
+
+static int get_state_key(struct openconnect_info *vpninfo, const char *keyfname,
+			 int create, unsigned char *key)
+{
+	char *buf = NULL;
+	ssize_t len;
+	int ret;
+
+	if (!access(keyfname, F_OK)) {
+		len = read_state_file(vpninfo, keyfname, &buf);
+		if (len < 0)
+			return len;
+		if (len != STATE_KEY_LEN) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Session state key %s has wrong length\n"),
+				     keyfname);
+			free(buf);
+			return -EINVAL;
+		}
+		memcpy(key, buf, STATE_KEY_LEN);
+		memset(buf, 0, STATE_KEY_LEN);
+		free(buf);
+		return 0;
+	}
+
+	if (!create)
+		return -ENOENT;
+
+	ret = openconnect_random(key, STATE_KEY_LEN);
+	if (ret)
+		return ret;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Creating new session state key %s\n"), keyfname);
+	return write_private_file(vpninfo, keyfname, key, STATE_KEY_LEN);
+}
+
+static void append_state(struct oc_text_buf *buf, const char *name, const char *val)
+{
+	if (!val)
+		return;
+	/* Values are one per line, and none of them should ever need more */
+	if (strchr(val, '\n')) {
+		buf->error = -EINVAL;
+		return;
+	}
+	buf_append(buf, "%s=%s\n", name, val);
+}
+
+int openconnect_save_session_state(struct openconnect_info *vpninfo,
+				   const char *fname, const char *keyfname,
+				   const char *server)
+{
+	unsigned char key[STATE_KEY_LEN];
+	struct oc_text_buf *buf;
+	unsigned char *out;
+	int ret, len;
+
+	if (!vpninfo->cookie || !vpninfo->peer_cert)
+		return -EINVAL;
+
+	buf = buf_alloc();
+	if (!buf)
+		return -ENOMEM;
+	append_state(buf, "server", server);
+	append_state(buf, "protocol", vpninfo->proto->name);
+	append_state(buf, "host", openconnect_get_hostname(vpninfo));
+	buf_append(buf, "port=%d\n", vpninfo->port);
+	append_state(buf, "path", vpninfo->urlpath);
+	append_state(buf, "cookie", vpninfo->cookie);
+	append_state(buf, "fingerprint", openconnect_get_peer_cert_hash(vpninfo));
+	ret = buf_error(buf);
+	if (ret)
+		goto out;
+
+	ret = get_state_key(vpninfo, keyfname, 1, key);
+	if (ret)
+		goto out;
+
+	len = STATE_HDR_LEN + buf->pos;
+	out = malloc(len);
+	if (!out) {
+		ret = -ENOMEM;
+		goto out_key;
+	}
+	memcpy(out, STATE_MAGIC, STATE_MAGIC_LEN);
+	memcpy(out + STATE_HDR_LEN, buf->data, buf->pos);
+	ret = openconnect_random(out + STATE_MAGIC_LEN, STATE_IV_LEN);
+	if (!ret)
+		ret = openconnect_aes_gcm(1, key, out + STATE_MAGIC_LEN,
+					  STATE_MAGIC, STATE_MAGIC_LEN,
+					  out + STATE_HDR_LEN, buf->pos,
+					  out + STATE_MAGIC_LEN + STATE_IV_LEN);
+	if (!ret)
+		ret = write_private_file(vpninfo, fname, out, len);
+	if (!ret)
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Saved session state to %s\n"), fname);
+	free(out);
+ out_key:
+	memset(key, 0, sizeof(key));
+ out:
+	if (buf->data)
+		memset(buf->data, 0, buf->pos);
+	buf_free(buf);
+	return ret;
+}
+
+/* Returns 0 and sets up the cookie, server address and path if a usable
+   state was found. The caller is responsible for checking the server's
+   certificate against the returned fingerprint. */
+int openconnect_load_session_state(struct openconnect_info *vpninfo,
+				   const char *fname, const char *keyfname,
+				   const char *server, char **fingerprint)
+{
+	unsigned char key[STATE_KEY_LEN];
+	char *host = NULL, *path = NULL, *cookie = NULL, *fp = NULL;
+	char *buf = NULL, *line, *next;
+	int port = 0, server_ok = 0, proto_ok = 0;
+	ssize_t size = 0;
+	int ret, len;
+
+	if (access(fname, F_OK))
+		return -ENOENT;
+
+	ret = get_state_key(vpninfo, keyfname, 0, key);
+	if (ret) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Cannot read session state without key %s\n"),
+			     keyfname);
+		return ret;
+	}
+
+	size = read_state_file(vpninfo, fname, &buf);
+	if (size < 0) {
+		ret = size;
+		size = 0;
+		goto out;
+	}
+	if (size < STATE_HDR_LEN || memcmp(buf, STATE_MAGIC, STATE_MAGIC_LEN)) {
+		ret = -EINVAL;
+		goto bad;
+	}
+
+	len = size - STATE_HDR_LEN;
+	ret = openconnect_aes_gcm(0, key, (void *)(buf + STATE_MAGIC_LEN),
+				  STATE_MAGIC, STATE_MAGIC_LEN,
+				  buf + STATE_HDR_LEN, len,
+				  (void *)(buf + STATE_MAGIC_LEN + STATE_IV_LEN));
+	if (ret)
+		goto bad;
+
+	/* read_state_file() left room for a terminator */
+	buf[STATE_HDR_LEN + len] = 0;
+
+	for (line = buf + STATE_HDR_LEN; *line; line = next) {
+		char *val;
+
+		next = strchr(line, '\n');
+		if (!next) {
+			ret = -EINVAL;
+			goto bad;
+		}
+		*(next++) = 0;
+
+		val = strchr(line, '=');
+		if (!val) {
+			ret = -EINVAL;
+			goto bad;
+		}
+		*(val++) = 0;
+
+		if (!strcmp(line, "server"))
+			server_ok = !strcmp(val, server);
+		else if (!strcmp(line, "protocol"))
+			proto_ok = !strcmp(val, vpninfo->proto->name);
+		else if (!strcmp(line, "host"))
+			host = val;
+		else if (!strcmp(line, "port"))
+			port = atoi(val);
+		else if (!strcmp(line, "path"))
+			path = val;
+		else if (!strcmp(line, "cookie"))
+			cookie = val;
+		else if (!strcmp(line, "fingerprint"))
+			fp = val;
+	}
+
+	if (!server_ok || !proto_ok) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Session state in %s is for a different server\n"),
+			     fname);
+		ret = -ENOENT;
+		goto out;
+	}
+	if (!host || !port || !cookie || !fp) {
+		ret = -EINVAL;
+		goto bad;
+	}
+
+	ret = openconnect_set_hostname(vpninfo, host);
+	if (!ret)
+		ret = openconnect_set_urlpath(vpninfo, path);
+	if (ret)
+		goto out;
+	vpninfo->port = port;
+
+	free(vpninfo->cookie);
+	vpninfo->cookie = strdup(cookie);
+	*fingerprint = strdup(fp);
+	if (!vpninfo->cookie || !*fingerprint) {
+		free(*fingerprint);
+		*fingerprint = NULL;
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Using saved session for %s\n"), host);
+	goto out;
+
+ bad:
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("Session state in %s is invalid or corrupt\n"), fname);
+ out:
+	memset(key, 0, sizeof(key));
+	if (buf) {
+		memset(buf, 0, size);
+		free(buf);
+	}
+	return ret;
+}
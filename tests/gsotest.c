@@ -0,0 +1,390 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define __OPENCONNECT_INTERNAL_H__
+
+#define vpn_progress(v, d, ...) do { } while (0)
+#define _(x) x
+
+#define MIN(x,y) ((x)<(y))?(x):(y)
+
+struct pkt {
+	uint64_t tstamp;
+	uint16_t gso_size;
+	int len;
+	struct pkt *next;
+	unsigned char data[];
+};
+
+struct pkt_q {
+	struct pkt *head;
+	struct pkt **tail;
+	int count;
+};
+
+static inline struct pkt *dequeue_packet(struct pkt_q *q)
+{
+	struct pkt *ret = q->head;
+
+	if (ret) {
+		q->head = ret->next;
+		if (!--q->count)
+			q->tail = &q->head;
+	}
+	return ret;
+}
+
+static inline int queue_packet(struct pkt_q *q, struct pkt *p)
+{
+	*(q->tail) = p;
+	p->next = NULL;
+	q->tail = &p->next;
+	return ++q->count;
+}
+
+static inline void init_pkt_queue(struct pkt_q *q)
+{
+	q->tail = &q->head;
+}
+
+static inline uint32_t load_be32(const void *_p)
+{
+	const unsigned char *p = _p;
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline uint16_t load_be16(const void *_p)
+{
+	const unsigned char *p = _p;
+	return (p[0] << 8) | p[1];
+}
+
+static inline void store_be32(void *_p, uint32_t d)
+{
+	unsigned char *p = _p;
+	p[0] = d >> 24;
+	p[1] = d >> 16;
+	p[2] = d >> 8;
+	p[3] = d;
+}
+
+static inline void store_be16(void *_p, uint16_t d)
+{
+	unsigned char *p = _p;
+	p[0] = d >> 8;
+	p[1] = d;
+}
+
+#define TUN_GSO_MAX	65535
+
+struct openconnect_info {
+	struct {
+		int mtu;
+	} ip_info;
+	int pkt_trailer;
+	struct pkt_q outgoing_queue;
+	struct pkt_q incoming_queue;
+};
+
+uint32_t csum_partial(const void *buf, int len, uint32_t sum);
+uint16_t csum_fold(uint32_t sum);
+uint32_t csum_pseudo(const unsigned char *iph, int proto, int l4len);
+struct pkt *gso_segment(struct openconnect_info *vpninfo, struct pkt *pkt);
+int gro_coalesce(struct openconnect_info *vpninfo, struct pkt *pkt, struct pkt *out);
+void tcp_clamp_mss(struct openconnect_info *vpninfo, struct pkt *pkt);
+
+#include "../gso.c"
+
+/*
+ * Check tcp_clamp_mss() on SYNs with the MSS option at both even and
+ * odd offsets, comparing its incremental checksum update against a
+ * full recompute. Then split random super-packets with gso_segment(),
+ * check each segment, and make sure gro_coalesce() puts them back
+ * together exactly as they were.
+ */
+
+#define NR_ITERS 1000
+
+static int iphdr_len(int v6)
+{
+	return v6 ? 40 : 20;
+}
+
+/* Fill in an IPv4 or IPv6 header with random addresses */
+static void make_iphdr(unsigned char *iph, int v6, int l4len)
+{
+	int i;
+
+	if (v6) {
+		memset(iph, 0, 8);
+		iph[0] = 0x60;
+		store_be16(iph + 4, l4len);
+		iph[6] = IPPROTO_TCP;
+		iph[7] = 64;
+		for (i = 8; i < 40; i++)
+			iph[i] = rand();
+	} else {
+		memset(iph, 0, 12);
+		iph[0] = 0x45;
+		store_be16(iph + 2, 20 + l4len);
+		store_be16(iph + 4, rand());
+		iph[6] = 0x40; /* DF */
+		iph[8] = 64;
+		iph[9] = IPPROTO_TCP;
+		for (i = 12; i < 20; i++)
+			iph[i] = rand();
+		set_ip_csum(iph, 20);
+	}
+}
+
+/* Fill in a TCP header of 'thl' bytes with random ports, sequence and
+   window, and no options. */
+static void make_tcphdr(unsigned char *th, int thl, int flags)
+{
+	int i;
+
+	for (i = 0; i < 12; i++)
+		th[i] = rand();
+	th[12] = (thl / 4) << 4;
+	th[13] = flags;
+	store_be16(th + 14, rand());
+	store_be32(th + 16, 0);
+	memset(th + 20, TCPOPT_NOP, thl - 20);
+}
+
+/* Compare the TCP checksum with one calculated from scratch, over
+   everything but the checksum field itself */
+static int check_tcp_csum(const struct pkt *pkt, int iphl)
+{
+	const unsigned char *th = pkt->data + iphl;
+	int l4len = pkt->len - iphl;
+	uint32_t sum = csum_pseudo(pkt->data, IPPROTO_TCP, l4len);
+	uint16_t csum;
+
+	sum = csum_partial(th, 16, sum);
+	sum = csum_partial(th + 18, l4len - 18, sum);
+	csum = ~csum_fold(sum);
+	return load_be16(th + 16) != csum;
+}
+
+/* A SYN with a 28-byte TCP header, and the MSS option at 'ofs' */
+static int test_clamp(struct openconnect_info *vpninfo, struct pkt *pkt,
+		      int v6, int ofs, int flags)
+{
+	int iphl = iphdr_len(v6), thl = 28;
+	int mss = vpninfo->ip_info.mtu - iphl - 20;
+	unsigned char *th = pkt->data + iphl;
+	unsigned char orig[100];
+	int old = rand() & 0xffff;
+
+	pkt->len = iphl + thl;
+	make_iphdr(pkt->data, v6, thl);
+	make_tcphdr(th, thl, flags);
+	th[ofs] = TCPOPT_MSS;
+	th[ofs + 1] = 4;
+	store_be16(th + ofs + 2, old);
+	set_tcp_csum(pkt->data, th, thl);
+	memcpy(orig, pkt->data, pkt->len);
+
+	tcp_clamp_mss(vpninfo, pkt);
+
+	if (!(flags & TCP_FLAG_SYN) || old <= mss) {
+		if (!memcmp(orig, pkt->data, pkt->len))
+			return 0;
+		printf("IPv%d MSS %d at offset %d changed (flags %02x, limit %d)\n",
+		       v6 ? 6 : 4, old, ofs, flags, mss);
+		return -1;
+	}
+	if (load_be16(th + ofs + 2) != mss) {
+		printf("IPv%d MSS %d at offset %d clamped to %d, not %d\n",
+		       v6 ? 6 : 4, old, ofs, load_be16(th + ofs + 2), mss);
+		return -1;
+	}
+	if (check_tcp_csum(pkt, iphl)) {
+		printf("IPv%d MSS %d at offset %d clamped to %d with bad checksum\n",
+		       v6 ? 6 : 4, old, ofs, mss);
+		return -1;
+	}
+	return 0;
+}
+
+/* Check segment 'i' of the super-packet 'orig' of 'len' bytes */
+static int check_segment(const struct pkt *seg, const unsigned char *orig, int len,
+			 int iphl, int hdrlen, int mss, int i)
+{
+	const unsigned char *iph = seg->data, *th = iph + iphl;
+	const unsigned char *oth = orig + iphl;
+	int ofs = hdrlen + i * mss;
+	int seglen = MIN(mss, len - ofs);
+	int last = ofs + seglen == len;
+
+	if (seg->len != hdrlen + seglen) {
+		printf("IPv%d segment %d has %d bytes, not %d\n",
+		       iphl == 20 ? 4 : 6, i, seg->len, hdrlen + seglen);
+		return -1;
+	}
+	if (iphl == 20) {
+		if (load_be16(iph + 2) != seg->len ||
+		    load_be16(iph + 4) != (uint16_t)(load_be16(orig + 4) + i) ||
+		    csum_fold(csum_partial(iph, iphl, 0)) != 0xffff) {
+			printf("IPv4 segment %d has a bad header\n", i);
+			return -1;
+		}
+	} else if (load_be16(iph + 4) != seg->len - 40) {
+		printf("IPv6 segment %d has a bad payload length\n", i);
+		return -1;
+	}
+
+	if (load_be32(th + 4) != load_be32(oth + 4) + i * mss ||
+	    th[13] != (last ? oth[13] : (oth[13] & ~TCP_FLAG_PSH)) ||
+	    memcmp(th, oth, 4) || memcmp(th + 8, oth + 8, 5) ||
+	    memcmp(th + 14, oth + 14, 2) || memcmp(th + 18, oth + 18, hdrlen - iphl - 18)) {
+		printf("IPv%d segment %d has a bad TCP header\n", iphl == 20 ? 4 : 6, i);
+		return -1;
+	}
+	if (check_tcp_csum(seg, iphl)) {
+		printf("IPv%d segment %d has a bad TCP checksum\n", iphl == 20 ? 4 : 6, i);
+		return -1;
+	}
+	if (memcmp(iph + hdrlen, orig + ofs, seglen)) {
+		printf("IPv%d segment %d has the wrong payload\n", iphl == 20 ? 4 : 6, i);
+		return -1;
+	}
+	return 0;
+}
+
+/* Segment a super-packet with a 32-byte TCP header, and coalesce it again */
+static int test_gso(struct openconnect_info *vpninfo, struct pkt *out,
+		    int v6, int mss, int paylen)
+{
+	int iphl = iphdr_len(v6), thl = 32, hdrlen = iphl + thl;
+	int len = hdrlen + paylen, nsegs = (paylen + mss - 1) / mss;
+	struct pkt *pkt = malloc(sizeof(*pkt) + len);
+	unsigned char *orig = malloc(len);
+	struct pkt *seg;
+	int i, ret = -1;
+
+	if (!pkt || !orig) {
+		free(pkt);
+		free(orig);
+		return -1;
+	}
+
+	pkt->len = len;
+	pkt->gso_size = mss;
+	make_iphdr(pkt->data, v6, thl + paylen);
+	make_tcphdr(pkt->data + iphl, thl, TCP_FLAG_ACK | TCP_FLAG_PSH);
+	/* Timestamps, which every segment must carry */
+	pkt->data[iphl + 22] = 8;
+	pkt->data[iphl + 23] = 10;
+	for (i = 24; i < thl + paylen; i++)
+		pkt->data[iphl + i] = rand();
+	/* Only the pseudo-header sum, as the tun device gives it */
+	store_be16(pkt->data + iphl + 16,
+		   csum_fold(csum_pseudo(pkt->data, IPPROTO_TCP, thl + paylen)));
+	memcpy(orig, pkt->data, len);
+
+	seg = gso_segment(vpninfo, pkt);
+	if (!seg || vpninfo->outgoing_queue.count != nsegs - 1) {
+		printf("IPv%d packet of %d bytes split into %d segments, not %d\n",
+		       v6 ? 6 : 4, len, seg ? vpninfo->outgoing_queue.count + 1 : 0, nsegs);
+		goto out;
+	}
+	for (i = 0; i < nsegs; i++) {
+		struct pkt *s = i ? vpninfo->outgoing_queue.head : seg;
+
+		if (check_segment(s, orig, len, iphl, hdrlen, mss, i))
+			goto out;
+		if (i)
+			queue_packet(&vpninfo->incoming_queue, dequeue_packet(&vpninfo->outgoing_queue));
+	}
+
+	i = gro_coalesce(vpninfo, seg, out);
+	if (nsegs == 1) {
+		ret = i ? -1 : 0;
+		if (ret)
+			printf("IPv%d single segment was coalesced\n", v6 ? 6 : 4);
+		goto out;
+	}
+	if (i != nsegs || out->len != len || out->gso_size != mss ||
+	    memcmp(out->data, orig, len)) {
+		printf("IPv%d packet of %d bytes in %d segments coalesced badly (%d, %d bytes)\n",
+		       v6 ? 6 : 4, len, nsegs, i, out->len);
+		goto out;
+	}
+	ret = 0;
+ out:
+	while ((pkt = dequeue_packet(&vpninfo->outgoing_queue)))
+		free(pkt);
+	while ((pkt = dequeue_packet(&vpninfo->incoming_queue)))
+		free(pkt);
+	free(seg);
+	free(orig);
+	return ret;
+}
+
+int main(void)
+{
+	struct openconnect_info vpninfo;
+	struct pkt *pkt = malloc(sizeof(*pkt) + 100);
+	struct pkt *out = malloc(sizeof(*out) + TUN_GSO_MAX);
+	int i, v6, ofs, mss, ret = 0;
+
+	if (!pkt || !out)
+		return 1;
+
+	memset(&vpninfo, 0, sizeof(vpninfo));
+	init_pkt_queue(&vpninfo.outgoing_queue);
+	init_pkt_queue(&vpninfo.incoming_queue);
+	srand(time(NULL));
+
+	for (i = 0; i < NR_ITERS; i++) {
+		vpninfo.ip_info.mtu = 1280 + rand() % 221;
+		for (v6 = 0; v6 < 2; v6++) {
+			/* Even and odd offsets, after any NOPs */
+			for (ofs = 20; ofs <= 24; ofs++) {
+				if (test_clamp(&vpninfo, pkt, v6, ofs, TCP_FLAG_SYN) ||
+				    test_clamp(&vpninfo, pkt, v6, ofs, TCP_FLAG_SYN | TCP_FLAG_ACK) ||
+				    test_clamp(&vpninfo, pkt, v6, ofs, TCP_FLAG_ACK))
+					ret = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < NR_ITERS; i++) {
+		mss = 536 + rand() % 925;
+		for (v6 = 0; v6 < 2; v6++) {
+			int hdrlen = iphdr_len(v6) + 32;
+
+			/* Anything up to the biggest super-packet, and an
+			   exact multiple of the MSS */
+			if (test_gso(&vpninfo, out, v6, mss,
+				     1 + rand() % (TUN_GSO_MAX - hdrlen)) ||
+			    test_gso(&vpninfo, out, v6, mss,
+				     mss * (1 + rand() % ((TUN_GSO_MAX - hdrlen) / mss))))
+				ret = 1;
+		}
+	}
+
+	free(out);
+	free(pkt);
+	return ret;
+}
@@ -0,0 +1,202 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define __OPENCONNECT_INTERNAL_H__
+
+#define SPLIT_INCLUDE 1
+
+#include "../split-trie.c"
+
+/*
+ * Check split_trie_lookup() against a linear longest-prefix match over
+ * random prefixes for IPv4 and IPv6. With '-b', also report lookups per
+ * second for a range of table sizes.
+ */
+
+struct prefix {
+	unsigned char addr[16];
+	int plen;
+	unsigned char val;
+};
+
+static void random_addr(unsigned char *addr, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		addr[i] = rand();
+}
+
+/* Mostly /16 to /24 for IPv4 (/64 to /96 for IPv6), as split lists are */
+static void random_prefix(struct prefix *p, int bits)
+{
+	int i;
+
+	random_addr(p->addr, bits / 8);
+	if (rand() % 8)
+		p->plen = bits / 2 + rand() % (bits / 4 + 1);
+	else
+		p->plen = rand() % (bits + 1);
+	for (i = p->plen; i < bits; i++)
+		p->addr[i / 8] &= ~(0x80 >> (i % 8));
+	p->val = 1 + rand() % 2;
+}
+
+static int match(const struct prefix *p, const unsigned char *addr)
+{
+	int i;
+
+	for (i = 0; i < p->plen; i++) {
+		if ((p->addr[i / 8] ^ addr[i / 8]) & (0x80 >> (i % 8)))
+			return 0;
+	}
+	return 1;
+}
+
+static int linear_lookup(const struct prefix *p, int nr, const unsigned char *addr)
+{
+	int i, best = -1, val = 0;
+
+	/* Later entries win for the same prefix, as with the trie */
+	for (i = 0; i < nr; i++) {
+		if (p[i].plen >= best && match(&p[i], addr)) {
+			best = p[i].plen;
+			val = p[i].val;
+		}
+	}
+	return val;
+}
+
+static struct split_trie *build(struct prefix *p, int nr, int bits)
+{
+	struct split_trie *t = split_trie_new(bits);
+	int i;
+
+	if (!t) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(1);
+	}
+	for (i = 0; i < nr; i++) {
+		if (split_trie_insert(t, p[i].addr, p[i].plen, p[i].val)) {
+			fprintf(stderr, "Insert failed\n");
+			exit(1);
+		}
+	}
+	if (split_trie_compile(t)) {
+		fprintf(stderr, "Compile failed\n");
+		exit(1);
+	}
+	return t;
+}
+
+static void check(int bits, int nr)
+{
+	struct prefix *p = calloc(nr, sizeof(*p));
+	struct split_trie *t;
+	unsigned char addr[16];
+	int i, j;
+
+	for (i = 0; i < nr; i++)
+		random_prefix(&p[i], bits);
+	t = build(p, nr, bits);
+
+	for (i = 0; i < 20000; i++) {
+		/* Half of them inside a known prefix, maybe a more specific one */
+		random_addr(addr, bits / 8);
+		if (nr && (i & 1)) {
+			const struct prefix *q = &p[rand() % nr];
+
+			for (j = 0; j < q->plen; j++) {
+				addr[j / 8] &= ~(0x80 >> (j % 8));
+				addr[j / 8] |= q->addr[j / 8] & (0x80 >> (j % 8));
+			}
+		}
+		if (split_trie_lookup(t, addr) != linear_lookup(p, nr, addr)) {
+			fprintf(stderr, "IPv%d lookup %d mismatch with %d prefixes\n",
+				bits == 32 ? 4 : 6, i, nr);
+			exit(1);
+		}
+	}
+	split_trie_free(t);
+	free(p);
+}
+
+#define BENCH_ADDRS 65536
+
+static void bench(int bits, int nr)
+{
+	struct prefix *p = calloc(nr, sizeof(*p));
+	unsigned char *addrs = malloc(BENCH_ADDRS * 16);
+	struct split_trie *t;
+	struct timespec start, end;
+	unsigned long lookups = 0, hits = 0;
+	double secs;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		random_prefix(&p[i], bits);
+	t = build(p, nr, bits);
+
+	for (i = 0; i < BENCH_ADDRS; i++) {
+		memcpy(addrs + i * 16, p[rand() % nr].addr, 16);
+		addrs[i * 16 + bits / 8 - 1] = rand();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (i = 0; i < BENCH_ADDRS; i++)
+			hits += split_trie_lookup(t, addrs + i * 16) == SPLIT_INCLUDE;
+		lookups += BENCH_ADDRS;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	} while (secs < 0.5);
+
+	printf("IPv%d %7d prefixes: %7lu KiB, %6.1f M lookups/s (%lu hits)\n",
+	       bits == 32 ? 4 : 6, nr, (unsigned long)split_trie_size(t) / 1024,
+	       lookups / secs / 1e6, hits);
+
+	split_trie_free(t);
+	free(addrs);
+	free(p);
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 0, 1, 10, 100, 1000 };
+	int i;
+
+	srand(0xdeadbeef);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		check(32, sizes[i]);
+		check(128, sizes[i]);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "-b")) {
+		static const int bench_sizes[] = { 100, 1000, 10000, 20000, 100000 };
+
+		for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+			bench(32, bench_sizes[i]);
+			bench(128, bench_sizes[i]);
+		}
+	}
+	return 0;
+}
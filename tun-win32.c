@@ -379,6 +379,12 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 	return -1;
 }
 
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
+{
+	/* Left to the vpnc-script, which uses netsh */
+	return -EOPNOTSUPP;
+}
+
 void os_shutdown_tun(struct openconnect_info *vpninfo)
 {
 	script_config_tun(vpninfo, "disconnect");
@@ -394,7 +400,7 @@ int openconnect_setup_tun_fd(struct openconnect_info *vpninfo, intptr_t tun_fd)
 	vpninfo->tun_rd_overlap.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
 	monitor_read_fd(vpninfo, tun);
 
-	return 0;
+	return setup_split_policy(vpninfo);
 }
 
 int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
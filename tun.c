@@ -69,6 +69,16 @@
 #define TUN_HAS_AF_PREFIX 1
 #endif
 
+/*
+ * Linux can exchange TCP super-packets of up to 64KiB with us, each with
+ * a virtio_net_hdr prefix describing how to segment it and what checksum
+ * is still needed. See gso.c for the segmentation and coalescing.
+ */
+#if defined(IFF_VNET_HDR) && defined(TUNSETOFFLOAD)
+#include <linux/virtio_net.h>
+#define TUN_HAS_VNET_HDR 1
+#endif
+
 #ifdef __sun__
 #include <stropts.h>
 #include <sys/sockio.h>
@@ -245,6 +255,10 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 	}
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+#ifdef TUN_HAS_VNET_HDR
+	if (vpninfo->tun_offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+#endif
 	if (vpninfo->ifname)
 		ifreq_set_ifname(vpninfo, &ifr);
 	if (ioctl(tun_fd, TUNSETIFF, (void *) &ifr) < 0) {
@@ -263,6 +277,21 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 	if (!vpninfo->ifname)
 		vpninfo->ifname = strdup(ifr.ifr_name);
 
+#ifdef TUN_HAS_VNET_HDR
+	if (vpninfo->tun_offload) {
+		/* The header is there even if the kernel won't do offload */
+		vpninfo->tun_vnet_hdr = 1;
+		if (ioctl(tun_fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0)
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to enable tun offload (TUNSETOFFLOAD): %s\n"),
+				     strerror(errno));
+		else
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Enabled TSO and checksum offload on %s\n"),
+				     vpninfo->ifname);
+	}
+#endif
+
 	/* Ancient vpnc-scripts might not get this right */
 	set_tun_mtu(vpninfo);
 
@@ -462,7 +491,7 @@ int openconnect_setup_tun_fd(struct openconnect_info *vpninfo, int tun_fd)
 
 	set_sock_nonblock(tun_fd);
 
-	return 0;
+	return setup_split_policy(vpninfo);
 }
 
 int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
@@ -500,6 +529,82 @@ int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
 	return openconnect_setup_tun_fd(vpninfo, fds[0]);
 }
 
+#ifdef TUN_HAS_VNET_HDR
+static int vnet_read_hdr(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	struct virtio_net_hdr vh;
+
+	memcpy(&vh, pkt->data - sizeof(vh), sizeof(vh));
+
+	switch (vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_NONE:
+		break;
+
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		/* gso_segment() will fill in all the checksums later */
+		if (!vh.gso_size)
+			return -1;
+		pkt->gso_size = vh.gso_size;
+		return 0;
+
+	default:
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Unsupported GSO type %d from tun device\n"),
+			     vh.gso_type);
+		return -1;
+	}
+
+	/* The kernel left the checksum for us to finish; it has put the
+	   pseudo-header sum into the checksum field already. */
+	if (vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		int start = vh.csum_start, ofs = start + vh.csum_offset;
+
+		if (ofs + 2 > pkt->len)
+			return -1;
+
+		store_be16(pkt->data + ofs,
+			   ~csum_fold(csum_partial(pkt->data + start, pkt->len - start, 0)));
+	}
+	return 0;
+}
+
+/* Merge any following segments of the same TCP flow into one GSO packet,
+   and prepend the virtio_net_hdr. Returns the number of packets from the
+   incoming queue which were used, in addition to 'pkt'. */
+static int vnet_write_hdr(struct openconnect_info *vpninfo, struct pkt **pkt)
+{
+	struct virtio_net_hdr vh;
+	struct pkt *gro = vpninfo->tun_gro_pkt;
+	int nsegs = 0;
+
+	memset(&vh, 0, sizeof(vh));
+
+	if (!gro && vpninfo->incoming_queue.head) {
+		gro = malloc(sizeof(struct pkt) + TUN_GSO_MAX);
+		vpninfo->tun_gro_pkt = gro;
+	}
+	if (gro)
+		nsegs = gro_coalesce(vpninfo, *pkt, gro);
+
+	if (nsegs) {
+		int iphl = ((gro->data[0] >> 4) == 4) ? 20 : 40;
+
+		vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vh.gso_type = (iphl == 20) ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+		vh.gso_size = gro->gso_size;
+		vh.hdr_len = iphl + (gro->data[iphl + 12] >> 4) * 4;
+		vh.csum_start = iphl;
+		vh.csum_offset = 16;
+		*pkt = gro;
+		nsegs--;
+	}
+
+	memcpy((*pkt)->data - sizeof(vh), &vh, sizeof(vh));
+	return nsegs;
+}
+#endif
+
 int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
 	int prefix_size = 0;
@@ -509,6 +614,10 @@ int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 	if (!vpninfo->script_tun)
 		prefix_size = sizeof(int);
 #endif
+#ifdef TUN_HAS_VNET_HDR
+	if (vpninfo->tun_vnet_hdr)
+		prefix_size = sizeof(struct virtio_net_hdr);
+#endif
 
 	/* Sanity. Just non-blocking reads on a select()able file descriptor... */
 	len = read(vpninfo->tun_fd, pkt->data - prefix_size, pkt->len + prefix_size);
@@ -516,6 +625,11 @@ int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 		return -1;
 
 	pkt->len = len - prefix_size;
+
+#ifdef TUN_HAS_VNET_HDR
+	if (vpninfo->tun_vnet_hdr)
+		return vnet_read_hdr(vpninfo, pkt);
+#endif
 	return 0;
 }
 
@@ -523,6 +637,15 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
 	unsigned char *data = pkt->data;
 	int len = pkt->len;
+	int merged = 0;
+
+#ifdef TUN_HAS_VNET_HDR
+	if (vpninfo->tun_vnet_hdr) {
+		merged = vnet_write_hdr(vpninfo, &pkt);
+		data = pkt->data - sizeof(struct virtio_net_hdr);
+		len = pkt->len + sizeof(struct virtio_net_hdr);
+	}
+#endif
 
 #ifdef TUN_HAS_AF_PREFIX
 	if (!vpninfo->script_tun) {
@@ -566,10 +689,31 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 			     _("Failed to write incoming packet: %s\n"),
 			     strerror(errno));
 	}
+
+	/* The segments which were coalesced into 'pkt' are done with too */
+	while (merged--) {
+		struct pkt *this = dequeue_packet(&vpninfo->incoming_queue);
+
+		vpninfo->stats.rx_pkts++;
+		vpninfo->stats.rx_bytes += this->len;
+		free(this);
+	}
 	return 0;
 
 }
 
+/* When the MTU changes during the session */
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
+{
+#if defined(__sun__) || defined(__native_client__)
+	return -EOPNOTSUPP;
+#else
+	if (vpninfo->script_tun || !vpninfo->ifname)
+		return -EINVAL;
+	return set_tun_mtu(vpninfo);
+#endif
+}
+
 void os_shutdown_tun(struct openconnect_info *vpninfo)
 {
 	if (vpninfo->script_tun) {
@@ -587,7 +731,13 @@ void os_shutdown_tun(struct openconnect_info *vpninfo)
 #endif
 	}
 
-	if (vpninfo->vpnc_script)
+	/* Otherwise the application gave us the fd, and still owns it */
+	if (vpninfo->vpnc_script
+#ifdef HAVE_LINUX_RTNETLINK_H
+	    || vpninfo->netlink_config
+#endif
+	    )
 		close(vpninfo->tun_fd);
 	vpninfo->tun_fd = -1;
+	vpninfo->tun_vnet_hdr = 0;
 }
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
 
 #include "openconnect-internal.h"
 
@@ -211,3 +212,177 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 
 	return 0;
 }
+
+#define FASTEST_HOST_TTL	3600	/* Seconds to trust the last ranking */
+
+/* The cache holds the SHA1 of the XML config and when it was probed on
+   the first line, and the name of the fastest host on the second. */
+static char *read_fastest_cache(struct openconnect_info *vpninfo,
+				const char *cache_file, const char *sha1)
+{
+	char line[80], name[256], hash[SHA1_SIZE * 2 + 1];
+	time_t now = time(NULL);
+	char *ret = NULL;
+	long when;
+	FILE *f;
+
+	f = openconnect_fopen_utf8(vpninfo, cache_file, "r");
+	if (!f)
+		return NULL;
+
+	if (fgets(line, sizeof(line), f) && fgets(name, sizeof(name), f) &&
+	    sscanf(line, "%40s %ld", hash, &when) == 2 && !strcmp(hash, sha1) &&
+	    when <= now && now - when < FASTEST_HOST_TTL) {
+		name[strcspn(name, "\r\n")] = 0;
+		if (name[0])
+			ret = strdup(name);
+	}
+	fclose(f);
+	return ret;
+}
+
+static void write_fastest_cache(struct openconnect_info *vpninfo,
+				const char *cache_file, const char *sha1,
+				const char *name)
+{
+	FILE *f = openconnect_fopen_utf8(vpninfo, cache_file, "w");
+
+	if (!f) {
+		fprintf(stderr, _("Failed to open %s for write: %s\n"),
+			cache_file, strerror(errno));
+		return;
+	}
+	fprintf(f, "%s %ld\n%s\n", sha1, (long)time(NULL), name);
+	fclose(f);
+}
+
+/* Connect to every host in the XML config's ServerList at once, and
+   return the HostName of the one which answered first, or NULL. */
+char *config_fastest_host(struct openconnect_info *vpninfo, const char *cache_file)
+{
+	unsigned char sha1[SHA1_SIZE];
+	char sha1_hex[SHA1_SIZE * 2 + 1];
+	char **names = NULL, **addrs = NULL, *ret = NULL;
+	uint64_t *rtt = NULL;
+	int i, nr = 0, best = -1;
+	ssize_t size;
+	char *xmlfile;
+	xmlDocPtr xml_doc;
+	xmlNode *xml_node, *xml_node2;
+
+	/* We'd only be timing the connection to the proxy */
+	if (vpninfo->proxy) {
+		fprintf(stderr, _("Cannot find the fastest host through a proxy\n"));
+		return NULL;
+	}
+
+	size = read_file_into_string(vpninfo, vpninfo->xmlconfig, &xmlfile);
+	if (size <= 0)
+		return NULL;
+
+	if (openconnect_sha1(sha1, xmlfile, size)) {
+		free(xmlfile);
+		return NULL;
+	}
+	for (i = 0; i < SHA1_SIZE; i++)
+		snprintf(&sha1_hex[i*2], 3, "%02x", sha1[i]);
+
+	if (cache_file) {
+		ret = read_fastest_cache(vpninfo, cache_file, sha1_hex);
+		if (ret) {
+			printf(_("Using host \"%s\", which was fastest last time\n"), ret);
+			free(xmlfile);
+			return ret;
+		}
+	}
+
+	xml_doc = xmlReadMemory(xmlfile, size, "noname.xml", NULL, 0);
+	free(xmlfile);
+	if (!xml_doc) {
+		fprintf(stderr, _("Failed to parse XML config file %s\n"),
+			vpninfo->xmlconfig);
+		return NULL;
+	}
+
+	xml_node = xmlDocGetRootElement(xml_doc);
+	for (xml_node = xml_node->children; xml_node; xml_node = xml_node->next) {
+		if (xml_node->type != XML_ELEMENT_NODE ||
+		    strcmp((char *)xml_node->name, "ServerList"))
+			continue;
+
+		for (xml_node = xml_node->children; xml_node; xml_node = xml_node->next) {
+			char *name = NULL, *addr = NULL;
+			void *new;
+
+			if (xml_node->type != XML_ELEMENT_NODE ||
+			    strcmp((char *)xml_node->name, "HostEntry"))
+				continue;
+
+			for (xml_node2 = xml_node->children; xml_node2; xml_node2 = xml_node2->next) {
+				if (xml_node2->type != XML_ELEMENT_NODE)
+					continue;
+				if (!name && !strcmp((char *)xml_node2->name, "HostName"))
+					name = fetch_and_trim(xml_node2);
+				else if (!addr && !strcmp((char *)xml_node2->name, "HostAddress"))
+					addr = fetch_and_trim(xml_node2);
+			}
+			/* Without a HostAddress, the HostName is used to connect */
+			if (name && !addr)
+				addr = strdup(name);
+			if (!name || !addr) {
+				free(name);
+				free(addr);
+				continue;
+			}
+
+			new = realloc(names, (nr + 1) * sizeof(*names));
+			if (new) {
+				names = new;
+				new = realloc(addrs, (nr + 1) * sizeof(*addrs));
+			}
+			if (!new) {
+				free(name);
+				free(addr);
+				break;
+			}
+			addrs = new;
+			names[nr] = name;
+			addrs[nr] = addr;
+			nr++;
+		}
+		break;
+	}
+	xmlFreeDoc(xml_doc);
+
+	if (!nr) {
+		fprintf(stderr, _("No hosts listed in XML config file %s\n"),
+			vpninfo->xmlconfig);
+		goto out;
+	}
+
+	rtt = calloc(nr, sizeof(*rtt));
+	if (!rtt || openconnect_probe_servers(vpninfo, addrs, nr, rtt) <= 0) {
+		fprintf(stderr, _("None of the hosts in the XML config could be reached\n"));
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (rtt[i] && (best < 0 || rtt[i] < rtt[best]))
+			best = i;
+	}
+	printf(_("Host \"%s\" is fastest (%lu ms)\n"), names[best],
+	       (unsigned long)(rtt[best] / 1000));
+
+	ret = strdup(names[best]);
+	if (ret && cache_file)
+		write_fastest_cache(vpninfo, cache_file, sha1_hex, ret);
+ out:
+	for (i = 0; i < nr; i++) {
+		free(names[i]);
+		free(addrs[i]);
+	}
+	free(names);
+	free(addrs);
+	free(rtt);
+	return ret;
+}